@@ -77,13 +77,26 @@ let
         cmakeFlags = (args.cmakeFlags or [ ])
           ++ cmakeFlags
           ++ [ "-GNinja" ]
-          ++ [ "-DCPM_USE_LOCAL_PACKAGES=ON" ]  # Try find_package before downloading
-          ++ (lib.optional (cmakeArtifacts != null) "-DCMAKE_PREFIX_PATH=${cmakeArtifacts}");
+          ++ [ "-DCPM_USE_LOCAL_PACKAGES=ON" ];  # Try find_package before downloading
 
-        # If we have artifacts, we might want to copy them in or use a specific build dir
+        # Seed the build tree with what buildDepsOnly built. Configure leaves the files it
+        # would write identically alone, so the build finds those targets up to date.
         preConfigure = (args.preConfigure or "") + lib.optionalString (cmakeArtifacts != null) ''
-          # If we have incremental artifacts, we might want to seed the build directory
-          # This is a simplified version; a full implementation would use --preset or similar.
+          mkdir -p "''${cmakeBuildDir:-build}"
+          cp -a --no-preserve=ownership ${cmakeArtifacts}/. "''${cmakeBuildDir:-build}/"
+          chmod -R u+w "''${cmakeBuildDir:-build}"
+        '';
+
+        # Seeding only pays off if ninja agrees the dependency targets are up to date, which
+        # needs the same flags, sources and timestamps as buildDepsOnly. Say so when it doesn't.
+        preBuild = (args.preBuild or "") + lib.optionalString (cmakeArtifacts != null) ''
+          if [[ -s .cmake2nix-deps-targets ]]; then
+            staleSteps=$(ninja -n $(< .cmake2nix-deps-targets) 2>&1 | grep -c '^\[' || true)
+            if (( staleSteps > 0 )); then
+              echo "warning: $staleSteps dependency build steps out of date after seeding" \
+                "from cmakeArtifacts; ninja will rebuild them" >&2
+            fi
+          fi
         '';
       };
 
@@ -91,25 +104,51 @@ let
     pkgs.stdenv.mkDerivation finalAttrs;
 
   /*
-    buildDepsOnly creates a derivation that builds only the dependencies of a project.
+    buildDepsOnly builds the FetchContent targets the project depends on, and nothing
+    of the project itself. Its output holds just their objects and artifacts plus the
+    ninja logs; pass it as cmakeArtifacts to buildCMakePackage to reuse them.
+    `cmake2nix deps-targets` picks the targets from the File API codemodel.
   */
-  buildDepsOnly = { src, ... } @ args:
-    buildCMakePackage (args // {
+  buildDepsOnly = { src, cmake2nix ? pkgs.cmake2nix or (throw "buildDepsOnly needs cmake2nix"), ... } @ args:
+    buildCMakePackage (builtins.removeAttrs args [ "cmake2nix" ] // {
       pname = "${args.pname or "project"}-deps";
-      # We use a dummy configure/build that triggers dependency fetching but doesn't build the main app
-      # This is project-specific but we can try a generic approach by setting a flag
-      cmakeFlags = (args.cmakeFlags or [ ]) ++ [ "-DNIX_CMAKE_BUILD_DEPS_ONLY=1" ];
 
-      # We override the build phase to only build the dependencies
-      # In many projects, this means just configuring or building specific targets
+      nativeBuildInputs = (args.nativeBuildInputs or [ ]) ++ [ cmake2nix ];
+
+      preConfigure = (args.preConfigure or "") + ''
+        mkdir -p "''${cmakeBuildDir:-build}/.cmake/api/v1/query"
+        touch "''${cmakeBuildDir:-build}/.cmake/api/v1/query/codemodel-v2"
+      '';
+
       buildPhase = args.buildPhase or ''
-        cmake --build . --target all # Or a more discovery-based approach
+        runHook preBuild
+        depsTargets=$(cmake2nix deps-targets .cmake/api/v1/reply)
+        if [[ -n "$depsTargets" ]]; then
+          echo "Building dependency targets:" $depsTargets
+          cmake --build . --parallel "''${NIX_BUILD_CORES:-1}" --target $depsTargets
+        else
+          echo "No dependency targets to build"
+        fi
+        runHook postBuild
       '';
 
       installPhase = ''
+        runHook preInstall
         mkdir -p $out
-        cp -r . $out/
+        cmake2nix deps-targets --outputs .cmake/api/v1/reply > "$NIX_BUILD_TOP/deps-outputs"
+        cmake2nix deps-targets .cmake/api/v1/reply > .cmake2nix-deps-targets
+        echo .cmake2nix-deps-targets >> "$NIX_BUILD_TOP/deps-outputs"
+        for log in .ninja_log .ninja_deps; do
+          if [[ -e $log ]]; then
+            echo "$log" >> "$NIX_BUILD_TOP/deps-outputs"
+          fi
+        done
+        xargs -d '\n' -r cp -a --parents -t "$out" < "$NIX_BUILD_TOP/deps-outputs"
+        runHook postInstall
       '';
+
+      # Byte-identical objects and timestamps are what make them reusable
+      dontFixup = true;
     });
 
 in
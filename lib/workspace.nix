@@ -13,6 +13,7 @@ let
     , cmakeToolchainFile ? (pkgs.callPackage ../pkgs/cmake-toolchain-hook/cmake-toolchain.nix { } pkgs.stdenv)
     , cmakeDependencyHookFile ? ../pkgs/cmake-dependency-hook/cmakeBuildHook.cmake
     , recursive ? false
+    , cmake2nix ? pkgs.cmake2nix or null # Summarizes the reply, see extractFromCodemodel
     }:
     let
       # Setup File API query
@@ -30,7 +31,9 @@ let
         name = "cmake-discovery";
         inherit src;
 
-        nativeBuildInputs = [ cmake pkgs.git pkgs.cacert pkgs.ninja ] ++ nativeBuildInputs;
+        nativeBuildInputs = [ cmake pkgs.git pkgs.cacert pkgs.ninja ]
+          ++ lib.optional (cmake2nix != null) cmake2nix
+          ++ nativeBuildInputs;
 
         dontBuild = true;
         dontInstall = true;
@@ -59,6 +62,8 @@ let
           mkdir -p $out/reply
           if [ -d build/.cmake/api/v1/reply ]; then
             cp -r build/.cmake/api/v1/reply/* $out/reply/
+            ${lib.optionalString (cmake2nix != null)
+              "cmake2nix codemodel build/.cmake/api/v1/reply $out/codemodel.json || true"}
           fi
         '';
 
@@ -77,9 +82,30 @@ let
     let content = builtins.readFile path;
     in builtins.fromJSON (builtins.unsafeDiscardStringContext content);
 
+  /*
+    extractFromCodemodel returns the targets of a File API reply as
+    { name, id, type, imported, linkDependencies, sources }.
+
+    Given a summary written by `cmake2nix codemodel` (JSON, or a .nix file),
+    for example one checked in next to the lock file, that is plain data. Given
+    a configured output it reads the summary discoverDependencies wrote, or,
+    without one, the reply itself: the index, the codemodel and every target.
+  */
   extractFromCodemodel = configured:
     let
-      replyDir = "${configured}/reply";
+      isSummary = lib.hasSuffix ".json" (toString configured)
+        || lib.hasSuffix ".nix" (toString configured);
+      summaryPath = if isSummary then configured else "${configured}/codemodel.json";
+      summary =
+        if lib.hasSuffix ".nix" (toString summaryPath) then import summaryPath
+        else readJSON summaryPath;
+    in
+    if isSummary || builtins.pathExists summaryPath then summary.targets
+    else extractFromReply "${configured}/reply";
+
+  # One readJSON per target: slow for large projects, see `cmake2nix codemodel`
+  extractFromReply = replyDir:
+    let
       indexFiles = builtins.attrNames (builtins.readDir replyDir);
       indexFile = lib.findFirst (f: lib.hasPrefix "index-" f) null indexFiles;
 
@@ -103,16 +129,31 @@ let
         if (codemodel == null || builtins.length codemodel.configurations == 0) then [ ]
         else (builtins.elemAt codemodel.configurations 0).targets;
 
+      infos = builtins.listToAttrs (map
+        (t: { name = t.id; value = readJSON "${replyDir}/${t.jsonFile}"; })
+        targets);
+
+      isLibrary = id: infos ? ${id} && lib.hasSuffix "_LIBRARY" infos.${id}.type;
+
+      # As `cmake2nix codemodel`: linkLibraries where the codemodel has it,
+      # otherwise the libraries built first
+      linkIds = info:
+        if info ? linkLibraries then lib.concatMap (l: lib.optional (l ? id) l.id) info.linkLibraries
+        else lib.filter isLibrary (map (d: d.id) (info.dependencies or [ ]));
+
     in
     map
       (t:
         let
-          info = readJSON "${replyDir}/${t.jsonFile}";
+          info = infos.${t.id};
         in
         {
           inherit (t) name id;
           inherit (info) type;
           imported = info.imported or false;
+          linkDependencies = map (id: infos.${id}.name)
+            (lib.filter (id: infos ? ${id}) (linkIds info));
+          sources = map (s: s.path) (info.sources or [ ]);
         }
       )
       targets;
@@ -169,6 +210,9 @@ let
       cpmLockPath = workspaceRoot + "/package-lock.cmake";
       hasCPMLock = builtins.pathExists cpmLockPath;
 
+      # Targets summarized by `cmake2nix codemodel`, if checked in
+      codemodelPath = workspaceRoot + "/cmake-codemodel.json";
+
       # Load the appropriate lock file
       lock =
         if hasCMakeLock then
@@ -201,6 +245,10 @@ let
       workspace = rec {
         inherit workspaceRoot lock;
 
+        targets =
+          if builtins.pathExists codemodelPath then extractFromCodemodel codemodelPath
+          else [ ];
+
         # Create overlay that provides all dependencies as CMake packages
         mkCMakeOverlay = { sourcePreference ? "source" }:
           mkProjectOverlay {
@@ -1,4 +1,8 @@
-{ lib, writeShellScript, stdenv }:
+{ lib, writeShellScript, stdenv
+  # Use nix-compiler-launcher / nix-linker-launcher (pkgs/cmake2nix/src/launcher.cpp)
+  # instead of the bash scripts: no shell startup per translation unit
+, useNativeLaunchers ? stdenv.hostPlatform == stdenv.buildPlatform
+}:
 
 let
   inherit (stdenv) hostPlatform;
@@ -23,6 +27,48 @@ let
     ];
   };
 
+  compilerFlags =
+    map (path: "-I${path}") nixIncludePaths
+    ++ map (path: "-L${path}") nixLibraryPaths
+    ++ lib.optional hostPlatform.isDarwin "-mmacosx-version-min=${hostPlatform.darwinMinVersion}";
+
+  linkerFlags =
+    map (path: "-L${path}") nixLibraryPaths
+    ++ map (path: "-Wl,-rpath,${path}") nixLibraryPaths
+    ++ (platformFlags.commonLinkerFlags or []);
+
+  # The same flags as the scripts below, baked in as launcher-config.hpp. Compiled
+  # directly rather than through cmake2nix's CMake build: that build uses these
+  # launchers, and the launcher needs nothing but libc.
+  cStringList = flags: lib.concatMapStrings (flag: "${builtins.toJSON flag}, ") flags;
+
+  nativeLaunchers = stdenv.mkDerivation {
+    name = "nix-cmake-launchers";
+    src = ../cmake2nix/src/launcher.cpp;
+    dontUnpack = true;
+
+    launcherConfig = ''
+      #pragma once
+      #define CMAKE2NIX_LAUNCHER_COMPILE_FLAGS ${cStringList compilerFlags}
+      #define CMAKE2NIX_LAUNCHER_LINK_FLAGS ${cStringList linkerFlags}
+    '';
+    passAsFile = [ "launcherConfig" ];
+
+    buildPhase = ''
+      runHook preBuild
+      cp "$launcherConfigPath" launcher-config.hpp
+      $CXX -std=c++20 -O2 -I. -o nix-compiler-launcher "$src"
+      $CXX -std=c++20 -O2 -I. -DCMAKE2NIX_LAUNCHER_LINK -o nix-linker-launcher "$src"
+      runHook postBuild
+    '';
+
+    installPhase = ''
+      runHook preInstall
+      install -Dm755 -t "$out/bin" nix-compiler-launcher nix-linker-launcher
+      runHook postInstall
+    '';
+  };
+
 in
 {
   cCompilerLauncher = writeShellScript "nix-gcc-launcher" ''
@@ -47,6 +93,11 @@ in
       echo "NIX CMAKE COMPILER LAUNCHER: $compiler ''${nix_flags[@]} $@" >&2
     fi
     
+    # Opt-in compile cache (see cmake2nix compile)
+    if [[ -n "''${NIX_CMAKE_COMPILE_CACHE:-}" ]] && type -P cmake2nix >/dev/null; then
+      exec cmake2nix compile "$compiler" "''${nix_flags[@]}" "$@"
+    fi
+    
     exec "$compiler" "''${nix_flags[@]}" "$@"
   '';
 
@@ -72,6 +123,11 @@ in
       echo "NIX CMAKE COMPILER LAUNCHER: $compiler ''${nix_flags[@]} $@" >&2
     fi
     
+    # Opt-in compile cache (see cmake2nix compile)
+    if [[ -n "''${NIX_CMAKE_COMPILE_CACHE:-}" ]] && type -P cmake2nix >/dev/null; then
+      exec cmake2nix compile "$compiler" "''${nix_flags[@]}" "$@"
+    fi
+    
     exec "$compiler" "''${nix_flags[@]}" "$@"
   '';
 
@@ -126,4 +182,10 @@ in
     
     exec "$compiler" "''${nix_flags[@]}" "$@"
   '';
+} // lib.optionalAttrs useNativeLaunchers {
+  cCompilerLauncher = "${nativeLaunchers}/bin/nix-compiler-launcher";
+  cxxCompilerLauncher = "${nativeLaunchers}/bin/nix-compiler-launcher";
+  cLinkerLauncher = "${nativeLaunchers}/bin/nix-linker-launcher";
+  cxxLinkerLauncher = "${nativeLaunchers}/bin/nix-linker-launcher";
+  inherit nativeLaunchers;
 }
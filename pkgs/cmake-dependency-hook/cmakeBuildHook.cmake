@@ -13,26 +13,106 @@ cmake_minimum_required(VERSION 3.24)
 # directly, which bypasses the dependency provider entirely. FetchContent_Populate()
 # does check FETCHCONTENT_SOURCE_DIR_<UPPERCASENAME> CMake cache variables, so we
 # set those from environment variables here to support both interception methods.
-execute_process(
-    COMMAND ${CMAKE_COMMAND} -E environment
-    OUTPUT_VARIABLE _all_env_vars
-    OUTPUT_STRIP_TRAILING_WHITESPACE
-)
-string(REPLACE "\n" ";" _env_var_list "${_all_env_vars}")
-foreach(_env_line IN LISTS _env_var_list)
-    if(_env_line MATCHES "^(FETCHCONTENT_SOURCE_DIR_[^=]+)=(.*)$")
-        set(_var_name "${CMAKE_MATCH_1}")
-        set(_var_value "${CMAKE_MATCH_2}")
-        message(STATUS "Nix: Setting ${_var_name} from environment to ${_var_value}")
-        set(${_var_name} "${_var_value}" CACHE PATH "Nix-provided source directory" FORCE)
+#
+# The source directories and the dependency search paths further down come from a
+# manifest when the setup hook could write one before configure
+# (`cmake2nix deps-manifest`, see default.nix): there they are already classified and
+# de-duplicated. Without one, the environment and the store are probed here instead.
+if(NOT DEFINED NIX_HOST_OFFSET)
+    set(NIX_HOST_OFFSET 0)
+endif()
+if(NOT DEFINED NIX_TARGET_OFFSET)
+    set(NIX_TARGET_OFFSET 0)
+endif()
+
+set(_nix_deps_manifest FALSE)
+if(DEFINED ENV{NIX_CMAKE_DEPS_MANIFEST} AND EXISTS "$ENV{NIX_CMAKE_DEPS_MANIFEST}")
+    include("$ENV{NIX_CMAKE_DEPS_MANIFEST}")
+    if(NIX_DEPS_MANIFEST_VERSION EQUAL 1 AND
+       NIX_DEPS_HOST_OFFSET EQUAL NIX_HOST_OFFSET AND
+       NIX_DEPS_TARGET_OFFSET EQUAL NIX_TARGET_OFFSET)
+        set(_nix_deps_manifest TRUE)
+        message(STATUS "Nix: Using dependency manifest $ENV{NIX_CMAKE_DEPS_MANIFEST}")
+    else()
+        message(STATUS "Nix: Ignoring dependency manifest $ENV{NIX_CMAKE_DEPS_MANIFEST} (other version or platform offsets)")
     endif()
-endforeach()
-unset(_all_env_vars)
-unset(_env_var_list)
-unset(_env_line)
+endif()
+
+if(_nix_deps_manifest)
+    set(_source_dirs "${NIX_DEPS_FETCHCONTENT_SOURCE_DIRS}")
+    while(_source_dirs)
+        list(POP_FRONT _source_dirs _var_name _var_value)
+        message(STATUS "Nix: Setting ${_var_name} from manifest to ${_var_value}")
+        set(${_var_name} "${_var_value}" CACHE PATH "Nix-provided source directory" FORCE)
+    endwhile()
+    unset(_source_dirs)
+else()
+    execute_process(
+        COMMAND ${CMAKE_COMMAND} -E environment
+        OUTPUT_VARIABLE _all_env_vars
+        OUTPUT_STRIP_TRAILING_WHITESPACE
+    )
+    string(REPLACE "\n" ";" _env_var_list "${_all_env_vars}")
+    foreach(_env_line IN LISTS _env_var_list)
+        if(_env_line MATCHES "^(FETCHCONTENT_SOURCE_DIR_[^=]+)=(.*)$")
+            set(_var_name "${CMAKE_MATCH_1}")
+            set(_var_value "${CMAKE_MATCH_2}")
+            message(STATUS "Nix: Setting ${_var_name} from environment to ${_var_value}")
+            set(${_var_name} "${_var_value}" CACHE PATH "Nix-provided source directory" FORCE)
+        endif()
+    endforeach()
+    unset(_all_env_vars)
+    unset(_env_var_list)
+    unset(_env_line)
+endif()
 unset(_var_name)
 unset(_var_value)
 
+# Package config directories of every dependency prefix, written by
+# `cmake2nix index-prefixes` (see default.nix), so find_package() needn't search
+if(DEFINED ENV{NIX_CMAKE_PACKAGE_INDEX} AND EXISTS "$ENV{NIX_CMAKE_PACKAGE_INDEX}")
+    include("$ENV{NIX_CMAKE_PACKAGE_INDEX}")
+    if(NIX_PACKAGE_INDEX_VERSION EQUAL 1)
+        message(STATUS "Nix: Using package index $ENV{NIX_CMAKE_PACKAGE_INDEX}")
+    else()
+        message(STATUS "Nix: Ignoring package index $ENV{NIX_CMAKE_PACKAGE_INDEX} (other version)")
+        unset(NIX_PACKAGE_INDEX_VERSION)
+    endif()
+endif()
+
+# Looks up <name> in the package index. Sets <result> to HIT (and <name>_DIR in the
+# caller) when an indexed prefix provides it, MISS when none does, KNOWN_MISS when the
+# same find_package() call already failed this configure, and "" without an index or
+# when <name>_DIR is already set.
+function(nix_package_index_lookup name args result)
+    set(${result} "" PARENT_SCOPE)
+    if(NOT NIX_PACKAGE_INDEX_VERSION EQUAL 1 OR ${name}_DIR)
+        return()
+    endif()
+    get_property(_missed GLOBAL PROPERTY NIX_PACKAGE_INDEX_MISSED_${name})
+    if(_missed AND "${_missed}" STREQUAL "(${args})")
+        set(${result} KNOWN_MISS PARENT_SCOPE)
+        return()
+    endif()
+
+    string(TOLOWER "${name}" _lower)
+    if(NOT DEFINED NIX_PACKAGE_INDEX_${_lower})
+        set(${result} MISS PARENT_SCOPE)
+        return()
+    endif()
+    # The index is keyed case-insensitively; <Name>Config.cmake is matched exactly
+    set(_dir "${NIX_PACKAGE_INDEX_${_lower}}")
+    if(EXISTS "${_dir}/${name}Config.cmake" OR EXISTS "${_dir}/${_lower}-config.cmake")
+        set(${name}_DIR "${_dir}" PARENT_SCOPE)
+        set(${result} HIT PARENT_SCOPE)
+    endif()
+endfunction()
+
+# After a failed search despite an index MISS, skip identical calls from now on
+function(nix_package_index_record_miss name args)
+    set_property(GLOBAL PROPERTY NIX_PACKAGE_INDEX_MISSED_${name} "(${args})")
+endfunction()
+
 # Track if the provider was actually used
 set_property(GLOBAL PROPERTY NIX_PROVIDER_TRIGGERED FALSE)
 
@@ -262,15 +342,26 @@ function(process_nix_dependencies hostOffset targetOffset)
     message(STATUS "Nix dependencies processed successfully")
 endfunction()
 
+# The manifest's lists, appended the way process_nix_dependencies() leaves them
+function(nix_apply_deps_manifest)
+    message(STATUS "Processing Nix dependencies from manifest")
+    foreach(_kind IN ITEMS PREFIX INCLUDE LIBRARY PROGRAM FRAMEWORK APPBUNDLE)
+        list(APPEND CMAKE_SYSTEM_${_kind}_PATH ${NIX_DEPS_${_kind}_PATH})
+        if(CMAKE_SYSTEM_${_kind}_PATH)
+            list(REMOVE_DUPLICATES CMAKE_SYSTEM_${_kind}_PATH)
+        endif()
+        string(TOLOWER "${_kind}" _kind_lower)
+        set(CMAKE_SYSTEM_${_kind}_PATH "${CMAKE_SYSTEM_${_kind}_PATH}" CACHE INTERNAL "System ${_kind_lower} paths from Nix")
+    endforeach()
+endfunction()
+
 # For native builds: process_nix_dependencies(0 0)
-if(NOT DEFINED NIX_HOST_OFFSET)
-    set(NIX_HOST_OFFSET 0)
-endif()
-if(NOT DEFINED NIX_TARGET_OFFSET)
-    set(NIX_TARGET_OFFSET 0)
+if(_nix_deps_manifest)
+    nix_apply_deps_manifest()
+else()
+    process_nix_dependencies("${NIX_HOST_OFFSET}" "${NIX_TARGET_OFFSET}")
 endif()
-
-process_nix_dependencies("${NIX_HOST_OFFSET}" "${NIX_TARGET_OFFSET}")
+unset(_nix_deps_manifest)
 
 message(STATUS "====== LOADED cmakeBuildHook.cmake ======")
 
@@ -323,6 +414,7 @@ if(CMAKE_VERSION VERSION_GREATER_EQUAL "3.24")
                     set(_git_repo "")
                     set(_git_tag "")
                     set(_url "")
+                    set(_url_hash "")
                     set(_source_dir "")
 
                     list(LENGTH _args _args_len)
@@ -338,6 +430,8 @@ if(CMAKE_VERSION VERSION_GREATER_EQUAL "3.24")
                                 set(_git_tag "${_value}")
                             elseif(_key STREQUAL "URL")
                                 set(_url "${_value}")
+                            elseif(_key STREQUAL "URL_HASH")
+                                set(_url_hash "${_value}")
                             elseif(_key STREQUAL "SOURCE_DIR")
                                 set(_source_dir "${_value}")
                             endif()
@@ -355,15 +449,23 @@ if(CMAKE_VERSION VERSION_GREATER_EQUAL "3.24")
                     if(_url)
                         string(JSON dep_json SET "${dep_json}" "url" "\"${_url}\"")
                     endif()
+                    if(_url_hash)
+                        # <ALGO>=<hex>, lets cmake2nix pin the archive without downloading it
+                        string(JSON dep_json SET "${dep_json}" "urlHash" "\"${_url_hash}\"")
+                    endif()
                     if(_source_dir)
                         string(JSON dep_json SET "${dep_json}" "sourceDir" "\"${_source_dir}\"")
                     endif()
 
+                    string(REPLACE "\n" " " dep_json_min "${dep_json}")
                     if(_discovery_log)
-                        string(REPLACE "\n" " " dep_json_min "${dep_json}")
                         file(APPEND "${_discovery_log}" "${dep_json_min}\n")
                         message(STATUS "Nix: Logged dependency ${dep_name}")
                     endif()
+                    # Also echo the entry into the build log: the log file lives inside the
+                    # build sandbox, but the build log streams to the caller while configure
+                    # is still running (cmake2nix starts prefetching from these lines)
+                    message(STATUS "cmake2nix-discovery: ${dep_json_min}")
 
                     set_property(GLOBAL PROPERTY NIX_DISCOVERY_LOGGED_${dep_name} TRUE)
                 endif()
@@ -402,7 +504,15 @@ if(CMAKE_VERSION VERSION_GREATER_EQUAL "3.24")
             endif()
 
             # Normal build mode logic
-            find_package(${dep_name} BYPASS_PROVIDER QUIET GLOBAL)
+            nix_package_index_lookup(${dep_name} "" _nix_index)
+            if(_nix_index STREQUAL "KNOWN_MISS")
+                set(${dep_name}_FOUND FALSE)
+            else()
+                find_package(${dep_name} BYPASS_PROVIDER QUIET GLOBAL)
+                if(NOT ${dep_name}_FOUND AND _nix_index STREQUAL "MISS")
+                    nix_package_index_record_miss(${dep_name} "")
+                endif()
+            endif()
 
             # Check if the package was found AND provides the expected targets
             set(_has_targets FALSE)
@@ -468,9 +578,21 @@ if(CMAKE_VERSION VERSION_GREATER_EQUAL "3.24")
             list(REMOVE_AT _find_args 0)  # Remove package name from args
             list(REMOVE_ITEM _find_args "REQUIRED")
             message(STATUS "Nix: Intercepting find_package(${dep_name})")
-            find_package(${dep_name} ${_find_args} PATHS ${CMAKE_SYSTEM_PREFIX_PATH} NO_DEFAULT_PATH BYPASS_PROVIDER GLOBAL)
-            if(NOT ${dep_name}_FOUND)
-                find_package(${dep_name} ${_find_args} BYPASS_PROVIDER GLOBAL)
+            nix_package_index_lookup(${dep_name} "${_find_args}" _nix_index)
+            if(_nix_index STREQUAL "KNOWN_MISS")
+                set(${dep_name}_FOUND FALSE)
+            else()
+                # On an index MISS no Nix prefix has a config file, so only the default
+                # search (modules, CMAKE_PREFIX_PATH, ...) can still succeed
+                if(NOT _nix_index STREQUAL "MISS")
+                    find_package(${dep_name} ${_find_args} PATHS ${CMAKE_SYSTEM_PREFIX_PATH} NO_DEFAULT_PATH BYPASS_PROVIDER GLOBAL)
+                endif()
+                if(NOT ${dep_name}_FOUND)
+                    find_package(${dep_name} ${_find_args} BYPASS_PROVIDER GLOBAL)
+                endif()
+                if(NOT ${dep_name}_FOUND AND _nix_index STREQUAL "MISS")
+                    nix_package_index_record_miss(${dep_name} "${_find_args}")
+                endif()
             endif()
         endif()
     endmacro()
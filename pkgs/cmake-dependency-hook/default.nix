@@ -21,6 +21,28 @@
         export NIX_CMAKE_TOP_LEVEL_INCLUDES="${./cmakeBuildHook.cmake}"
       fi
 
+      # Classify the dependency search paths once per build instead of on every
+      # configure (cmakeBuildHook.cmake falls back to probing without a manifest).
+      # cmake2nix is itself built with this hook, so it can't be a dependency here:
+      # the manifest is only written when cmake2nix is on PATH, e.g. in nativeBuildInputs.
+      nixCmakeDepsManifest() {
+        if [[ -n "''${dontNixCmakeDepsManifest:-}" || -n "''${NIX_CMAKE_DEPS_MANIFEST:-}" ]]; then
+          return
+        fi
+        if ! type -P cmake2nix >/dev/null; then
+          return
+        fi
+        local dir="''${NIX_BUILD_TOP:-''${TMPDIR:-/tmp}}"
+        if cmake2nix deps-manifest "$dir/nix-deps.cmake"; then
+          export NIX_CMAKE_DEPS_MANIFEST="$dir/nix-deps.cmake"
+        fi
+        # Config directory of every package in those prefixes, for the find_package() provider
+        if cmake2nix index-prefixes "$dir/nix-packages.cmake"; then
+          export NIX_CMAKE_PACKAGE_INDEX="$dir/nix-packages.cmake"
+        fi
+      }
+      preConfigureHooks+=(nixCmakeDepsManifest)
+
       # Enhanced CMake configure phase with dependency management
       nixCmakeConfigurePhase() {
         echo "running preConfigure..." >&2
@@ -0,0 +1,333 @@
+// End-to-end workflows of the real cmake2nix binary at scale, offline: the fake
+// nix-build, nix-instantiate, nix-prefetch-* and git (ls-remote) in bench/fakes/
+// go first on PATH and answer deterministically, with configurable latency and
+// failures.
+//
+//   cmake2nix-bench-e2e [--deps N] [--fanout F] [--latency-ms MS] [--build-ms MS]
+//                       [--fail-rate PCT] [--jobs J] [--json FILE] [--keep]
+//
+// Each workflow reports wall time, processes spawned (per tool), the peak RSS of
+// the cmake2nix processes and the bytes of files they wrote. With --json the same
+// numbers are written as JSON, to diff between commits.
+
+#include "cmake2nix.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <fstream>
+#include <map>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef CMAKE2NIX_BINARY
+#error "CMAKE2NIX_BINARY must point at the cmake2nix executable"
+#endif
+#ifndef CMAKE2NIX_FAKES_DIR
+#error "CMAKE2NIX_FAKES_DIR must point at bench/fakes"
+#endif
+
+extern char** environ;
+
+using namespace cmake2nix;
+
+namespace {
+
+struct Settings {
+    unsigned deps = 2000;
+    unsigned fanout = 0;
+    unsigned latency_ms = 0;
+    unsigned build_ms = 0;
+    unsigned fail_rate = 0;
+    unsigned jobs = 0;
+    fs::path json_file;
+    bool keep = false;
+};
+
+struct Metrics {
+    std::string workflow;
+    double wall = 0;
+    long peak_rss_kb = 0;
+    uint64_t bytes_written = 0;
+    int failed_commands = 0;
+    std::map<std::string, size_t> spawns; // By tool, including cmake2nix itself
+};
+
+[[noreturn]] void usage(const char* argv0) {
+    fmt::print(stderr,
+               "usage: {} [--deps N] [--fanout F] [--latency-ms MS] [--build-ms MS]\n"
+               "       [--fail-rate PCT] [--jobs J] [--json FILE] [--keep]\n",
+               argv0);
+    std::exit(2);
+}
+
+Settings parse_args(int argc, char** argv) {
+    Settings settings;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+            }
+            return argv[++i];
+        };
+        auto number = [&] { return unsigned(std::strtoul(value(), nullptr, 10)); };
+        if (arg == "--deps") {
+            settings.deps = number();
+        } else if (arg == "--fanout") {
+            settings.fanout = number();
+        } else if (arg == "--latency-ms") {
+            settings.latency_ms = number();
+        } else if (arg == "--build-ms") {
+            settings.build_ms = number();
+        } else if (arg == "--fail-rate") {
+            settings.fail_rate = number();
+        } else if (arg == "--jobs" || arg == "-j") {
+            settings.jobs = number();
+        } else if (arg == "--json") {
+            settings.json_file = value();
+        } else if (arg == "--keep") {
+            settings.keep = true;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    return settings;
+}
+
+// Run one command to completion, accumulating its resource usage. Output goes to
+// `log` so the report stays readable.
+void run(const std::vector<std::string>& args, const fs::path& log, Metrics& metrics) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, log.c_str(),
+                                     O_WRONLY | O_CREAT | O_APPEND, 0644);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    pid_t pid = 0;
+    int rc = posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (rc != 0) {
+        throw std::runtime_error(fmt::format("Failed to spawn {}", args[0]));
+    }
+
+    int status = 0;
+    struct rusage usage {};
+    while (wait4(pid, &status, 0, &usage) < 0) {
+        if (errno != EINTR) {
+            throw std::runtime_error("wait4 failed");
+        }
+    }
+    // Linux reports the largest RSS of the child and the descendants it waited for
+    metrics.peak_rss_kb = std::max(metrics.peak_rss_kb, usage.ru_maxrss);
+    metrics.spawns["cmake2nix"]++;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        metrics.failed_commands++;
+    }
+}
+
+// Bytes of the regular files under `dir` modified since `since`
+uint64_t bytes_written(const fs::path& dir, fs::file_time_type since) {
+    uint64_t total = 0;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(dir, ec);
+         it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_regular_file(ec) && it->last_write_time(ec) >= since) {
+            total += it->file_size(ec);
+        }
+    }
+    return total;
+}
+
+// The fakes log one line per spawn
+void collect_spawns(const fs::path& calls, Metrics& metrics) {
+    std::ifstream in(calls);
+    std::string tool;
+    while (std::getline(in, tool)) {
+        metrics.spawns[tool]++;
+    }
+    in.close();
+    fs::remove(calls);
+}
+
+class Harness {
+  public:
+    Harness(const Settings& settings, const fs::path& root)
+        : settings_(settings), root_(root), project_(root / "project"), cache_(root / "cache"),
+          fake_dir_(root / "fake"), log_(root / "cmake2nix.log") {
+        fs::create_directories(project_);
+        fs::create_directories(fake_dir_);
+        std::ofstream(project_ / "CMakeLists.txt")
+            << "cmake_minimum_required(VERSION 3.24)\n"
+               "project(e2e VERSION 1.0.0 LANGUAGES CXX)\n"
+               "include(FetchContent)\n";
+
+        std::string path = CMAKE2NIX_FAKES_DIR;
+        if (const char* inherited = std::getenv("PATH")) {
+            path += std::string(":") + inherited;
+        }
+        ::setenv("PATH", path.c_str(), 1);
+        ::setenv("TMPDIR", root.c_str(), 1);
+        ::setenv("CMAKE2NIX_FAKE_DIR", fake_dir_.c_str(), 1);
+        ::setenv("CMAKE2NIX_FAKE_DEPS", std::to_string(settings.deps).c_str(), 1);
+        ::setenv("CMAKE2NIX_FAKE_FANOUT", std::to_string(settings.fanout).c_str(), 1);
+        ::setenv("CMAKE2NIX_FAKE_LATENCY_MS", std::to_string(settings.latency_ms).c_str(), 1);
+        ::setenv("CMAKE2NIX_FAKE_BUILD_MS", std::to_string(settings.build_ms).c_str(), 1);
+        ::setenv("CMAKE2NIX_FAKE_FAIL_RATE", std::to_string(settings.fail_rate).c_str(), 1);
+    }
+
+    // cmake2nix <global options> <subcommand> [flags...]
+    std::vector<std::string> command(std::string_view subcommand,
+                                     std::initializer_list<std::string_view> flags = {}) const {
+        std::vector<std::string> args = {CMAKE2NIX_BINARY,
+                                         "-i",
+                                         (project_ / "CMakeLists.txt").string(),
+                                         "-l",
+                                         (project_ / "cmake-lock.json").string(),
+                                         "-o",
+                                         project_.string(),
+                                         "--cache-dir",
+                                         cache_.string(),
+                                         "--external-prefetch",
+                                         "-j",
+                                         std::to_string(settings_.jobs)};
+        args.insert(args.end(), flags.begin(), flags.end());
+        args.emplace_back(subcommand);
+        return args;
+    }
+
+    void reset(bool keep_lock, bool keep_cache) {
+        if (!keep_lock) {
+            fs::remove(project_ / "cmake-lock.json");
+        }
+        if (!keep_cache) {
+            fs::remove_all(cache_);
+        }
+    }
+
+    Metrics measure(std::string workflow, const std::vector<std::vector<std::string>>& commands) {
+        Metrics metrics;
+        metrics.workflow = std::move(workflow);
+        fs::remove(fake_dir_ / "calls");
+        auto since = fs::file_time_type::clock::now();
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& args : commands) {
+            run(args, log_, metrics);
+        }
+        metrics.wall =
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        metrics.bytes_written = bytes_written(project_, since) + bytes_written(cache_, since);
+        collect_spawns(fake_dir_ / "calls", metrics);
+        return metrics;
+    }
+
+  private:
+    const Settings& settings_;
+    fs::path root_;
+    fs::path project_;
+    fs::path cache_;
+    fs::path fake_dir_;
+    fs::path log_;
+};
+
+void print_table(const std::vector<Metrics>& results) {
+    fmt::print("{:<16} {:>9} {:>10} {:>12} {:>7}  {}\n", "workflow", "wall (s)", "peak RSS",
+               "written", "failed", "spawns");
+    for (const auto& m : results) {
+        std::string spawns;
+        for (const auto& [tool, count] : m.spawns) {
+            spawns += fmt::format("{}{}={}", spawns.empty() ? "" : " ", tool, count);
+        }
+        fmt::print("{:<16} {:>9.2f} {:>7} MB {:>9} KB {:>7}  {}\n", m.workflow, m.wall,
+                   m.peak_rss_kb / 1024, m.bytes_written / 1024, m.failed_commands, spawns);
+    }
+}
+
+void write_json(const fs::path& path, const Settings& settings,
+                const std::vector<Metrics>& results) {
+    json j;
+    j["settings"] = {{"deps", settings.deps},           {"fanout", settings.fanout},
+                     {"latency_ms", settings.latency_ms}, {"build_ms", settings.build_ms},
+                     {"fail_rate", settings.fail_rate},   {"jobs", settings.jobs}};
+    j["workflows"] = json::array();
+    for (const auto& m : results) {
+        j["workflows"].push_back({{"name", m.workflow},
+                                  {"wall_seconds", m.wall},
+                                  {"peak_rss_kb", m.peak_rss_kb},
+                                  {"bytes_written", m.bytes_written},
+                                  {"failed_commands", m.failed_commands},
+                                  {"spawns", m.spawns}});
+    }
+    fsutil::write_atomic(path, j.dump(2) + "\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    auto settings = parse_args(argc, argv);
+    // --keep works in a fixed directory instead of a temporary one
+    std::optional<fsutil::TempDir> temp;
+    fs::path root = fs::temp_directory_path() / "cmake2nix-e2e-last";
+    if (settings.keep) {
+        fs::remove_all(root);
+        fs::create_directories(root);
+    } else {
+        root = temp.emplace("cmake2nix-e2e-").path();
+    }
+    fmt::print("cmake2nix e2e: {} dependencies, fanout {}, {} ms/prefetch, {} ms/build, "
+               "{}% failures, -j {}\n",
+               settings.deps, settings.fanout, settings.latency_ms, settings.build_ms,
+               settings.fail_rate, settings.jobs);
+
+    std::vector<Metrics> results;
+    try {
+        Harness harness(settings, root);
+
+        // Nothing cached: discovery, resolution and every prefetch happen
+        harness.reset(false, false);
+        results.push_back(harness.measure(
+            "lock-cold", {harness.command("lock"), harness.command("generate")}));
+
+        // The same, as separate steps (no prefetch overlapping discovery)
+        harness.reset(false, false);
+        results.push_back(harness.measure("staged-cold", {harness.command("discover"),
+                                                          harness.command("prefetch"),
+                                                          harness.command("generate")}));
+
+        // Re-lock with nothing changed: should cost next to nothing
+        results.push_back(harness.measure(
+            "lock-unchanged", {harness.command("lock"), harness.command("generate")}));
+
+        // A fresh lock against warm caches
+        harness.reset(false, true);
+        results.push_back(harness.measure(
+            "lock-warm-cache", {harness.command("lock"), harness.command("generate")}));
+
+        if (settings.fanout != 0) {
+            harness.reset(false, false);
+            results.push_back(
+                harness.measure("lock-recursive", {harness.command("lock", {"--recursive"})}));
+        }
+    } catch (const std::exception& e) {
+        fmt::print(stderr, "Error: {}\n", e.what());
+        return 1;
+    }
+
+    print_table(results);
+    if (!settings.json_file.empty()) {
+        write_json(settings.json_file, settings, results);
+    }
+    if (settings.keep) {
+        fmt::print("Work tree and cmake2nix.log kept in {}\n", root.string());
+    }
+    return 0;
+}
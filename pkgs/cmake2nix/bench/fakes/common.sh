@@ -0,0 +1,61 @@
+# Shared by the fake Nix/git tools of the end-to-end benchmark (see
+# bench/e2e_bench.cpp). Everything they print is a pure function of their
+# arguments and the CMAKE2NIX_FAKE_* settings:
+#
+#   CMAKE2NIX_FAKE_DIR         state: call log and fake store (required)
+#   CMAKE2NIX_FAKE_DEPS        dependencies the top-level discovery reports
+#   CMAKE2NIX_FAKE_FANOUT      dependencies each dependency declares (recursive runs)
+#   CMAKE2NIX_FAKE_LATENCY_MS  per nix-prefetch-* and git ls-remote call
+#   CMAKE2NIX_FAKE_BUILD_MS    per nix-build, spread over the log it streams
+#   CMAKE2NIX_FAKE_FAIL_RATE   percentage of nix-prefetch-* calls that fail
+
+: "${CMAKE2NIX_FAKE_DIR:?CMAKE2NIX_FAKE_DIR must be set}"
+FAKE_DEPS=${CMAKE2NIX_FAKE_DEPS:-100}
+FAKE_FANOUT=${CMAKE2NIX_FAKE_FANOUT:-0}
+FAKE_LATENCY_MS=${CMAKE2NIX_FAKE_LATENCY_MS:-0}
+FAKE_BUILD_MS=${CMAKE2NIX_FAKE_BUILD_MS:-0}
+FAKE_FAIL_RATE=${CMAKE2NIX_FAKE_FAIL_RATE:-0}
+
+# One line per spawn; the harness counts them per tool
+fake_record() {
+  echo "$1" >>"$CMAKE2NIX_FAKE_DIR/calls"
+}
+
+fake_sleep_ms() {
+  local ms=$1
+  if [ "$ms" -gt 0 ]; then
+    sleep "$((ms / 1000)).$(printf '%03d' $((ms % 1000)))"
+  fi
+}
+
+# Helpers return through REPLY rather than stdout, so callers don't fork a subshell
+# per value; that matters for logs of thousands of entries.
+
+# Deterministic 32-bit hash of a string (FNV-1a)
+fake_hash() {
+  local text=$1 h=2166136261 i c
+  for ((i = 0; i < ${#text}; i++)); do
+    printf -v c '%d' "'${text:i:1}"
+    h=$(((h ^ c) * 16777619 & 0xffffffff))
+  done
+  REPLY=$h
+}
+
+# 64 hex digits derived from a string: a stand-in SHA-256
+fake_sha256() {
+  fake_hash "$1"
+  local h=$REPLY
+  printf -v REPLY '%08x%08x%08x%08x%08x%08x%08x%08x' \
+    "$h" $((h ^ 1)) $((h ^ 2)) $((h ^ 3)) $((h ^ 4)) $((h ^ 5)) $((h ^ 6)) $((h ^ 7))
+}
+
+# Fail for FAKE_FAIL_RATE percent of argument lists, the same ones every run
+fake_maybe_fail() {
+  local tool=$1
+  shift
+  fake_hash "$*"
+  if [ "$FAKE_FAIL_RATE" -gt 0 ] && [ $((REPLY % 100)) -lt "$FAKE_FAIL_RATE" ]; then
+    echo "$tool: simulated failure for $*" >&2
+    exit 1
+  fi
+}
@@ -0,0 +1,231 @@
+// Per-invocation cost of the compiler launcher: the same compile command line run
+// directly, through a nix-gcc-launcher script as pkgs/cmake-compiler-launchers
+// writes it, and through nix-compiler-launcher. The "compiler" is a no-op, so
+// what is left is process startup and the launcher itself.
+//
+//   cmake2nix-bench-launcher [--iterations N] [--compiler PATH] [--bash PATH]
+//
+// Reports mean, median and p99 microseconds per invocation and the overhead of
+// each launcher over running the compiler directly.
+
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <fstream>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef CMAKE2NIX_COMPILER_LAUNCHER
+#error "CMAKE2NIX_COMPILER_LAUNCHER must point at the nix-compiler-launcher executable"
+#endif
+
+extern char** environ;
+
+using namespace cmake2nix;
+
+namespace {
+
+struct Settings {
+    unsigned iterations = 2000;
+    std::string compiler = "/bin/true";
+    std::string bash;
+};
+
+struct Result {
+    std::string name;
+    double mean_us = 0;
+    double median_us = 0;
+    double p99_us = 0;
+};
+
+[[noreturn]] void usage(const char* argv0) {
+    fmt::print(stderr, "usage: {} [--iterations N] [--compiler PATH] [--bash PATH]\n", argv0);
+    std::exit(2);
+}
+
+Settings parse_args(int argc, char** argv) {
+    Settings settings;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                usage(argv[0]);
+            }
+            return argv[++i];
+        };
+        if (arg == "--iterations") {
+            settings.iterations = std::max(1u, unsigned(std::strtoul(value(), nullptr, 10)));
+        } else if (arg == "--compiler") {
+            settings.compiler = value();
+        } else if (arg == "--bash") {
+            settings.bash = value();
+        } else {
+            usage(argv[0]);
+        }
+    }
+    return settings;
+}
+
+// First `name` on PATH
+std::string find_program(std::string_view name) {
+    const char* path = std::getenv("PATH");
+    std::string_view dirs = path != nullptr ? path : "/usr/bin:/bin";
+    while (!dirs.empty()) {
+        auto colon = dirs.find(':');
+        auto candidate = fs::path(dirs.substr(0, colon)) / name;
+        if (::access(candidate.c_str(), X_OK) == 0) {
+            return candidate.string();
+        }
+        dirs.remove_prefix(colon == std::string_view::npos ? dirs.size() : colon + 1);
+    }
+    throw std::runtime_error(fmt::format("{} not found on PATH", name));
+}
+
+// The nix-gcc-launcher script for one include and one library directory
+fs::path write_script(const fs::path& dir, const std::string& bash) {
+    auto script = dir / "nix-gcc-launcher";
+    std::ofstream(script) << "#!" << bash << "\n"
+                          << R"(set -euo pipefail
+compiler="$1"
+shift
+
+nix_flags=()
+nix_flags+=("-I/nix/store/00000000000000000000000000000000-glibc-2.40-dev/include")
+
+nix_flags+=("-L/nix/store/00000000000000000000000000000000-glibc-2.40/lib")
+
+if [[ "${NIX_DEBUG_CMAKE:-}" == "1" ]]; then
+  echo "NIX CMAKE COMPILER LAUNCHER: $compiler ${nix_flags[@]} $@" >&2
+fi
+
+exec "$compiler" "${nix_flags[@]}" "$@"
+)";
+    fs::permissions(script, fs::perms::owner_all | fs::perms::group_read | fs::perms::group_exec);
+    return script;
+}
+
+// A CMake compile line: compiler, definitions, includes, flags, source and object
+std::vector<std::string> compile_arguments() {
+    std::vector<std::string> args;
+    for (int i = 0; i < 8; ++i) {
+        args.push_back(fmt::format("-DBENCH_DEFINITION_{}=1", i));
+    }
+    for (int i = 0; i < 12; ++i) {
+        args.push_back(fmt::format("-I/build/source/src/module{}/include", i));
+    }
+    for (const char* flag : {"-O2", "-g", "-std=gnu++23", "-fPIC", "-Wall", "-Wextra"}) {
+        args.emplace_back(flag);
+    }
+    args.insert(args.end(), {"-MD", "-MT", "module.cpp.o", "-MF", "module.cpp.o.d", "-o",
+                             "module.cpp.o", "-c", "/build/source/src/module.cpp"});
+    return args;
+}
+
+// Microseconds per run of `args`, stdout and stderr to /dev/null
+std::vector<double> measure(const std::vector<std::string>& args, unsigned iterations) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+    std::vector<double> times;
+    times.reserve(iterations);
+    for (unsigned i = 0; i < iterations; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        pid_t pid = 0;
+        if (posix_spawn(&pid, argv[0], &actions, nullptr, argv.data(), environ) != 0) {
+            posix_spawn_file_actions_destroy(&actions);
+            throw std::runtime_error(fmt::format("Failed to spawn {}", args[0]));
+        }
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0) {
+            if (errno != EINTR) {
+                posix_spawn_file_actions_destroy(&actions);
+                throw std::runtime_error("waitpid failed");
+            }
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            posix_spawn_file_actions_destroy(&actions);
+            throw std::runtime_error(fmt::format("{} failed", args[0]));
+        }
+        times.push_back(
+            std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start)
+                .count());
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return times;
+}
+
+Result summarize(std::string name, std::vector<double> times) {
+    std::sort(times.begin(), times.end());
+    Result result{std::move(name)};
+    double total = 0;
+    for (double t : times) {
+        total += t;
+    }
+    result.mean_us = total / double(times.size());
+    result.median_us = times[times.size() / 2];
+    result.p99_us = times[std::min(times.size() - 1, times.size() * 99 / 100)];
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    auto settings = parse_args(argc, argv);
+    try {
+        if (settings.bash.empty()) {
+            settings.bash = find_program("bash");
+        }
+        fsutil::TempDir temp("cmake2nix-launcher-bench-");
+        auto script = write_script(temp.path(), settings.bash);
+        auto args = compile_arguments();
+        ::unsetenv("NIX_DEBUG_CMAKE");
+
+        auto with = [&](std::vector<std::string> prefix) {
+            prefix.insert(prefix.end(), args.begin(), args.end());
+            return prefix;
+        };
+        std::vector<std::pair<std::string, std::vector<std::string>>> variants = {
+            {"direct", with({settings.compiler})},
+            {"script", with({script.string(), settings.compiler})},
+            {"native", with({CMAKE2NIX_COMPILER_LAUNCHER, settings.compiler})},
+        };
+
+        fmt::print("cmake2nix launcher: {} invocations of {} with {} arguments\n",
+                   settings.iterations, settings.compiler, args.size());
+        // Warm the page cache and the dynamic loader before timing anything
+        for (const auto& [name, command] : variants) {
+            measure(command, std::min(settings.iterations, 50u));
+        }
+
+        std::vector<Result> results;
+        for (const auto& [name, command] : variants) {
+            results.push_back(summarize(name, measure(command, settings.iterations)));
+        }
+
+        double direct = results.front().mean_us;
+        fmt::print("{:<8} {:>10} {:>10} {:>10} {:>12}\n", "launcher", "mean us", "median us",
+                   "p99 us", "overhead us");
+        for (const auto& result : results) {
+            fmt::print("{:<8} {:>10.1f} {:>10.1f} {:>10.1f} {:>12.1f}\n", result.name,
+                       result.mean_us, result.median_us, result.p99_us, result.mean_us - direct);
+        }
+    } catch (const std::exception& e) {
+        fmt::print(stderr, "Error: {}\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+// Throughput of the discovery-log / prefetch-output matchers against the
+// std::regex versions they replaced, on synthetic discovery logs.
+//
+//   cmake2nix-bench-matchers [lines...]   (default: 10000 100000)
+
+#include "cmake2nix.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <fstream>
+#include <regex>
+
+using namespace cmake2nix;
+
+namespace {
+
+std::vector<std::string> synthetic_log(size_t lines) {
+    std::vector<std::string> log;
+    log.reserve(lines);
+    for (size_t i = 0; i < lines; ++i) {
+        // Mix GitHub and non-GitHub remotes the way real superbuild logs do
+        std::string repo = i % 4 == 3
+                               ? fmt::format("https://gitlab.example.com/group{}/dep{}.git", i % 97, i)
+                               : fmt::format("https://github.com/owner{}/dep{}.git", i % 97, i);
+        log.push_back(fmt::format(
+            R"({{"name":"dep{}","gitRepository":"{}","gitTag":"v{}.{}.{}","sourceDir":"/build/_deps/dep{}-src"}})",
+            i, repo, i % 7, i % 13, i % 5, i));
+    }
+    return log;
+}
+
+template <typename Fn> double seconds(Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(std::string_view what, size_t lines, size_t bytes, double secs) {
+    fmt::print("  {:<28} {:>9.3f} ms  {:>12.0f} lines/s  {:>8.1f} MiB/s\n", what, secs * 1e3,
+               lines / secs, bytes / secs / (1024.0 * 1024.0));
+}
+
+void bench(size_t lines) {
+    auto log = synthetic_log(lines);
+    size_t bytes = 0;
+    for (const auto& line : log) {
+        bytes += line.size() + 1;
+    }
+    fmt::print("{} lines ({:.1f} MiB)\n", lines, bytes / (1024.0 * 1024.0));
+
+    size_t regex_hits = 0;
+    report("std::regex per line (old)", lines, bytes, seconds([&] {
+               for (const auto& line : log) {
+                   std::regex github_regex(R"(https?://github\.com/([^/]+)/([^/\.]+))");
+                   std::smatch match;
+                   regex_hits += std::regex_search(line, match, github_regex);
+               }
+           }));
+
+    size_t compiled_hits = 0;
+    report("std::regex compiled once", lines, bytes, seconds([&] {
+               static const std::regex github_regex(R"(https?://github\.com/([^/]+)/([^/\.]+))");
+               for (const auto& line : log) {
+                   std::smatch match;
+                   compiled_hits += std::regex_search(line, match, github_regex);
+               }
+           }));
+
+    size_t matcher_hits = 0;
+    report("matchers::github_repo", lines, bytes, seconds([&] {
+               for (const auto& line : log) {
+                   matcher_hits += matchers::github_repo(line).has_value();
+               }
+           }));
+
+    size_t sri_hits = 0;
+    std::string prefetch_output =
+        R"({"owner":"fmtlib","repo":"fmt","rev":"12.1.0","hash":"sha256-ZmI1Dv0ZabPlxa02OpERI47jp7zFfjpeWCy1WyuPYZ0="})";
+    report("matchers::find_sri_sha256", lines, prefetch_output.size() * lines, seconds([&] {
+               for (size_t i = 0; i < lines; ++i) {
+                   sri_hits += !matchers::find_sri_sha256(prefetch_output).empty();
+               }
+           }));
+
+    if (regex_hits != matcher_hits || compiled_hits != matcher_hits || sri_hits != lines) {
+        fmt::print(stderr, "matcher disagrees with regex: {} vs {}\n", matcher_hits, regex_hits);
+        std::exit(1);
+    }
+
+    auto path = fs::temp_directory_path() / fmt::format("cmake2nix-bench-{}.json", lines);
+    {
+        std::ofstream out(path);
+        for (const auto& line : log) {
+            out << line << '\n';
+        }
+    }
+    size_t parsed = 0;
+    report("parse_discovery_log", lines, bytes,
+           seconds([&] { parsed = discovery::parse_discovery_log(path).size(); }));
+    fs::remove(path);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::vector<size_t> sizes = {10'000, 100'000};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) {
+            sizes.push_back(std::strtoull(argv[i], nullptr, 10));
+        }
+    }
+    for (size_t lines : sizes) {
+        bench(lines);
+    }
+    return 0;
+}
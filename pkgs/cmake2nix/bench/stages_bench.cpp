@@ -0,0 +1,366 @@
+// Throughput, allocations and peak heap of cmake2nix's internal stages on synthetic
+// projects of 10, 1k and 100k dependencies (Google Benchmark).
+//
+//   cmake2nix-bench [--benchmark_filter=<regex>]
+//
+// Counters per iteration: "allocs" and "alloc_bytes" (operator new calls and bytes),
+// and "peak_heap" (highest live heap above the level before the stage). Allocation
+// counts are deterministic, so they diff cleanly between commits:
+//
+//   cmake2nix-bench --benchmark_out=base.json --benchmark_out_format=json
+//   cmake2nix-bench --benchmark_out=new.json --benchmark_out_format=json
+//   compare.py benchmarks base.json new.json   # from google/benchmark's tools/
+
+#include "cmake2nix.hpp"
+
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <malloc.h>
+#include <new>
+#include <unistd.h>
+
+using namespace cmake2nix;
+
+// Every allocation of the process goes through these, so stages are measured
+// including the libraries they call into
+namespace {
+std::atomic<size_t> allocations = 0;
+std::atomic<size_t> allocated_bytes = 0;
+std::atomic<size_t> live_bytes = 0;
+std::atomic<size_t> peak_bytes = 0;
+
+void* counted_new(size_t size) {
+    void* ptr = std::malloc(size == 0 ? 1 : size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    size_t usable = malloc_usable_size(ptr);
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    size_t live = live_bytes.fetch_add(usable, std::memory_order_relaxed) + usable;
+    size_t peak = peak_bytes.load(std::memory_order_relaxed);
+    while (live > peak && !peak_bytes.compare_exchange_weak(peak, live)) {
+    }
+    return ptr;
+}
+
+void counted_delete(void* ptr) noexcept {
+    if (ptr != nullptr) {
+        live_bytes.fetch_sub(malloc_usable_size(ptr), std::memory_order_relaxed);
+        std::free(ptr);
+    }
+}
+} // namespace
+
+void* operator new(size_t size) {
+    return counted_new(size);
+}
+void* operator new[](size_t size) {
+    return counted_new(size);
+}
+void operator delete(void* ptr) noexcept {
+    counted_delete(ptr);
+}
+void operator delete[](void* ptr) noexcept {
+    counted_delete(ptr);
+}
+void operator delete(void* ptr, size_t) noexcept {
+    counted_delete(ptr);
+}
+void operator delete[](void* ptr, size_t) noexcept {
+    counted_delete(ptr);
+}
+
+namespace {
+
+// Allocation counters over one benchmark's timed loop
+class Meter {
+  public:
+    Meter()
+        : allocations_(allocations.load()), bytes_(allocated_bytes.load()),
+          baseline_(live_bytes.load()) {
+        peak_bytes.store(baseline_);
+    }
+
+    void report(benchmark::State& state, size_t items, size_t bytes = 0) const {
+        using benchmark::Counter;
+        state.counters["allocs"] =
+            Counter(double(allocations.load() - allocations_), Counter::kAvgIterations);
+        state.counters["alloc_bytes"] =
+            Counter(double(allocated_bytes.load() - bytes_), Counter::kAvgIterations);
+        state.counters["peak_heap"] = double(peak_bytes.load() - baseline_);
+        state.SetItemsProcessed(int64_t(state.iterations() * items));
+        if (bytes != 0) {
+            state.SetBytesProcessed(int64_t(state.iterations() * bytes));
+        }
+    }
+
+  private:
+    size_t allocations_;
+    size_t bytes_;
+    size_t baseline_;
+};
+
+// Stages print progress lines; keep them out of the benchmark report
+class QuietStdout {
+  public:
+    QuietStdout() {
+        std::fflush(stdout);
+        saved_ = ::dup(STDOUT_FILENO);
+        int null = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+        ::dup2(null, STDOUT_FILENO);
+        ::close(null);
+    }
+    ~QuietStdout() {
+        std::fflush(stdout);
+        ::dup2(saved_, STDOUT_FILENO);
+        ::close(saved_);
+    }
+    QuietStdout(const QuietStdout&) = delete;
+    QuietStdout& operator=(const QuietStdout&) = delete;
+
+  private:
+    int saved_ = -1;
+};
+
+// Synthetic inputs, deterministic for a given size. Dependencies mix the fetchers
+// real projects use: mostly GitHub, some other git hosts, some archive URLs.
+
+std::string fake_hash(size_t i) {
+    return digest::to_sri(digest::Sha256().finish()).replace(7, 8, fmt::format("{:08x}", i));
+}
+
+Dependency synthetic_dependency(size_t i, std::string_view version = "") {
+    Dependency dep;
+    dep.name = fmt::format("dep{}", i);
+    dep.version = version.empty() ? fmt::format("{}.{}.{}", i % 7, i % 13, i % 5) : version;
+    dep.args = json::object();
+    dep.metadata = json::object();
+    switch (i % 8) {
+    case 7:
+        dep.method = "fetchurl";
+        dep.args["url"] = fmt::format("https://downloads.example.com/dep{}-{}.tar.gz", i,
+                                      dep.version);
+        dep.args["sha256"] = fake_hash(i);
+        dep.metadata["url"] = dep.args["url"];
+        break;
+    case 3:
+        dep.method = "fetchgit";
+        dep.args["url"] = fmt::format("https://gitlab.example.com/group{}/dep{}.git", i % 97, i);
+        dep.args["rev"] = digest::sha256_hex(dep.name + dep.version).substr(0, 40);
+        dep.args["sha256"] = fake_hash(i);
+        dep.metadata["gitRepository"] = dep.args["url"];
+        dep.metadata["gitTag"] = "v" + dep.version;
+        dep.metadata["ref"] = "v" + dep.version;
+        break;
+    default:
+        dep.method = "fetchFromGitHub";
+        dep.args["owner"] = fmt::format("owner{}", i % 97);
+        dep.args["repo"] = dep.name;
+        dep.args["rev"] = digest::sha256_hex(dep.name + dep.version).substr(0, 40);
+        dep.args["hash"] = fake_hash(i);
+        dep.metadata["gitRepository"] =
+            fmt::format("https://github.com/owner{}/{}.git", i % 97, dep.name);
+        dep.metadata["gitTag"] = "v" + dep.version;
+        dep.metadata["ref"] = "v" + dep.version;
+        break;
+    }
+    return dep;
+}
+
+LockFile synthetic_lock(size_t count) {
+    LockFile lock;
+    for (size_t i = 0; i < count; ++i) {
+        auto dep = synthetic_dependency(i);
+        lock.dependencies.emplace(dep.name, std::move(dep));
+    }
+    return lock;
+}
+
+// What a later discovery reports against synthetic_lock(count): 1 in 10 bumped,
+// 1 in 20 unpinned again, and count / 20 new dependencies
+std::vector<Dependency> synthetic_discovery(size_t count) {
+    std::vector<Dependency> deps;
+    for (size_t i = 0; i < count + count / 20; ++i) {
+        auto dep = synthetic_dependency(i, i % 10 == 9 ? "99.0.0" : "");
+        if (i % 20 == 0 || i >= count) {
+            dep.args[std::string(lockfile::hash_field(dep))] = placeholder_hash;
+        }
+        deps.push_back(std::move(dep));
+    }
+    return deps;
+}
+
+// One line per dependency, as the CMake hook prints it
+std::string synthetic_log(size_t count) {
+    std::string log;
+    for (size_t i = 0; i < count; ++i) {
+        auto dep = synthetic_dependency(i);
+        if (dep.method == "fetchurl") {
+            fmt::format_to(std::back_inserter(log),
+                           R"({{"name":"{}","version":"{}","url":"{}"}})", dep.name, dep.version,
+                           dep.args["url"].get<std::string>());
+        } else {
+            fmt::format_to(std::back_inserter(log),
+                           R"({{"name":"{}","version":"{}","gitRepository":"{}","gitTag":"{}",)"
+                           R"("sourceDir":"/build/_deps/{}-src"}})",
+                           dep.name, dep.version, dep.metadata["gitRepository"].get<std::string>(),
+                           dep.metadata["gitTag"].get<std::string>(), dep.name);
+        }
+        log += '\n';
+    }
+    return log;
+}
+
+// A superbuild: project() followed by one FetchContent_Declare per dependency
+std::string synthetic_cmake_lists(size_t count) {
+    std::string out = "cmake_minimum_required(VERSION 3.24)\n"
+                      "project(synthetic VERSION 1.2.3 LANGUAGES CXX)\n\n"
+                      "include(FetchContent)\n\n";
+    for (size_t i = 0; i < count; ++i) {
+        fmt::format_to(std::back_inserter(out),
+                       "FetchContent_Declare(\n  dep{0}\n"
+                       "  GIT_REPOSITORY https://github.com/owner{1}/dep{0}.git\n"
+                       "  GIT_TAG v{2}.{3}.{4} # pinned\n)\n\n",
+                       i, i % 97, i % 7, i % 13, i % 5);
+    }
+    out += "FetchContent_MakeAvailable(dep0)\n";
+    return out;
+}
+
+void write_file(const fs::path& path, std::string_view content) {
+    fsutil::write_atomic(path, content);
+}
+
+void BM_ParseDiscoveryLog(benchmark::State& state) {
+    auto count = size_t(state.range(0));
+    fsutil::TempDir dir("cmake2nix-bench-");
+    auto log = synthetic_log(count);
+    write_file(dir.path() / "discovery-log.json", log);
+
+    QuietStdout quiet;
+    Meter meter;
+    for (auto _ : state) {
+        auto deps = discovery::parse_discovery_log(dir.path() / "discovery-log.json");
+        benchmark::DoNotOptimize(deps.data());
+    }
+    meter.report(state, count, log.size());
+}
+
+void BM_LockToJson(benchmark::State& state) {
+    auto count = size_t(state.range(0));
+    auto lock = synthetic_lock(count);
+
+    Meter meter;
+    for (auto _ : state) {
+        auto j = lock.to_json();
+        benchmark::DoNotOptimize(j);
+    }
+    meter.report(state, count);
+}
+
+void BM_LockFromJson(benchmark::State& state) {
+    auto count = size_t(state.range(0));
+    auto j = synthetic_lock(count).to_json();
+
+    Meter meter;
+    for (auto _ : state) {
+        auto lock = LockFile::from_json(j);
+        benchmark::DoNotOptimize(lock.dependencies.size());
+    }
+    meter.report(state, count);
+}
+
+// The SAX reader and streaming writer the CLI actually uses
+void BM_LockLoad(benchmark::State& state) {
+    auto count = size_t(state.range(0));
+    fsutil::TempDir dir("cmake2nix-bench-");
+    auto path = dir.path() / "cmake-lock.json";
+    {
+        QuietStdout quiet;
+        lockfile::save(synthetic_lock(count), path);
+    }
+    auto bytes = size_t(fs::file_size(path));
+
+    Meter meter;
+    for (auto _ : state) {
+        auto lock = lockfile::load(path);
+        benchmark::DoNotOptimize(lock.dependencies.size());
+    }
+    meter.report(state, count, bytes);
+}
+
+void BM_LockSave(benchmark::State& state) {
+    auto count = size_t(state.range(0));
+    fsutil::TempDir dir("cmake2nix-bench-");
+    auto path = dir.path() / "cmake-lock.json";
+    auto lock = synthetic_lock(count);
+
+    QuietStdout quiet;
+    Meter meter;
+    for (auto _ : state) {
+        lockfile::save(lock, path);
+    }
+    meter.report(state, count, size_t(fs::file_size(path)));
+}
+
+void BM_Merge(benchmark::State& state) {
+    auto count = size_t(state.range(0));
+    auto old_lock = synthetic_lock(count);
+    auto discovered = synthetic_discovery(count);
+
+    Meter meter;
+    for (auto _ : state) {
+        auto result = lockfile::merge(old_lock, discovered);
+        benchmark::DoNotOptimize(result.lock.dependencies.size());
+    }
+    meter.report(state, discovered.size());
+}
+
+void BM_GeneratePackagesNix(benchmark::State& state) {
+    auto count = size_t(state.range(0));
+    auto lock = synthetic_lock(count);
+
+    size_t bytes = 0;
+    Meter meter;
+    for (auto _ : state) {
+        auto nix = generator::generate_packages_nix(lock);
+        bytes = nix.size();
+        benchmark::DoNotOptimize(nix.data());
+    }
+    meter.report(state, count, bytes);
+}
+
+void BM_ParseCMakeLists(benchmark::State& state) {
+    auto count = size_t(state.range(0));
+    fsutil::TempDir dir("cmake2nix-bench-");
+    auto source = synthetic_cmake_lists(count);
+    write_file(dir.path() / "CMakeLists.txt", source);
+
+    Meter meter;
+    for (auto _ : state) {
+        auto info = parser::parse_cmake_lists(dir.path() / "CMakeLists.txt");
+        benchmark::DoNotOptimize(info.pname.data());
+    }
+    meter.report(state, count, source.size());
+}
+
+void sizes(benchmark::internal::Benchmark* bench) {
+    bench->Arg(10)->Arg(1'000)->Arg(100'000)->Unit(benchmark::kMicrosecond);
+}
+
+} // namespace
+
+BENCHMARK(BM_ParseDiscoveryLog)->Apply(sizes);
+BENCHMARK(BM_LockToJson)->Apply(sizes);
+BENCHMARK(BM_LockFromJson)->Apply(sizes);
+BENCHMARK(BM_LockLoad)->Apply(sizes);
+BENCHMARK(BM_LockSave)->Apply(sizes);
+BENCHMARK(BM_Merge)->Apply(sizes);
+BENCHMARK(BM_GeneratePackagesNix)->Apply(sizes);
+BENCHMARK(BM_ParseCMakeLists)->Apply(sizes);
+
+BENCHMARK_MAIN();
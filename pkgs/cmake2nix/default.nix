@@ -6,6 +6,8 @@
 , nix
 , nix-prefetch-github
 , git
+, curl
+, zlib
 , makeBinaryWrapper
 }:
 
@@ -32,11 +34,14 @@ workspace.buildPackage {
     makeBinaryWrapper
   ];
 
-  # Runtime dependencies that cmake2nix shells out to
   buildInputs = [
+    zlib
+
+    # Runtime dependencies that cmake2nix shells out to
     nix
     nix-prefetch-github
     git
+    curl
   ];
 
   cmakeFlags = [
@@ -45,10 +50,13 @@ workspace.buildPackage {
     "-DCMAKE_INSTALL_PREFIX=${placeholder "out"}"
   ];
 
+  # ctest (tests/), all offline
+  doCheck = true;
+
   # Make nix commands available at runtime
   postInstall = ''
     wrapProgram $out/bin/cmake2nix \
-      --prefix PATH : ${lib.makeBinPath [ nix nix-prefetch-github git ]}
+      --prefix PATH : ${lib.makeBinPath [ nix nix-prefetch-github git curl ]}
   '';
 
   meta = with lib; {
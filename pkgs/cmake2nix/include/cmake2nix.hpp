@@ -1,9 +1,19 @@
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <optional>
+#include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace cmake2nix {
@@ -19,21 +29,34 @@ struct Config {
     std::string packages_nix = "cmake-packages.nix";
     std::string env_nix = "cmake-env.nix";
     std::string composition_nix = "default.nix";
+    bool shard = false; // One .nix file per dependency under shard_dir, imported from packages_nix
+    std::string shard_dir = "cmake-deps";
     std::vector<std::string> cmake_flags;
     bool recursive = false;
     bool no_prefetch = false;
     bool verbose = false;
+    unsigned jobs = 0;      // Parallel prefetch workers (0 = number of cores)
+    unsigned host_jobs = 4; // Concurrent prefetches against a single host
+    fs::path cache_dir;     // Prefetch cache location (empty = cache::default_dir())
+    bool no_cache = false;
+    bool external_prefetch = false; // Use the nix-prefetch-* tools instead of in-process hashing
+    fs::path trace_file; // Chrome trace of the run (empty = none)
+    bool stats = false;  // Print a per-phase timing summary at exit
 };
 
 // Represents a dependency from discovery
 struct Dependency {
     std::string name;
     std::string version;
-    std::string method; // fetchFromGitHub, fetchgit, fetchurl
+    std::string method; // fetchFromGitHub, fetchgit, fetchurl, fetchzip
     json args;          // Method-specific arguments
     json metadata;      // Additional metadata
 };
 
+// Hash written for dependencies that have not been prefetched yet
+inline constexpr std::string_view placeholder_hash =
+    "sha256-AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=";
+
 // Lock file structure
 struct LockFile {
     std::string version = "1.0";
@@ -49,39 +72,781 @@ struct ProjectInfo {
     std::string version;
 };
 
+// Digest - SHA-256 for cache keys and Nix hashes
+namespace digest {
+class Sha256 {
+  public:
+    using Digest = std::array<uint8_t, 32>;
+
+    Sha256();
+    void update(const void* data, size_t size);
+    void update(std::string_view data) {
+        update(data.data(), data.size());
+    }
+    Digest finish();
+
+  private:
+    void compress(const uint8_t* block);
+
+    std::array<uint32_t, 8> state_;
+    std::array<uint8_t, 64> buffer_{};
+    size_t buffered_ = 0;
+    uint64_t total_ = 0;
+};
+
+std::string to_hex(const Sha256::Digest& digest);
+std::string to_sri(const Sha256::Digest& digest);
+std::string to_nix32(const Sha256::Digest& digest);
+// Accepts the encodings Nix tools print: SRI, or nix32, hex or base64 with an
+// optional "sha256:" prefix
+std::optional<Sha256::Digest> parse_sha256(std::string_view hash);
+// SRI form of a hex digest, e.g. CMake's URL_HASH SHA256=<hex>; only algorithms
+// Nix fetchers accept (sha1, sha256, sha512), case-insensitive
+std::optional<std::string> sri_from_hex(std::string_view algorithm, std::string_view hex);
+std::string sha256_hex(std::string_view data);
+} // namespace digest
+
+// Matchers - Allocation-free scanners for the patterns we search logs and sources for
+namespace matchers {
+struct GitHubRepo {
+    std::string_view owner;
+    std::string_view repo;
+};
+
+std::optional<GitHubRepo> github_repo(std::string_view url);
+std::string_view find_sri_sha256(std::string_view text);
+std::optional<std::string_view> project_name(std::string_view content);
+std::optional<std::string_view> version(std::string_view content);
+} // namespace matchers
+
+// Filesystem helpers
+namespace fsutil {
+// Read-only memory mapping of a file
+class MappedFile {
+  public:
+    explicit MappedFile(const fs::path& path);
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    ~MappedFile();
+
+    std::string_view text() const {
+        return {data_, size_};
+    }
+
+  private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Buffered writer to a unique temp file next to `path`, renamed over it on
+// commit() so readers never see partial content. Discarded if not committed.
+class AtomicFile {
+  public:
+    explicit AtomicFile(fs::path path);
+    AtomicFile(const AtomicFile&) = delete;
+    AtomicFile& operator=(const AtomicFile&) = delete;
+    ~AtomicFile();
+
+    void write(std::string_view data) {
+        if (buffer_.size() + data.size() > buffer_limit) {
+            flush();
+        }
+        buffer_.append(data);
+    }
+    void put(char c) {
+        if (buffer_.size() == buffer_limit) {
+            flush();
+        }
+        buffer_.push_back(c);
+    }
+    void commit(bool durable = false); // `durable` fsyncs the file and its directory
+
+  private:
+    static constexpr size_t buffer_limit = 64 * 1024;
+
+    void flush();
+    [[noreturn]] void fail(std::string_view what);
+
+    fs::path path_;
+    fs::path temp_;
+    int fd_ = -1;
+    std::string buffer_;
+};
+
+// Fresh directory, removed with everything in it on destruction
+class TempDir {
+  public:
+    explicit TempDir(std::string_view prefix, const fs::path& parent = fs::temp_directory_path());
+    TempDir(const TempDir&) = delete;
+    TempDir& operator=(const TempDir&) = delete;
+    ~TempDir();
+
+    const fs::path& path() const {
+        return path_;
+    }
+
+  private:
+    fs::path path_;
+};
+
+// Advisory flock() on `path` (created if missing), held until destruction.
+// Shared locks coexist; an exclusive lock waits for all others.
+class FileLock {
+  public:
+    FileLock(const fs::path& path, bool exclusive);
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+    ~FileLock();
+
+  private:
+    int fd_ = -1;
+};
+
+fs::path make_temp_file(const fs::path& dir, std::string_view prefix,
+                        std::string_view suffix = "");
+void write_atomic(const fs::path& path, std::string_view content, bool durable = false);
+// write_atomic unless the file already holds exactly `content`, so unchanged
+// outputs keep their mtime; returns whether the file was written
+bool write_if_changed(const fs::path& path, std::string_view content);
+} // namespace fsutil
+
+// NAR - Nix archive serialization, so fixed-output hashes can be computed in-process
+namespace nar {
+// Feeds the NAR serialization of one file system object into a SHA-256. Nodes are
+// described depth-first; directory entries must arrive in byte-wise name order.
+class Encoder {
+  public:
+    explicit Encoder(digest::Sha256& sha);
+
+    // A regular file: follow with exactly `size` bytes of contents(), then end_regular()
+    void regular(bool executable, uint64_t size);
+    void contents(std::string_view data);
+    void end_regular();
+    void symlink(std::string_view target);
+    // Each entry(name) is followed by exactly one node and end_entry()
+    void begin_directory();
+    void entry(std::string_view name);
+    void end_entry();
+    void end_directory();
+
+  private:
+    void number(uint64_t value);
+    void pad(uint64_t size);
+    void token(std::string_view value);
+
+    digest::Sha256& sha_;
+    uint64_t size_ = 0;
+    uint64_t remaining_ = 0;
+    std::vector<std::string> last_entry_; // Per open directory, to enforce ordering
+};
+
+// Directory entry names to leave out, at any depth (e.g. ".git")
+using Filter = std::function<bool(std::string_view name)>;
+
+// Serialize a path without copying it: directories are walked in sorted order and
+// files streamed through a fixed buffer. Only the owner-executable bit is recorded.
+void dump(const fs::path& path, Encoder& encoder, const Filter& skip = {});
+// What `nix hash path` prints, as the raw digest
+digest::Sha256::Digest hash_path(const fs::path& path, const Filter& skip = {});
+} // namespace nar
+
+// Archive - Single-pass .tar.gz unpacking straight into a NAR hash
+namespace archive {
+// Fed the compressed bytes as they arrive, produces the hash of the tree fetchzip
+// would unpack (single top-level directory stripped) without writing it out.
+// Tar order isn't NAR order, so file contents are held until finish(): in memory up
+// to `memory_budget` bytes, then in an unlinked temporary file.
+class TarballHasher {
+  public:
+    static constexpr size_t default_memory_budget = 64 * 1024 * 1024;
+
+    explicit TarballHasher(size_t memory_budget = default_memory_budget);
+    ~TarballHasher();
+    TarballHasher(const TarballHasher&) = delete;
+    TarballHasher& operator=(const TarballHasher&) = delete;
+
+    void update(std::string_view compressed);
+    digest::Sha256::Digest finish();
+
+    uint64_t spilled_bytes() const;
+
+  private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+} // namespace archive
+
+// Mirror - Local bare git repositories, one per remote, shared by every fetch of it.
+// Fetches hold an exclusive flock on the mirror, checkouts a shared one.
+namespace mirror {
+// Canonical form of a remote URL, so https://Host/a/b.git and https://host/a/b/ share
+// a mirror; scp-style user@host:path becomes ssh://user@host/path
+std::string normalize_url(std::string_view url);
+// A submodule URL relative to its superproject's remote ("../lib.git")
+std::string resolve_url(std::string_view base, std::string_view relative);
+
+class Checkout;
+
+class Repository {
+  public:
+    // The mirror of `url` under `root`, created on first use
+    Repository(const fs::path& root, std::string url);
+
+    // Make `rev` (commit, tag or branch) available and return its commit id. Only
+    // that rev is fetched, shallowly; a commit already in the mirror costs nothing.
+    std::string fetch(const std::string& rev);
+    // Check `commit` out into `dir` (which must not exist or be empty) as a detached
+    // worktree, with submodules checked out from their own mirrors
+    [[nodiscard]] Checkout checkout(const std::string& commit, const fs::path& dir);
+
+    const fs::path& path() const {
+        return path_;
+    }
+
+  private:
+    friend class Checkout;
+    void initialize();
+    void checkout_into(const std::string& commit, const fs::path& dir, Checkout& checkout);
+
+    fs::path root_;
+    fs::path path_;
+    fs::path lock_path_;
+    std::string url_;
+};
+
+// A worktree checkout and its submodules' worktrees. Going out of scope deletes the
+// directory and unregisters the worktrees from their mirrors.
+class Checkout {
+  public:
+    explicit Checkout(fs::path dir) : dir_(std::move(dir)) {}
+    Checkout(Checkout&& other) noexcept;
+    Checkout& operator=(Checkout&&) = delete;
+    ~Checkout();
+
+    const fs::path& path() const {
+        return dir_;
+    }
+
+  private:
+    friend class Repository;
+    fs::path dir_;
+    std::vector<Repository> mirrors_; // Each one the checkout registered a worktree with
+};
+} // namespace mirror
+
+// Cache - Persistent prefetch results shared across projects and runs
+namespace cache {
+fs::path default_dir();
+
+class PrefetchCache {
+  public:
+    explicit PrefetchCache(fs::path dir);
+
+    static std::string key(std::string_view method, std::string_view source,
+                           std::string_view rev);
+    std::optional<std::string> lookup(const std::string& key);
+    void store(const std::string& key, const std::string& hash);
+
+    size_t hits() const {
+        return hits_;
+    }
+    size_t misses() const {
+        return misses_;
+    }
+
+  private:
+    fs::path entry_path(const std::string& key) const;
+
+    fs::path dir_;
+    std::atomic<size_t> hits_ = 0;
+    std::atomic<size_t> misses_ = 0;
+};
+} // namespace cache
+
+// Trace - Timed spans of a run, written as Chrome trace events (--trace) and summarised
+// per phase (--stats). Nothing is recorded, or allocated, until start() is called.
+namespace trace {
+using Clock = std::chrono::steady_clock;
+
+// Begin recording; timestamps are relative to `origin`. Later calls are ignored.
+void start(Clock::time_point origin = Clock::now());
+bool enabled();
+
+// A complete event on the calling thread, from construction to destruction.
+// Categories used: "phase", "command", "prefetch", "discover", "file", "process".
+class Span {
+  public:
+    explicit Span(std::string_view name, std::string_view category = "phase");
+    ~Span();
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    // Shown with the event in the trace viewer
+    void arg(std::string_view key, std::string_view value);
+
+  private:
+    bool active_ = false;
+    Span* parent_ = nullptr;
+    Clock::time_point start_;
+    std::string name_;
+    std::string category_;
+    std::vector<std::pair<std::string, std::string>> args_;
+};
+
+// Attach an argument to the calling thread's innermost open span, if any
+void annotate(std::string_view key, std::string_view value);
+// An interval measured elsewhere, e.g. startup before recording began
+void record(std::string_view name, std::string_view category, Clock::time_point start,
+            Clock::time_point end);
+// A reaped child process: its wall time and the CPU time it (and its children) used
+void record_child(std::string_view command, Clock::time_point start, Clock::time_point end,
+                  std::chrono::duration<double> cpu);
+
+// Chrome trace-event JSON, for chrome://tracing or ui.perfetto.dev
+void write(const fs::path& path);
+// Time per phase, the `slowest` slowest dependencies, and child time against wall time
+void print_stats(size_t slowest = 10);
+} // namespace trace
+
+// Subprocess - Shell-free child processes (posix_spawn) with streamed output
+namespace subprocess {
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    std::function<void(std::string_view)> on_stdout_data; // Raw chunks, for binary output
+    std::function<void(std::string_view)> on_stdout_line; // Called per line as output arrives
+    std::function<void(std::string_view)> on_stderr_line;
+    bool capture_stdout = true; // Accumulate into Result::out
+    bool capture_stderr = true; // Accumulate into Result::err
+    std::chrono::milliseconds timeout{0}; // 0 = no timeout
+    const std::atomic<bool>* cancel = nullptr;
+};
+
+struct Result {
+    int exit_code = -1; // 128 + signal if the child was killed
+    bool timed_out = false;
+    bool cancelled = false;
+    std::string out;
+    std::string err;
+    std::chrono::duration<double> elapsed{0};
+
+    bool ok() const {
+        return exit_code == 0 && !timed_out && !cancelled;
+    }
+    std::string describe(std::string_view program) const;
+};
+
+// Runs many children at once, multiplexing all of their pipes on one poll() loop
+class EventLoop {
+  public:
+    EventLoop();
+    ~EventLoop();
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    void spawn(const std::vector<std::string>& argv, Options options,
+               std::function<void(Result)> on_exit);
+    void run(); // Returns once every spawned child has exited
+    void cancel_all();
+
+  private:
+    struct Child;
+    std::vector<std::unique_ptr<Child>> children_;
+};
+
+Result run(const std::vector<std::string>& argv, Options options = {});
+} // namespace subprocess
+
 // Discovery - Run CMake to discover dependencies
 namespace discovery {
-std::vector<Dependency> run(const Config& config);
-fs::path create_discovery_derivation(const Config& config);
+// Prefix of the build-log line the CMake hook prints for each dependency it intercepts
+inline constexpr std::string_view log_marker = "cmake2nix-discovery: ";
+// Called as the discovery build reports each dependency, before the build finishes
+using DependencyCallback = std::function<void(const Dependency&)>;
+
+std::vector<Dependency> run(const Config& config, const DependencyCallback& on_dependency = {});
+std::string fingerprint(const Config& config); // Hash of every CMake input + discovery settings
+fs::path create_discovery_derivation(const Config& config,
+                                     const DependencyCallback& on_dependency = {});
+// Discover what a dependency's own source declares; pins `dep` first if needed
+std::vector<Dependency> discover_dependency(const Config& config, Dependency& dep);
+// Expand `roots` level by level until no new (name, rev) appears. Each level's
+// nodes are discovered concurrently; parent -> child edges are recorded in
+// metadata["dependencies"].
+std::vector<Dependency> discover_recursive(const Config& config, std::vector<Dependency> roots);
 std::vector<Dependency> parse_discovery_log(const fs::path& log_file);
 } // namespace discovery
 
 // Lock file operations
 namespace lockfile {
+// How a dependency in a merged lock relates to the previous lock
+enum class Change {
+    Unchanged,      // Same source, already pinned to a real hash
+    Unpinned,       // Same source, still carrying the placeholder hash
+    Added,          // Not in the previous lock
+    VersionChanged, // Version differs
+    RevChanged,     // Same version, but rev (or another fetcher argument) differs
+    HashChanged,    // Same source, with a different hash declared in CMake (URL_HASH)
+};
+
+struct ChangeSet {
+    std::map<std::string, Change> changes; // Every dependency in the merged lock
+
+    // Dirty entries need prefetching before the lock is complete
+    bool is_dirty(const std::string& name) const;
+    size_t count(Change kind) const;
+    size_t dirty_count() const;
+};
+
+struct MergeResult {
+    LockFile lock;
+    ChangeSet changes;
+};
+
 LockFile load(const fs::path& path);
 void save(const LockFile& lock, const fs::path& path);
-LockFile merge(const LockFile& old_lock, const std::vector<Dependency>& new_deps);
+MergeResult merge(const LockFile& old_lock, const std::vector<Dependency>& new_deps);
+// Name of the args field holding the fetcher hash ("hash" or "sha256")
+std::string_view hash_field(const Dependency& dep);
+// Whether the dependency carries a real (non-placeholder) hash
+bool is_pinned(const Dependency& dep);
+// Same fetcher and arguments, ignoring the hash itself
+bool same_source(const Dependency& a, const Dependency& b);
 } // namespace lockfile
 
+// Resolver - Pin tags and branches to commits before anything is fetched or cached.
+// The lock keeps the requested ref in metadata["ref"] and the commit in args.rev.
+namespace resolver {
+// A full hex object id, which needs no resolving
+bool is_commit_id(std::string_view rev);
+// The remote a git dependency is fetched from; empty for other fetchers
+std::string remote_url(const Dependency& dep);
+// Point `dep` at `commit`, remembering what was asked for
+void pin(Dependency& dep, const std::string& commit);
+// Reuse the commit `lock` already resolved the same ref to; false if it has none
+bool apply_locked(Dependency& dep, const LockFile& lock);
+
+// Answers from `git ls-remote`, one call per repository for all of its refs. Lookups
+// are remembered, so a ref is asked for at most once per run. Thread-safe.
+class Resolver {
+  public:
+    explicit Resolver(unsigned jobs = 0, bool verbose = false);
+
+    // Commit `ref` points to in `url`; nullopt if the remote doesn't have it
+    std::optional<std::string> resolve(const std::string& url, const std::string& ref);
+    // Pin every git dependency with a symbolic rev, grouping them by repository and
+    // querying repositories concurrently. Unresolvable refs are reported and kept.
+    // Returns the number of dependencies pinned.
+    size_t resolve_all(const std::vector<Dependency*>& deps);
+
+    size_t remote_calls() const {
+        return remote_calls_;
+    }
+
+  private:
+    // One ls-remote for `refs`; false (after a warning) if the remote couldn't be listed
+    bool query(const std::string& url, const std::vector<std::string>& refs);
+    std::optional<std::string> lookup(const std::string& key, const std::string& ref);
+
+    unsigned jobs_;
+    bool verbose_;
+    std::mutex mutex_;
+    // Normalized URL -> requested ref -> commit ("" when the remote lacks it or failed)
+    std::map<std::string, std::map<std::string, std::string>> known_;
+    std::set<std::string> unreachable_; // Normalized URLs ls-remote failed for
+    std::atomic<size_t> remote_calls_ = 0;
+};
+} // namespace resolver
+
 // Prefetching - Fetch actual hashes for dependencies
 namespace prefetcher {
-void prefetch_all(LockFile& lock, bool verbose = false);
+struct Options {
+    unsigned jobs = 0;      // Worker threads (0 = std::thread::hardware_concurrency())
+    unsigned host_jobs = 4; // Per-host cap so a single forge doesn't throttle us
+    bool verbose = false;
+    cache::PrefetchCache* cache = nullptr; // Consulted before fetching anything
+    // Shell out to nix-prefetch-github/-git/-url instead of hashing in-process
+    bool external = false;
+    fs::path mirror_dir; // Bare git mirrors for fetchgit (empty = a throwaway mirror per fetch)
+    // Also register fetchgit checkouts in the Nix store, named "source"
+    bool add_to_store = false;
+    // Restrict prefetching to the dirty entries of a merge (null = every unpinned entry)
+    const lockfile::ChangeSet* changes = nullptr;
+    // Pins symbolic revs to commits before fetching, so caches are keyed by commit
+    // (null = prefetch_all uses a resolver of its own, a Pipeline fetches refs as given)
+    resolver::Resolver* resolver = nullptr;
+};
+
+// Prefetches dependencies as they are submitted, e.g. while discovery is still
+// running. Workers start with the first submission; finish() waits for them.
+class Pipeline {
+  public:
+    struct Result {
+        std::string name;
+        std::string key;  // source_key() of the dependency, after resolving its rev
+        std::string rev;  // Commit a symbolic rev was resolved to, if it was
+        std::string hash; // Empty if the prefetch failed
+        std::string error;
+        std::chrono::duration<double> elapsed{0};
+    };
+
+    explicit Pipeline(const Options& options);
+    ~Pipeline();
+    Pipeline(const Pipeline&) = delete;
+    Pipeline& operator=(const Pipeline&) = delete;
+
+    // Queue a prefetch; a source that was already submitted is fetched only once
+    void submit(const Dependency& dep);
+    // Stop accepting work and wait for everything submitted, in submission order
+    std::vector<Result> finish();
+    unsigned workers() const;
+    std::chrono::duration<double> elapsed() const; // Since construction
+
+  private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+// Resolves and prefetches every unpinned entry (or the dirty ones of `changes`).
+// Returns the number of dependencies whose hash or rev was updated.
+size_t prefetch_all(LockFile& lock, const Options& options = {});
+std::string host_of(const Dependency& dep);
+// What a prefetch depends on: fetcher, repository or URL, and rev
+std::string source_key(const Dependency& dep);
+// Fixed-output hash (SRI) of what fetchFromGitHub / fetchgit / fetchurl would fetch
 std::string prefetch_github(const std::string& owner, const std::string& repo,
-                            const std::string& rev);
-std::string prefetch_git(const std::string& url, const std::string& rev);
-std::string prefetch_url(const std::string& url);
+                            const std::string& rev, const Options& options = {});
+std::string prefetch_git(const std::string& url, const std::string& rev,
+                         const Options& options = {});
+std::string prefetch_url(const std::string& url, const Options& options = {});
+std::string prefetch_zip(const std::string& url, const Options& options = {});
 } // namespace prefetcher
 
 // Generator - Generate Nix expressions
 namespace generator {
 std::string generate_packages_nix(const LockFile& lock);
+// Sharded layout: a single dependency's file, and an index that imports them lazily
+std::string generate_package_nix(const Dependency& dep);
+std::string generate_packages_index(const LockFile& lock, std::string_view shard_dir);
+std::string shard_file_name(std::string_view name);
+std::string nix_string(std::string_view value); // Quoted, escaped Nix string literal
 std::string generate_env_nix(const std::string& nix_cmake_path);
 std::string generate_default_nix(const ProjectInfo& info);
 void write_all(const Config& config, const LockFile& lock, const ProjectInfo& info);
+// Whether the outputs of a previous write_all are intact and were generated from
+// the current lock file and project info
+bool up_to_date(const Config& config, const ProjectInfo& info);
 } // namespace generator
 
+// Manifest - Dependency search paths for cmakeBuildHook.cmake (nix-deps.cmake), classified
+// and de-duplicated once per derivation build instead of probed on every configure
+namespace manifest {
+// Bump when the variables nix-deps.cmake defines change; the hook ignores other versions
+inline constexpr int format_version = 1;
+
+struct PathList {
+    std::vector<std::string> paths; // First-seen order
+    std::set<std::string> seen;
+};
+
+struct SearchPaths {
+    PathList prefix;
+    PathList include;
+    PathList library;
+    PathList program;
+    PathList framework;
+    PathList appbundle;
+    std::map<std::string, std::string> source_dirs; // FETCHCONTENT_SOURCE_DIR_<NAME> -> path
+};
+
+// Store paths of the stdenv dependency variables (buildInputs, nativeBuildInputs, ...)
+// relative to the given platform offsets, plus FETCHCONTENT_SOURCE_DIR_* from the
+// environment; the same classification as the hook's own fallback
+SearchPaths collect(int host_offset = 0, int target_offset = 0);
+std::string generate(const SearchPaths& paths, int host_offset = 0, int target_offset = 0);
+
+// Bump when the variables the package index defines change
+inline constexpr int package_index_version = 1;
+// Where find_package() would find each package's config file searching `prefixes` in
+// order, keyed by lowercase package name: <prefix>/(lib*|share)/cmake/<name>*/, then
+// <prefix>/(lib*|share)/<name>*/ and <prefix>/(lib*|share)/<name>*/(cmake|CMake)/.
+// Prefixes are scanned concurrently.
+std::map<std::string, std::string> index_packages(const std::vector<std::string>& prefixes,
+                                                  unsigned jobs = 0);
+std::string generate_package_index(const std::map<std::string, std::string>& index);
+} // namespace manifest
+
+// Codemodel - Targets of a configured build, from the CMake File API codemodel reply
+namespace codemodel {
+struct Target {
+    std::string name;
+    std::string id;
+    std::string type; // EXECUTABLE, STATIC_LIBRARY, ..., INTERFACE_LIBRARY, UTILITY
+    bool imported = false;
+    bool generator_provided = false;
+    std::string source_dir;                // paths.source: relative to the source root if inside it
+    std::string build_dir;                 // paths.build: relative to the build root
+    std::vector<std::string> artifacts;    // Relative to the build root if inside it
+    std::vector<std::string> dependencies; // Ids of the targets built before this one
+    std::vector<std::string> link_dependencies; // Ids of the targets linked into this one
+    std::vector<std::string> sources;           // Relative to the source root if inside it
+};
+
+struct Model {
+    fs::path source_root;
+    fs::path build_root;
+    std::vector<Target> targets; // Of the first configuration, in reply order
+};
+
+// Reads the newest index-*.json of `reply_dir` (.cmake/api/v1/reply), its codemodel
+// and every target object, the target objects concurrently
+Model load(const fs::path& reply_dir, unsigned jobs = 0);
+// Built from FetchContent sources (under _deps/ or from the Nix store) rather than
+// the project's own
+bool is_dependency(const Target& target);
+// Dependency targets that have a build rule, by name. Without `all`, only those the
+// project's own targets depend on, directly or not.
+std::vector<const Target*> dependency_targets(const Model& model, bool all = false);
+// What building `targets` leaves in the build tree for a later build to reuse: their
+// object directories and artifacts, relative to the build root, if they exist
+std::vector<std::string> target_outputs(const Model& model,
+                                        const std::vector<const Target*>& targets);
+
+// Bump when the fields of the summary change
+inline constexpr int summary_version = 1;
+// The targets as lib/workspace.nix uses them (name, id, type, imported, link dependencies
+// by name, sources), without the build paths, so the summary can be checked in: as
+// JSON, or as a Nix expression to import
+std::string summary_json(const Model& model);
+std::string summary_nix(const Model& model);
+} // namespace codemodel
+
+// Compile cache - Object files of nix-compiler-launcher's compiles, keyed by the
+// preprocessed source, compiler and flags, in a local directory shared between builds
+namespace compile_cache {
+// Bump when what goes into a key changes; older entries are simply never hit
+inline constexpr int format_version = 3;
+inline constexpr uint64_t default_max_size = 5ull << 30;
+
+// A compiler command line, compiler first, and what caching it needs to know
+struct Invocation {
+    std::vector<std::string> args;
+    std::string output; // -o
+    std::string source; // The single input file
+    // Prints the preprocessed source to stdout, still writing the depfile
+    std::vector<std::string> preprocess;
+    // Flags that shape the object: all but the output, depfile and input names
+    std::vector<std::string> key_flags;
+    // What the cc-wrapper adds from the environment, by variable name: settings as
+    // NAME=value (NIX_HARDENING_ENABLE, ...), then each NIX_CFLAGS_COMPILE* or
+    // NIX_CXXSTDLIB_COMPILE* variable's name followed by its flags
+    std::vector<std::string> wrapper_flags;
+    // -g, in argv or NIX_CFLAGS_*: source paths end up in the object, so store paths
+    // are hashed verbatim
+    bool debug_info = false;
+    std::string uncacheable; // Why not, if it isn't (linking, -E, several inputs, ...)
+};
+
+Invocation parse(std::vector<std::string> args);
+// /nix/store/<hash>-<name> blanked, so a dependency bump that leaves its headers as
+// they were keeps its keys. Only line markers are rewritten: paths in the code itself
+// (__FILE__) end up in the object.
+std::string canonicalize_store_paths(std::string_view text, bool line_markers_only = false);
+// Flags as they go into a key: include directories with store paths blanked (the
+// preprocessed source covers them), plugin/specs/profile files by contents, no
+// -frandom-seed, and store paths elsewhere blanked if `canonical`
+std::vector<std::string> key_flags(const std::vector<std::string>& flags, bool canonical);
+// Resolved path of the compiler; outside the store also its size and mtime
+std::string compiler_identity(const std::string& compiler);
+std::string key(const Invocation& invocation, std::string_view compiler_identity,
+                std::string_view preprocessed);
+// "5G", "500M", "64K" or plain bytes
+uint64_t parse_size(std::string_view size);
+
+struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t uncacheable = 0;
+    uint64_t evicted = 0;
+    uint64_t bytes = 0; // Size of the entries, as of the last store or eviction
+};
+
+// Entries are objects/ab/<key>.o plus <key>.stderr for diagnostics to replay. The
+// stats file is updated under an exclusive flock, so any number of compiles may share
+// the directory; entries themselves appear by rename and are never partial.
+class Cache {
+  public:
+    explicit Cache(fs::path dir, uint64_t max_size = default_max_size);
+
+    // Copies the object to `output` and returns the diagnostics of the compile that
+    // produced it; nullopt on a miss. Hits refresh the entry's LRU time.
+    std::optional<std::string> restore(const std::string& key, const fs::path& output);
+    // Adds the object at `object`, then evicts least recently used entries while the
+    // cache is over its maximum size
+    void store(const std::string& key, const fs::path& object, std::string_view diagnostics);
+    void count(uint64_t Stats::*counter);
+
+    Stats stats() const;
+    void clear();
+    void zero_stats();
+
+  private:
+    fs::path entry_path(const std::string& key, std::string_view extension) const;
+    // Drops the oldest entries until the cache is under 90% of max_size_; returns bytes left
+    uint64_t evict(Stats& stats);
+    template <typename Update> void update_stats(Update update);
+
+    fs::path dir_;
+    uint64_t max_size_;
+};
+
+// Compile through the cache, returning the compiler's exit status; uncacheable
+// invocations and any cache failure just run the compiler
+int compile(const Invocation& invocation, Cache& cache);
+// Replace this process with the compiler, as the launcher would have; returns the
+// shell's 126 or 127 if it can't be executed
+int exec(const std::vector<std::string>& args);
+} // namespace compile_cache
+
 // Parser - Parse CMakeLists.txt
 namespace parser {
+// Tokens of a command invocation, as views into the source (escapes and
+// variable references are not processed)
+struct Argument {
+    enum class Kind { Unquoted, Quoted, Bracket };
+    Kind kind;
+    std::string_view text;
+};
+
+struct Command {
+    std::string_view name;
+    std::vector<Argument> arguments;
+    size_t line = 0;
+};
+
+// A dependency declared in CMake code, found without configuring
+struct CandidateDependency {
+    std::string kind; // FetchContent_Declare, CPMAddPackage, find_package
+    std::string name;
+    std::string version;
+    std::string git_repository;
+    std::string git_tag;
+    std::string url;
+    std::string url_hash;
+    fs::path file;
+    size_t line = 0;
+};
+
+struct ScanResult {
+    std::optional<ProjectInfo> project;
+    std::vector<CandidateDependency> dependencies;
+    std::vector<fs::path> files;
+    std::vector<std::string> errors; // Files reached but not parseable
+};
+
+void tokenize(std::string_view source, const std::function<void(const Command&)>& visit);
+ScanResult scan_tree(const fs::path& root, unsigned jobs = 0);
+
 ProjectInfo parse_cmake_lists(const fs::path& path);
 std::optional<std::string> extract_project_name(const std::string& content);
 std::optional<std::string> extract_version(const std::string& content);
@@ -93,6 +858,19 @@ void discover(const Config& config);
 void prefetch(const Config& config);
 void generate(const Config& config);
 void lock(const Config& config);
+void scan(const Config& config);
+void deps_manifest(const fs::path& file, int host_offset, int target_offset);
+// Without `prefixes`, indexes what the build environment provides (see deps_manifest)
+void index_prefixes(const fs::path& file, std::vector<std::string> prefixes, unsigned jobs);
+// Dependency targets of a configured build, one per line (their outputs with `outputs`)
+void deps_targets(const fs::path& reply_dir, bool all, bool outputs);
+// Summary of the reply to `file` (.nix for a Nix expression), or JSON to stdout
+void codemodel_summary(const fs::path& reply_dir, const fs::path& file, unsigned jobs);
+// `cmake2nix compile <compiler> <args>...`, as nix-compiler-launcher runs it when
+// NIX_CMAKE_COMPILE_CACHE is set; returns the compiler's exit status
+int compile(std::vector<std::string> args);
+// Print the compile cache's statistics, after clearing it or its counters if asked
+void compile_cache(const fs::path& dir, bool clear, bool zero_stats);
 void init(const fs::path& dir);
 void shell(const Config& config);
 void build(const Config& config);
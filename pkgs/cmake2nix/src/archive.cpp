@@ -0,0 +1,472 @@
+#include "cmake2nix.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <map>
+#include <unistd.h>
+#include <zlib.h>
+
+namespace cmake2nix::archive {
+
+namespace {
+constexpr size_t block_size = 512;
+constexpr size_t inflate_chunk = 64 * 1024;
+
+struct Node {
+    enum class Type { Directory, Regular, Symlink };
+
+    Type type = Type::Directory;
+    bool executable = false;
+    bool spilled = false; // Contents live in the spill file rather than in memory
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    std::string target;
+    std::map<std::string, std::unique_ptr<Node>> children; // Byte-wise order, as in a NAR
+};
+
+// Numeric header field: octal text, or base-256 when the top bit is set (GNU, large files)
+uint64_t parse_number(std::string_view field) {
+    if (!field.empty() && (uint8_t(field[0]) & 0x80) != 0) {
+        uint64_t value = uint8_t(field[0]) & 0x7f;
+        for (char c : field.substr(1)) {
+            value = value << 8 | uint8_t(c);
+        }
+        return value;
+    }
+    uint64_t value = 0;
+    for (char c : field) {
+        if (c >= '0' && c <= '7') {
+            value = value * 8 + uint64_t(c - '0');
+        } else if (c != ' ' && c != '\0') {
+            throw std::runtime_error("Corrupt tar archive: invalid numeric field");
+        }
+    }
+    return value;
+}
+
+// NUL-terminated header string
+std::string_view field_string(std::string_view field) {
+    return field.substr(0, std::min(field.find('\0'), field.size()));
+}
+
+bool is_zero_block(std::string_view block) {
+    return block.find_first_not_of('\0') == std::string_view::npos;
+}
+
+bool checksum_ok(std::string_view block) {
+    uint64_t expected = parse_number(block.substr(148, 8));
+    uint64_t sum = 0;
+    for (size_t i = 0; i < block.size(); ++i) {
+        sum += (i >= 148 && i < 156) ? uint8_t(' ') : uint8_t(block[i]);
+    }
+    return sum == expected;
+}
+} // namespace
+
+struct TarballHasher::State {
+    // What the bytes after the current header are
+    enum class Data { Header, Contents, Meta, Skip, End };
+
+    size_t memory_budget;
+    z_stream zs{};
+    bool inflating = false;
+    bool stream_end = false;
+
+    // Tar parser
+    std::string header;
+    Data data = Data::Header;
+    uint64_t remaining = 0; // Bytes of the current entry's data left
+    uint64_t padding = 0;   // Zero bytes after the data, up to the next block
+    char meta_type = 0;
+    std::string meta;
+    std::string long_name; // GNU 'L' / pax "path" for the next entry
+    std::string long_link; // GNU 'K' / pax "linkpath" for the next entry
+    std::optional<uint64_t> pax_size;
+    Node* current = nullptr;
+
+    // File contents
+    Node root;
+    std::string memory;
+    int spill_fd = -1;
+    uint64_t spill_size = 0;
+
+    ~State() {
+        if (inflating) {
+            inflateEnd(&zs);
+        }
+        if (spill_fd >= 0) {
+            ::close(spill_fd);
+        }
+    }
+
+    void inflate_all(std::string_view compressed) {
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(compressed.data()));
+        zs.avail_in = uInt(compressed.size());
+        std::array<char, inflate_chunk> out;
+        // Past the tar end blocks, inflate on to the gzip trailer so its CRC and length
+        // are checked; anything after that is ignored, like gzip -d does
+        while (zs.avail_in != 0 && !(stream_end && data == Data::End)) {
+            if (stream_end) {
+                // Another gzip member follows
+                inflateReset(&zs);
+                stream_end = false;
+            }
+            zs.next_out = reinterpret_cast<Bytef*>(out.data());
+            zs.avail_out = uInt(out.size());
+            int rc = inflate(&zs, Z_NO_FLUSH);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                throw std::runtime_error(fmt::format(
+                    "Corrupt gzip stream: {}", zs.msg != nullptr ? zs.msg : "inflate failed"));
+            }
+            stream_end = rc == Z_STREAM_END;
+            untar({out.data(), out.size() - zs.avail_out});
+        }
+    }
+
+    void untar(std::string_view input) {
+        while (!input.empty() && data != Data::End) {
+            if (data == Data::Header) {
+                size_t take = std::min(block_size - header.size(), input.size());
+                header.append(input.substr(0, take));
+                input.remove_prefix(take);
+                if (header.size() == block_size) {
+                    parse_header();
+                    header.clear();
+                }
+                continue;
+            }
+
+            if (remaining != 0) {
+                auto chunk = input.substr(0, size_t(std::min<uint64_t>(remaining, input.size())));
+                if (data == Data::Contents) {
+                    store(chunk);
+                } else if (data == Data::Meta) {
+                    meta.append(chunk);
+                }
+                remaining -= chunk.size();
+                input.remove_prefix(chunk.size());
+            } else {
+                size_t skip = size_t(std::min<uint64_t>(padding, input.size()));
+                padding -= skip;
+                input.remove_prefix(skip);
+            }
+            if (remaining == 0 && padding == 0) {
+                end_entry();
+            }
+        }
+    }
+
+    void begin_data(Data kind, uint64_t size) {
+        data = kind;
+        remaining = size;
+        padding = (block_size - size % block_size) % block_size;
+        if (size == 0) {
+            end_entry();
+        }
+    }
+
+    void end_entry() {
+        if (data == Data::Meta) {
+            apply_meta();
+        }
+        data = Data::Header;
+        current = nullptr;
+    }
+
+    void parse_header() {
+        std::string_view block = header;
+        if (is_zero_block(block)) {
+            // End of archive; ignore the second zero block and anything after it
+            data = Data::End;
+            return;
+        }
+        if (!checksum_ok(block)) {
+            throw std::runtime_error("Corrupt tar archive: header checksum mismatch");
+        }
+
+        char type = block[156];
+        uint64_t size = pax_size.value_or(parse_number(block.substr(124, 12)));
+        std::string name = std::exchange(long_name, {});
+        std::string link = std::exchange(long_link, {});
+        pax_size.reset();
+        if (name.empty()) {
+            name = field_string(block.substr(0, 100));
+            // POSIX ustar splits long names into prefix + name; GNU reuses those bytes
+            auto prefix = field_string(block.substr(345, 155));
+            if (block.substr(257, 6) == std::string_view("ustar\0", 6) && !prefix.empty()) {
+                name = fmt::format("{}/{}", prefix, name);
+            }
+        }
+        if (link.empty()) {
+            link = field_string(block.substr(157, 100));
+        }
+        bool executable = (parse_number(block.substr(100, 8)) & 0100) != 0;
+
+        switch (type) {
+        case 'x': // pax header for the next entry
+        case 'g': // pax global header (git archive puts the commit id here)
+        case 'L': // GNU long name
+        case 'K': // GNU long link name
+            meta_type = type;
+            meta.clear();
+            begin_data(Data::Meta, size);
+            return;
+        case '0':
+        case '\0':
+        case '7': {
+            Node& node = insert(name, Node::Type::Regular);
+            node.executable = executable;
+            node.size = size;
+            node.spilled = memory.size() + size > memory_budget;
+            node.offset = node.spilled ? spill_size : memory.size();
+            current = &node;
+            begin_data(Data::Contents, size);
+            return;
+        }
+        case '1': {
+            // Hard link: same contents (and mode) as an earlier entry
+            const Node* source = find(link);
+            if (source == nullptr || source->type != Node::Type::Regular) {
+                throw std::runtime_error(fmt::format("Tar hard link to missing file '{}'", link));
+            }
+            Node copy;
+            copy.type = Node::Type::Regular;
+            copy.executable = source->executable;
+            copy.spilled = source->spilled;
+            copy.offset = source->offset;
+            copy.size = source->size;
+            insert(name, Node::Type::Regular) = std::move(copy);
+            break;
+        }
+        case '2':
+            insert(name, Node::Type::Symlink).target = link;
+            break;
+        case '5':
+            insert(name, Node::Type::Directory);
+            break;
+        default:
+            // Devices and FIFOs can't be part of a fixed-output path
+            throw std::runtime_error(
+                fmt::format("Unsupported tar entry type '{}' for '{}'", type, name));
+        }
+        begin_data(Data::Skip, size);
+    }
+
+    void apply_meta() {
+        if (meta_type == 'L' || meta_type == 'K') {
+            (meta_type == 'L' ? long_name : long_link) = field_string(meta);
+            return;
+        }
+        if (meta_type != 'x') {
+            return;
+        }
+        // Records are "<length> <key>=<value>\n", the length counting the whole record
+        std::string_view records = meta;
+        while (!records.empty()) {
+            auto space = records.find(' ');
+            uint64_t length = space == std::string_view::npos
+                                  ? 0
+                                  : parse_decimal(std::string(records.substr(0, space)));
+            if (length <= space + 1 || length > records.size()) {
+                throw std::runtime_error("Corrupt tar archive: invalid pax record");
+            }
+            auto record = records.substr(space + 1, length - space - 2);
+            records.remove_prefix(length);
+
+            auto eq = record.find('=');
+            auto key = record.substr(0, eq);
+            auto value = eq == std::string_view::npos ? std::string_view() : record.substr(eq + 1);
+            if (key == "path") {
+                long_name = value;
+            } else if (key == "linkpath") {
+                long_link = value;
+            } else if (key == "size") {
+                pax_size = parse_decimal(std::string(value));
+            }
+        }
+    }
+
+    static uint64_t parse_decimal(const std::string& text) {
+        try {
+            size_t used = 0;
+            uint64_t value = std::stoull(text, &used, 10);
+            if (used == text.size()) {
+                return value;
+            }
+        } catch (const std::exception&) {
+        }
+        throw std::runtime_error("Corrupt tar archive: invalid pax number");
+    }
+
+    // Path components, rejecting anything that would escape the tree
+    static std::vector<std::string> split(std::string_view path) {
+        std::vector<std::string> parts;
+        while (!path.empty()) {
+            auto slash = path.find('/');
+            auto part = path.substr(0, slash);
+            path.remove_prefix(slash == std::string_view::npos ? path.size() : slash + 1);
+            if (part.empty() || part == ".") {
+                continue;
+            }
+            if (part == "..") {
+                throw std::runtime_error("Tar entry escapes the archive root");
+            }
+            parts.emplace_back(part);
+        }
+        return parts;
+    }
+
+    // Create (or replace, like extraction would) the node at `path`, with missing
+    // parent directories created implicitly
+    Node& insert(std::string_view path, Node::Type type) {
+        auto parts = split(path);
+        if (parts.empty()) {
+            if (type != Node::Type::Directory) {
+                throw std::runtime_error("Tar entry without a name");
+            }
+            return root;
+        }
+        Node* node = &root;
+        for (size_t i = 0; i < parts.size(); ++i) {
+            auto& child = node->children[parts[i]];
+            bool last = i + 1 == parts.size();
+            if (!child || (!last && child->type != Node::Type::Directory)) {
+                child = std::make_unique<Node>();
+            }
+            if (last && (type != Node::Type::Directory || child->type != type)) {
+                // A directory entry for an existing directory keeps its contents
+                *child = Node{};
+                child->type = type;
+            }
+            node = child.get();
+        }
+        return *node;
+    }
+
+    const Node* find(std::string_view path) const {
+        const Node* node = &root;
+        for (const auto& part : split(path)) {
+            if (node->type != Node::Type::Directory) {
+                return nullptr;
+            }
+            auto it = node->children.find(part);
+            if (it == node->children.end()) {
+                return nullptr;
+            }
+            node = it->second.get();
+        }
+        return node;
+    }
+
+    void store(std::string_view chunk) {
+        if (!current->spilled) {
+            memory.append(chunk);
+            return;
+        }
+        if (spill_fd < 0) {
+            auto path = fsutil::make_temp_file(fs::temp_directory_path(), "cmake2nix-spill-");
+            spill_fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+            ::unlink(path.c_str());
+            if (spill_fd < 0) {
+                throw std::runtime_error(
+                    fmt::format("Failed to open spill file: {}", std::strerror(errno)));
+            }
+        }
+        while (!chunk.empty()) {
+            ssize_t n = ::write(spill_fd, chunk.data(), chunk.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                throw std::runtime_error(
+                    fmt::format("Failed to write spill file: {}", std::strerror(errno)));
+            }
+            spill_size += uint64_t(n);
+            chunk.remove_prefix(size_t(n));
+        }
+    }
+
+    void encode(const Node& node, nar::Encoder& encoder, std::vector<char>& buffer) const {
+        switch (node.type) {
+        case Node::Type::Symlink:
+            encoder.symlink(node.target);
+            break;
+        case Node::Type::Regular:
+            encoder.regular(node.executable, node.size);
+            if (!node.spilled) {
+                encoder.contents(std::string_view(memory).substr(node.offset, node.size));
+            } else {
+                for (uint64_t done = 0; done < node.size;) {
+                    size_t want = size_t(std::min<uint64_t>(buffer.size(), node.size - done));
+                    ssize_t n = ::pread(spill_fd, buffer.data(), want, off_t(node.offset + done));
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n <= 0) {
+                        throw std::runtime_error("Failed to read spill file");
+                    }
+                    encoder.contents({buffer.data(), size_t(n)});
+                    done += uint64_t(n);
+                }
+            }
+            encoder.end_regular();
+            break;
+        case Node::Type::Directory:
+            encoder.begin_directory();
+            for (const auto& [name, child] : node.children) {
+                encoder.entry(name);
+                encode(*child, encoder, buffer);
+                encoder.end_entry();
+            }
+            encoder.end_directory();
+            break;
+        }
+    }
+};
+
+TarballHasher::TarballHasher(size_t memory_budget) : state_(std::make_unique<State>()) {
+    state_->memory_budget = memory_budget;
+    // 32 + MAX_WBITS: accept gzip or zlib framing
+    if (inflateInit2(&state_->zs, 32 + MAX_WBITS) != Z_OK) {
+        throw std::runtime_error("Failed to initialise zlib");
+    }
+    state_->inflating = true;
+}
+
+TarballHasher::~TarballHasher() = default;
+
+void TarballHasher::update(std::string_view compressed) {
+    state_->inflate_all(compressed);
+}
+
+digest::Sha256::Digest TarballHasher::finish() {
+    auto& state = *state_;
+    bool tar_complete = state.data == State::Data::End ||
+                        (state.data == State::Data::Header && state.header.empty());
+    if (!tar_complete || !state.stream_end) {
+        throw std::runtime_error("Truncated tar.gz archive");
+    }
+
+    // fetchzip keeps the single top-level entry; a lone file stays inside a directory
+    if (state.root.children.size() != 1) {
+        throw std::runtime_error(
+            fmt::format("Archive must contain a single file or directory, found {} entries",
+                        state.root.children.size()));
+    }
+    const Node& top = *state.root.children.begin()->second;
+    const Node& tree = top.type == Node::Type::Directory ? top : state.root;
+
+    digest::Sha256 sha;
+    nar::Encoder encoder(sha);
+    std::vector<char> buffer(inflate_chunk);
+    state.encode(tree, encoder, buffer);
+    return sha.finish();
+}
+
+uint64_t TarballHasher::spilled_bytes() const {
+    return state_->spill_size;
+}
+
+} // namespace cmake2nix::archive
@@ -0,0 +1,64 @@
+#include "cmake2nix.hpp"
+
+#include <cstdlib>
+#include <fmt/core.h>
+#include <fstream>
+
+namespace cmake2nix::cache {
+
+fs::path default_dir() {
+    if (const char* dir = std::getenv("CMAKE2NIX_CACHE_DIR"); dir && *dir) {
+        return dir;
+    }
+    if (const char* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+        return fs::path(xdg) / "cmake2nix";
+    }
+    if (const char* home = std::getenv("HOME"); home && *home) {
+        return fs::path(home) / ".cache" / "cmake2nix";
+    }
+    return fs::temp_directory_path() / "cmake2nix-cache";
+}
+
+PrefetchCache::PrefetchCache(fs::path dir) : dir_(std::move(dir) / "prefetch") {}
+
+std::string PrefetchCache::key(std::string_view method, std::string_view source,
+                               std::string_view rev) {
+    return fmt::format("{}\n{}\n{}", method, source, rev);
+}
+
+fs::path PrefetchCache::entry_path(const std::string& key) const {
+    // Content-addressed layout: prefetch/ab/abcdef... keeps directories small
+    std::string digest = digest::sha256_hex(key);
+    return dir_ / digest.substr(0, 2) / digest;
+}
+
+std::optional<std::string> PrefetchCache::lookup(const std::string& key) {
+    std::ifstream file(entry_path(key));
+    if (file) {
+        try {
+            json entry = json::parse(file);
+            // Guard against truncated or foreign files rather than trusting the name
+            if (entry.value("key", "") == key && entry.contains("hash")) {
+                hits_++;
+                return entry["hash"].get<std::string>();
+            }
+        } catch (const json::exception&) {
+        }
+    }
+    misses_++;
+    return std::nullopt;
+}
+
+void PrefetchCache::store(const std::string& key, const std::string& hash) {
+    // write_atomic's temp file + rename keeps concurrent readers and writers safe:
+    // readers only ever see complete entries, and racing writers store the same content.
+    // The cache is best-effort, so a failed write is not an error.
+    auto path = entry_path(key);
+    try {
+        fs::create_directories(path.parent_path());
+        fsutil::write_atomic(path, json{{"key", key}, {"hash", hash}}.dump() + "\n");
+    } catch (const std::exception&) {
+    }
+}
+
+} // namespace cmake2nix::cache
@@ -0,0 +1,305 @@
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <fmt/core.h>
+#include <thread>
+#include <unordered_map>
+
+namespace cmake2nix::codemodel {
+
+namespace {
+json read_json(const fs::path& path) {
+    try {
+        fsutil::MappedFile file(path);
+        return json::parse(file.text());
+    } catch (const json::exception& e) {
+        throw std::runtime_error(fmt::format("Failed to parse {}: {}", path.string(), e.what()));
+    }
+}
+
+// CMake writes a new index on every query; readers take the lexicographically last
+fs::path latest_index(const fs::path& reply_dir) {
+    fs::path latest;
+    std::error_code ec;
+    for (fs::directory_iterator it(reply_dir, ec), end; !ec && it != end; it.increment(ec)) {
+        auto name = it->path().filename().string();
+        if (name.starts_with("index-") && name.ends_with(".json") &&
+            (latest.empty() || name > latest.filename().string())) {
+            latest = it->path();
+        }
+    }
+    if (latest.empty()) {
+        throw std::runtime_error(
+            fmt::format("No File API reply in {} (was a codemodel query written before "
+                        "configuring?)",
+                        reply_dir.string()));
+    }
+    return latest;
+}
+
+bool is_library(std::string_view type) {
+    return type == "STATIC_LIBRARY" || type == "SHARED_LIBRARY" || type == "MODULE_LIBRARY" ||
+           type == "OBJECT_LIBRARY" || type == "INTERFACE_LIBRARY";
+}
+
+// Whether link_dependencies came from linkLibraries rather than still to be derived
+bool parse_target(const json& j, Target& target) {
+    target.name = j.value("name", "");
+    target.id = j.value("id", "");
+    target.type = j.value("type", "");
+    target.imported = j.value("imported", false);
+    target.generator_provided = j.value("isGeneratorProvided", false);
+    if (auto paths = j.find("paths"); paths != j.end()) {
+        target.source_dir = paths->value("source", "");
+        target.build_dir = paths->value("build", "");
+    }
+    for (const auto& artifact : j.value("artifacts", json::array())) {
+        target.artifacts.push_back(artifact.value("path", ""));
+    }
+    for (const auto& dependency : j.value("dependencies", json::array())) {
+        target.dependencies.push_back(dependency.value("id", ""));
+    }
+    for (const auto& source : j.value("sources", json::array())) {
+        target.sources.push_back(source.value("path", ""));
+    }
+    // Newer codemodels list what target_link_libraries() named; imported and plain
+    // library names have no id
+    auto link_libraries = j.find("linkLibraries");
+    if (link_libraries == j.end()) {
+        return false;
+    }
+    for (const auto& library : *link_libraries) {
+        if (auto id = library.value("id", ""); !id.empty()) {
+            target.link_dependencies.push_back(std::move(id));
+        }
+    }
+    return true;
+}
+
+using TargetsById = std::unordered_map<std::string_view, const Target*>;
+
+TargetsById index_by_id(const Model& model) {
+    TargetsById by_id;
+    for (const auto& target : model.targets) {
+        by_id.emplace(target.id, &target);
+    }
+    return by_id;
+}
+
+// Link dependencies by name; ids also encode the directory
+std::vector<std::string> link_names(const Target& target, const TargetsById& by_id) {
+    std::vector<std::string> names;
+    for (const auto& id : target.link_dependencies) {
+        if (auto it = by_id.find(id); it != by_id.end()) {
+            names.push_back(it->second->name);
+        }
+    }
+    return names;
+}
+
+// Whether `cmake --build --target <name>` has anything to build
+bool has_build_rule(const Target& target) {
+    return !target.imported && !target.generator_provided && target.type != "INTERFACE_LIBRARY";
+}
+} // namespace
+
+Model load(const fs::path& reply_dir, unsigned jobs) {
+    json index = read_json(latest_index(reply_dir));
+    std::string codemodel_file;
+    for (const auto& object : index.value("objects", json::array())) {
+        if (object.value("kind", "") == "codemodel") {
+            codemodel_file = object.value("jsonFile", "");
+            break;
+        }
+    }
+    if (codemodel_file.empty()) {
+        throw std::runtime_error(
+            fmt::format("The File API reply in {} has no codemodel", reply_dir.string()));
+    }
+
+    json codemodel = read_json(reply_dir / codemodel_file);
+    Model model;
+    if (auto paths = codemodel.find("paths"); paths != codemodel.end()) {
+        model.source_root = paths->value("source", "");
+        model.build_root = paths->value("build", "");
+    }
+    const auto& configurations = codemodel.value("configurations", json::array());
+    if (configurations.empty()) {
+        return model;
+    }
+    const auto& entries = configurations[0].value("targets", json::array());
+    model.targets.resize(entries.size());
+
+    // One file per target; large projects have thousands
+    std::vector<char> linked(entries.size());
+    std::vector<std::exception_ptr> errors(entries.size());
+    std::atomic<size_t> next = 0;
+    {
+        unsigned workers = jobs != 0 ? jobs : std::thread::hardware_concurrency();
+        std::vector<std::jthread> pool;
+        size_t count = std::clamp<size_t>(workers, 1, std::max<size_t>(entries.size(), 1));
+        for (size_t i = 0; i < count; ++i) {
+            pool.emplace_back([&] {
+                for (size_t j; (j = next++) < entries.size();) {
+                    try {
+                        auto file = reply_dir / entries[j].value("jsonFile", "");
+                        linked[j] = parse_target(read_json(file), model.targets[j]);
+                    } catch (...) {
+                        errors[j] = std::current_exception();
+                    }
+                }
+            });
+        }
+    }
+    for (const auto& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    // Older codemodels only have the build order: a library built first is linked
+    auto by_id = index_by_id(model);
+    for (size_t i = 0; i < model.targets.size(); ++i) {
+        if (linked[i]) {
+            continue;
+        }
+        auto& target = model.targets[i];
+        for (const auto& id : target.dependencies) {
+            auto it = by_id.find(id);
+            if (it != by_id.end() && is_library(it->second->type)) {
+                target.link_dependencies.push_back(id);
+            }
+        }
+    }
+    return model;
+}
+
+bool is_dependency(const Target& target) {
+    // FetchContent builds into <build>/_deps/<name>-build; sources provided through
+    // FETCHCONTENT_SOURCE_DIR_<NAME> are absolute store paths
+    return target.build_dir == "_deps" || target.build_dir.starts_with("_deps/") ||
+           target.source_dir.starts_with("/nix/store/");
+}
+
+std::vector<const Target*> dependency_targets(const Model& model, bool all) {
+    auto by_id = index_by_id(model);
+
+    std::set<const Target*> selected;
+    if (all) {
+        for (const auto& target : model.targets) {
+            if (is_dependency(target)) {
+                selected.insert(&target);
+            }
+        }
+    } else {
+        // Everything reachable from the project's own targets
+        std::deque<const Target*> queue;
+        std::set<const Target*> visited;
+        for (const auto& target : model.targets) {
+            if (!is_dependency(target)) {
+                queue.push_back(&target);
+                visited.insert(&target);
+            }
+        }
+        while (!queue.empty()) {
+            const Target* target = queue.front();
+            queue.pop_front();
+            if (is_dependency(*target)) {
+                selected.insert(target);
+            }
+            for (const auto& id : target->dependencies) {
+                auto it = by_id.find(id);
+                if (it != by_id.end() && visited.insert(it->second).second) {
+                    queue.push_back(it->second);
+                }
+            }
+        }
+    }
+
+    std::vector<const Target*> targets;
+    for (const Target* target : selected) {
+        if (has_build_rule(*target)) {
+            targets.push_back(target);
+        }
+    }
+    std::sort(targets.begin(), targets.end(),
+              [](const Target* a, const Target* b) { return a->name < b->name; });
+    return targets;
+}
+
+std::vector<std::string> target_outputs(const Model& model,
+                                        const std::vector<const Target*>& targets) {
+    std::set<std::string> outputs;
+    auto add = [&](const fs::path& relative) {
+        std::error_code ec;
+        auto path = relative.lexically_normal();
+        if (!path.empty() && path.is_relative() && !path.string().starts_with("..") &&
+            fs::exists(model.build_root / path, ec)) {
+            outputs.insert(path.string());
+        }
+    };
+    for (const Target* target : targets) {
+        // Objects of the Makefile and Ninja generators
+        add(fs::path(target->build_dir) / "CMakeFiles" / (target->name + ".dir"));
+        for (const auto& artifact : target->artifacts) {
+            add(artifact);
+        }
+    }
+    return {outputs.begin(), outputs.end()};
+}
+
+std::string summary_json(const Model& model) {
+    auto by_id = index_by_id(model);
+    json targets = json::array();
+    for (const auto& target : model.targets) {
+        targets.push_back({
+            {"name", target.name},
+            {"id", target.id},
+            {"type", target.type},
+            {"imported", target.imported},
+            {"linkDependencies", link_names(target, by_id)},
+            {"sources", target.sources},
+        });
+    }
+    json summary = {{"version", summary_version}, {"targets", std::move(targets)}};
+    return summary.dump(2) + "\n";
+}
+
+std::string summary_nix(const Model& model) {
+    auto by_id = index_by_id(model);
+    auto list = [](const std::vector<std::string>& items) {
+        std::string out = "[";
+        for (const auto& item : items) {
+            out += ' ';
+            out += generator::nix_string(item);
+        }
+        out += " ]";
+        return out;
+    };
+
+    std::string out;
+    out += "# Generated by cmake2nix codemodel\n";
+    out += "# Do not edit this file manually\n";
+    fmt::format_to(std::back_inserter(out), "{{\n  version = {};\n  targets = [\n",
+                   summary_version);
+    for (const auto& target : model.targets) {
+        fmt::format_to(std::back_inserter(out),
+                       "    {{\n"
+                       "      name = {};\n"
+                       "      id = {};\n"
+                       "      type = {};\n"
+                       "      imported = {};\n"
+                       "      linkDependencies = {};\n"
+                       "      sources = {};\n"
+                       "    }}\n",
+                       generator::nix_string(target.name), generator::nix_string(target.id),
+                       generator::nix_string(target.type), target.imported ? "true" : "false",
+                       list(link_names(target, by_id)), list(target.sources));
+    }
+    out += "  ];\n}\n";
+    return out;
+}
+
+} // namespace cmake2nix::codemodel
@@ -1,28 +1,89 @@
 #include "cmake2nix.hpp"
 
+#include <algorithm>
+#include <cstdlib>
 #include <fmt/core.h>
 #include <fstream>
+#include <map>
 
 namespace cmake2nix::commands {
 
-void discover(const Config& config) {
-    auto deps = discovery::run(config);
+namespace {
+LockFile load_existing(const Config& config) {
+    return fs::exists(config.lock_file) ? lockfile::load(config.lock_file) : LockFile{};
+}
 
-    // Load existing lock file if it exists
-    LockFile lock;
-    if (fs::exists(config.lock_file)) {
-        lock = lockfile::load(config.lock_file);
-        lock = lockfile::merge(lock, deps);
-    } else {
-        lock.dependencies.clear();
-        for (const auto& dep : deps) {
-            lock.dependencies[dep.name] = dep;
+uint64_t compile_cache_size() {
+    const char* size = std::getenv("NIX_CMAKE_COMPILE_CACHE_SIZE");
+    return size && *size ? compile_cache::parse_size(size) : compile_cache::default_max_size;
+}
+
+// Run discovery and fold the result into the existing lock, reporting what changed.
+// Refs the old lock already pinned keep their commit; new ones are resolved through
+// `resolver` (if any), so the merge compares commits rather than tag names.
+lockfile::MergeResult discover_and_merge(const Config& config, const LockFile& old_lock,
+                                         resolver::Resolver* resolver = nullptr,
+                                         const discovery::DependencyCallback& on_dependency = {}) {
+    auto deps = discovery::run(config, on_dependency);
+    std::vector<Dependency*> unresolved;
+    for (auto& dep : deps) {
+        if (!resolver::apply_locked(dep, old_lock)) {
+            unresolved.push_back(&dep);
         }
     }
+    if (resolver != nullptr) {
+        resolver->resolve_all(unresolved);
+    }
+    auto result = lockfile::merge(old_lock, deps);
 
-    lockfile::save(lock, config.lock_file);
+    using lockfile::Change;
+    const auto& changes = result.changes;
+    fmt::print("cmake2nix: {} added, {} version changed, {} rev changed, {} hash changed, "
+               "{} unpinned, {} unchanged\n",
+               changes.count(Change::Added), changes.count(Change::VersionChanged),
+               changes.count(Change::RevChanged), changes.count(Change::HashChanged),
+               changes.count(Change::Unpinned), changes.count(Change::Unchanged));
+    return result;
+}
 
-    if (!config.no_prefetch) {
+prefetcher::Options prefetch_options(const Config& config, cache::PrefetchCache* cache,
+                                     resolver::Resolver* resolver = nullptr,
+                                     const lockfile::ChangeSet* changes = nullptr) {
+    fs::path mirror_dir;
+    if (!config.no_cache) {
+        mirror_dir = (config.cache_dir.empty() ? cache::default_dir() : config.cache_dir) / "git";
+    }
+    return {.jobs = config.jobs,
+            .host_jobs = config.host_jobs,
+            .verbose = config.verbose,
+            .cache = cache,
+            .external = config.external_prefetch,
+            .mirror_dir = std::move(mirror_dir),
+            .changes = changes,
+            .resolver = resolver};
+}
+
+std::unique_ptr<cache::PrefetchCache> open_cache(const Config& config) {
+    if (config.no_cache) {
+        return nullptr;
+    }
+    return std::make_unique<cache::PrefetchCache>(config.cache_dir.empty() ? cache::default_dir()
+                                                                           : config.cache_dir);
+}
+} // namespace
+
+void discover(const Config& config) {
+    // Resolving refs is a network round trip per repository; --no-prefetch skips it
+    // along with hashing
+    resolver::Resolver resolver(config.jobs, config.verbose);
+    auto result = discover_and_merge(config, load_existing(config),
+                                     config.no_prefetch ? nullptr : &resolver);
+    lockfile::save(result.lock, config.lock_file);
+
+    bool unpinned = std::ranges::any_of(result.lock.dependencies, [](const auto& entry) {
+        return !lockfile::is_pinned(entry.second);
+    });
+    if (unpinned && !config.no_prefetch) {
         fmt::print("cmake2nix: ⚠️  Lock file contains placeholder hashes\n");
         fmt::print("cmake2nix: Run 'cmake2nix prefetch' to fetch real hashes\n");
     }
@@ -30,24 +91,214 @@ void discover(const Config& config) {
 
 void prefetch(const Config& config) {
     auto lock = lockfile::load(config.lock_file);
-    prefetcher::prefetch_all(lock, config.verbose);
-    lockfile::save(lock, config.lock_file);
+    auto cache = open_cache(config);
+
+    // An already complete lock is left untouched
+    if (prefetcher::prefetch_all(lock, prefetch_options(config, cache.get())) != 0) {
+        lockfile::save(lock, config.lock_file);
+    }
 }
 
 void generate(const Config& config) {
-    auto lock = lockfile::load(config.lock_file);
     auto info = parser::parse_cmake_lists(config.input_file);
 
+    if (generator::up_to_date(config, info)) {
+        fmt::print("cmake2nix: Lock file unchanged since last generation, nothing to do\n");
+        return;
+    }
+
+    auto lock = lockfile::load(config.lock_file);
+
     fmt::print("cmake2nix: Generating Nix expressions for {} v{}\n", info.pname, info.version);
 
     generator::write_all(config, lock, info);
 }
 
 void lock(const Config& config) {
-    discover(config);
-    if (!config.no_prefetch) {
-        prefetch(config);
+    auto old_lock = load_existing(config);
+    if (config.no_prefetch) {
+        lockfile::save(discover_and_merge(config, old_lock).lock, config.lock_file);
+        return;
+    }
+
+    // Prefetch while discovery is still configuring: each dependency the build log
+    // reports goes straight to the pipeline, unless it declares its own hash or the
+    // existing lock already pins the same source (merge will keep that hash). The
+    // pipeline and the merge share one resolver, so each ref is looked up once.
+    auto cache = open_cache(config);
+    resolver::Resolver resolver(config.jobs, config.verbose);
+    prefetcher::Pipeline pipeline(prefetch_options(config, cache.get(), &resolver));
+    auto result = discover_and_merge(config, old_lock, &resolver, [&](const Dependency& reported) {
+        if (lockfile::is_pinned(reported)) {
+            return;
+        }
+        Dependency dep = reported;
+        resolver::apply_locked(dep, old_lock);
+        auto it = old_lock.dependencies.find(dep.name);
+        if (it != old_lock.dependencies.end() && it->second.version == dep.version &&
+            lockfile::same_source(it->second, dep) && lockfile::is_pinned(it->second)) {
+            return;
+        }
+        pipeline.submit(dep);
+    });
+
+    std::map<std::string, std::string> hashes;
+    for (auto& fetched : pipeline.finish()) {
+        if (!fetched.hash.empty()) {
+            hashes.emplace(std::move(fetched.key), std::move(fetched.hash));
+        }
+    }
+    size_t overlapped = 0;
+    for (auto& [name, dep] : result.lock.dependencies) {
+        if (lockfile::is_pinned(dep)) {
+            continue;
+        }
+        if (auto it = hashes.find(prefetcher::source_key(dep)); it != hashes.end()) {
+            dep.args[std::string(lockfile::hash_field(dep))] = it->second;
+            overlapped++;
+        }
+    }
+    if (!hashes.empty()) {
+        fmt::print("cmake2nix: Prefetched {} dependencies while discovery ran ({:.2f}s)\n",
+                   overlapped, pipeline.elapsed().count());
+    }
+
+    // Whatever the stream missed (cached discovery, recursive levels, failures)
+    bool unpinned = std::ranges::any_of(result.lock.dependencies, [&](const auto& entry) {
+        return result.changes.is_dirty(entry.first) && !lockfile::is_pinned(entry.second);
+    });
+    if (unpinned) {
+        prefetcher::prefetch_all(result.lock,
+                                 prefetch_options(config, cache.get(), &resolver, &result.changes));
     }
+    lockfile::save(result.lock, config.lock_file);
+}
+
+void scan(const Config& config) {
+    auto result = parser::scan_tree(config.input_file, config.jobs);
+
+    if (result.project) {
+        fmt::print("cmake2nix: Project {} v{}\n",
+                   result.project->pname.empty() ? "?" : result.project->pname,
+                   result.project->version.empty() ? "?" : result.project->version);
+    }
+    fmt::print("cmake2nix: Scanned {} CMake files\n", result.files.size());
+    if (config.verbose) {
+        for (const auto& file : result.files) {
+            fmt::print("  {}\n", file.string());
+        }
+    }
+    for (const auto& error : result.errors) {
+        fmt::print(stderr, "Warning: Failed to parse {}\n", error);
+    }
+
+    for (const auto& dep : result.dependencies) {
+        std::string source = !dep.git_repository.empty() ? dep.git_repository : dep.url;
+        std::string rev = !dep.git_tag.empty() ? dep.git_tag : dep.version;
+        fmt::print("  {:<22} {:<20} {}{}{}  ({}:{})\n", dep.kind, dep.name, source,
+                   rev.empty() || source.empty() ? "" : " @ ", rev,
+                   dep.file.filename().string(), dep.line);
+    }
+    fmt::print("cmake2nix: Found {} candidate dependencies\n", result.dependencies.size());
+}
+
+void deps_manifest(const fs::path& file, int host_offset, int target_offset) {
+    auto paths = manifest::collect(host_offset, target_offset);
+    bool written =
+        fsutil::write_if_changed(file, manifest::generate(paths, host_offset, target_offset));
+    fmt::print("cmake2nix: {} {} ({} prefixes, {} FetchContent sources)\n",
+               written ? "Generated" : "Unchanged", file.string(), paths.prefix.paths.size(),
+               paths.source_dirs.size());
+}
+
+void index_prefixes(const fs::path& file, std::vector<std::string> prefixes, unsigned jobs) {
+    if (prefixes.empty()) {
+        // The hook's search prefixes, and CMAKE_PREFIX_PATH as find_package() also uses it
+        prefixes = std::move(manifest::collect().prefix.paths);
+        if (const char* path = std::getenv("CMAKE_PREFIX_PATH"); path && *path) {
+            std::string_view entries = path;
+            while (!entries.empty()) {
+                auto colon = entries.find(':');
+                if (auto entry = entries.substr(0, colon); !entry.empty()) {
+                    prefixes.emplace_back(entry);
+                }
+                entries.remove_prefix(colon == std::string_view::npos ? entries.size() : colon + 1);
+            }
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto index = manifest::index_packages(prefixes, jobs);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    bool written = fsutil::write_if_changed(file, manifest::generate_package_index(index));
+    fmt::print("cmake2nix: {} {} ({} packages in {} prefixes, {:.2f}s)\n",
+               written ? "Generated" : "Unchanged", file.string(), index.size(), prefixes.size(),
+               elapsed.count());
+}
+
+void deps_targets(const fs::path& reply_dir, bool all, bool outputs) {
+    auto model = codemodel::load(reply_dir);
+    auto targets = codemodel::dependency_targets(model, all);
+    // Bare lines, for `cmake --build . --target $(cmake2nix deps-targets)`
+    if (outputs) {
+        for (const auto& path : codemodel::target_outputs(model, targets)) {
+            fmt::print("{}\n", path);
+        }
+    } else {
+        for (const auto* target : targets) {
+            fmt::print("{}\n", target->name);
+        }
+    }
+}
+
+void codemodel_summary(const fs::path& reply_dir, const fs::path& file, unsigned jobs) {
+    auto start = std::chrono::steady_clock::now();
+    auto model = codemodel::load(reply_dir, jobs);
+    if (file.empty()) {
+        fmt::print("{}", codemodel::summary_json(model));
+        return;
+    }
+    auto content = file.extension() == ".nix" ? codemodel::summary_nix(model)
+                                              : codemodel::summary_json(model);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    bool written = fsutil::write_if_changed(file, content);
+    fmt::print("cmake2nix: {} {} ({} targets, {:.2f}s)\n", written ? "Generated" : "Unchanged",
+               file.string(), model.targets.size(), elapsed.count());
+}
+
+int compile(std::vector<std::string> args) {
+    if (args.empty()) {
+        throw std::runtime_error("compile: no compiler given");
+    }
+    const char* dir = std::getenv("NIX_CMAKE_COMPILE_CACHE");
+    if (dir == nullptr || *dir == '\0') {
+        return compile_cache::exec(args);
+    }
+    compile_cache::Cache cache(dir, compile_cache_size());
+    return compile_cache::compile(compile_cache::parse(std::move(args)), cache);
+}
+
+void compile_cache(const fs::path& dir, bool clear, bool zero_stats) {
+    uint64_t max_size = compile_cache_size();
+    compile_cache::Cache cache(dir, max_size);
+    if (clear) {
+        cache.clear();
+        fmt::print("cmake2nix: Cleared {}\n", dir.string());
+    }
+    if (zero_stats) {
+        cache.zero_stats();
+    }
+
+    auto stats = cache.stats();
+    uint64_t lookups = stats.hits + stats.misses;
+    fmt::print("cmake2nix: Compile cache {}\n", dir.string());
+    fmt::print("  hits         {} ({:.1f}%)\n", stats.hits,
+               lookups != 0 ? 100.0 * double(stats.hits) / double(lookups) : 0.0);
+    fmt::print("  misses       {}\n", stats.misses);
+    fmt::print("  uncacheable  {}\n", stats.uncacheable);
+    fmt::print("  evicted      {}\n", stats.evicted);
+    fmt::print("  size         {:.1f} MiB of {:.1f} MiB\n", double(stats.bytes) / (1 << 20),
+               double(max_size) / (1 << 20));
 }
 
 void init(const fs::path& dir) {
@@ -0,0 +1,633 @@
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fmt/core.h>
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+#include <utility>
+
+extern char** environ;
+
+namespace cmake2nix::compile_cache {
+
+namespace {
+constexpr std::string_view store_dir = "/nix/store/";
+constexpr size_t store_hash_size = 32;
+
+// Options taking the next argument as their value
+constexpr std::array<std::string_view, 27> separate_value_options = {
+    "-o",          "-MF",      "-MT",       "-MQ",      "-x",          "-I",
+    "-D",          "-U",       "-include",  "-imacros", "-isystem",    "-idirafter",
+    "-iprefix",    "-iquote",  "-isysroot", "-target",  "-arch",       "-Xclang",
+    "-Xassembler", "-Xlinker", "-mllvm",    "-L",       "-F",          "-iwithprefix",
+    "-dumpbase",   "-dumpdir", "-Xpreprocessor",
+};
+
+// Options that write more than the object and depfile, or don't write an object
+constexpr std::array<std::string_view, 12> uncacheable_prefixes = {
+    "-save-temps",        "--coverage",         "-fprofile-arcs",  "-ftest-coverage",
+    "-fprofile-generate", "-fprofile-instr-generate", "-fcs-profile-generate",
+    "-gsplit-dwarf",      "-fmodule",           "-fdump-",         "-ftime-trace",
+    "-fstack-usage",
+};
+
+// What cc-wrapper reads from the environment when compiling (add-flags.sh,
+// add-hardening.sh), by base name. Each may also carry a role suffix
+// (NIX_CFLAGS_COMPILE_FOR_BUILD, NIX_CFLAGS_COMPILE_<target salt>, ...), and all of
+// them are taken. Link flags don't apply to -c, and everything else is the build's
+// own bookkeeping.
+constexpr std::array<std::string_view, 2> wrapper_flag_variables = {
+    "NIX_CFLAGS_COMPILE", // Also NIX_CFLAGS_COMPILE_BEFORE
+    "NIX_CXXSTDLIB_COMPILE",
+};
+constexpr std::array<std::string_view, 3> wrapper_setting_variables = {
+    "NIX_HARDENING_ENABLE", // A set: order doesn't matter
+    "NIX_ENFORCE_NO_NATIVE",
+    "NIX_ENFORCE_PURITY",
+};
+
+// Include directories: the preprocessed source already holds what was found there
+constexpr std::array<std::string_view, 4> include_dir_options = {
+    "-I",
+    "-isystem",
+    "-idirafter",
+    "-iquote",
+};
+
+// Options naming a file the compiler itself reads, which the key covers by contents
+constexpr std::array<std::string_view, 9> file_value_options = {
+    "-fplugin=",            "-fpass-plugin=",         "-specs=",
+    "--specs=",             "-fprofile-use=",         "-fprofile-sample-use=",
+    "-fprofile-instr-use=", "-fsanitize-ignorelist=", "-fsanitize-blacklist=",
+};
+
+// `base` itself, or `base` with a role suffix
+template <size_t N>
+bool is_variable(std::string_view name, const std::array<std::string_view, N>& bases) {
+    return std::any_of(bases.begin(), bases.end(), [&](auto base) {
+        return name == base || (name.starts_with(base) && name[base.size()] == '_');
+    });
+}
+
+template <size_t N>
+bool starts_with_any(std::string_view text, const std::array<std::string_view, N>& prefixes) {
+    return std::any_of(prefixes.begin(), prefixes.end(),
+                       [&](auto prefix) { return text.starts_with(prefix); });
+}
+
+std::vector<std::string> split_flags(std::string_view value) {
+    std::istringstream stream{std::string(value)};
+    std::vector<std::string> flags;
+    for (std::string flag; stream >> flag;) {
+        flags.push_back(std::move(flag));
+    }
+    return flags;
+}
+
+// The cc-wrapper's inputs from the environment, sorted by name: settings as
+// NAME=value, and each flag variable's name followed by its flags
+std::vector<std::string> wrapper_flags() {
+    std::vector<std::pair<std::string_view, std::string_view>> variables;
+    for (char** entry = environ; *entry != nullptr; ++entry) {
+        std::string_view variable = *entry;
+        auto eq = variable.find('=');
+        auto name = variable.substr(0, eq);
+        if (eq != std::string_view::npos && (is_variable(name, wrapper_flag_variables) ||
+                                             is_variable(name, wrapper_setting_variables))) {
+            variables.emplace_back(name, variable.substr(eq + 1));
+        }
+    }
+    std::sort(variables.begin(), variables.end());
+
+    std::vector<std::string> flags;
+    for (auto [name, value] : variables) {
+        if (name.starts_with("NIX_HARDENING_ENABLE")) {
+            auto features = split_flags(value);
+            std::sort(features.begin(), features.end());
+            features.erase(std::unique(features.begin(), features.end()), features.end());
+            std::string joined;
+            for (const auto& feature : features) {
+                joined += (joined.empty() ? "" : " ") + feature;
+            }
+            flags.push_back(fmt::format("{}={}", name, joined));
+        } else if (is_variable(name, wrapper_setting_variables)) {
+            flags.push_back(fmt::format("{}={}", name, value));
+        } else {
+            flags.emplace_back(name);
+            for (auto& flag : split_flags(value)) {
+                flags.push_back(std::move(flag));
+            }
+        }
+    }
+    return flags;
+}
+
+bool is_nix32(char c) {
+    // The nix32 alphabet: digits and lowercase letters but e, o, t and u
+    return (c >= '0' && c <= '9') ||
+           (c >= 'a' && c <= 'z' && c != 'e' && c != 'o' && c != 't' && c != 'u');
+}
+
+bool is_store_name_char(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '+' || c == '-' || c == '.' ||
+           c == '_' || c == '?' || c == '=';
+}
+
+void append_canonical(std::string& out, std::string_view text) {
+    size_t pos = 0;
+    while (true) {
+        size_t found = text.find(store_dir, pos);
+        if (found == std::string_view::npos) {
+            out.append(text.substr(pos));
+            return;
+        }
+        size_t hash = found + store_dir.size();
+        out.append(text.substr(pos, hash - pos));
+        pos = hash;
+        if (text.size() >= hash + store_hash_size + 1 && text[hash + store_hash_size] == '-' &&
+            std::all_of(text.begin() + hash, text.begin() + hash + store_hash_size, is_nix32)) {
+            // The name goes too, as it carries the version. 'e' isn't in the alphabet, so
+            // this never names a real path.
+            out.append(store_hash_size, 'e');
+            pos += store_hash_size + 1;
+            while (pos < text.size() && is_store_name_char(text[pos])) {
+                ++pos;
+            }
+        }
+    }
+}
+
+// `# 12 "file" 2` from the preprocessor, or a #line directive
+bool is_line_marker(std::string_view line) {
+    if (line.starts_with("#line")) {
+        return true;
+    }
+    return line.size() > 2 && line[0] == '#' && line[1] == ' ' && line[2] >= '0' &&
+           line[2] <= '9';
+}
+
+std::string read_file(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream content;
+    content << in.rdbuf();
+    return content.str();
+}
+
+void write_out(FILE* stream, std::string_view data) {
+    if (!data.empty()) {
+        std::fwrite(data.data(), 1, data.size(), stream);
+        std::fflush(stream);
+    }
+}
+
+Stats load_stats(const fs::path& file) {
+    Stats stats;
+    std::ifstream in(file);
+    if (!in) {
+        return stats;
+    }
+    try {
+        json j = json::parse(in);
+        stats.hits = j.value("hits", uint64_t(0));
+        stats.misses = j.value("misses", uint64_t(0));
+        stats.uncacheable = j.value("uncacheable", uint64_t(0));
+        stats.evicted = j.value("evicted", uint64_t(0));
+        stats.bytes = j.value("bytes", uint64_t(0));
+    } catch (const json::exception&) {
+        // A damaged stats file only loses the counters
+    }
+    return stats;
+}
+} // namespace
+
+int exec(const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    std::fflush(stdout);
+    ::execvp(argv[0], argv.data());
+    int error = errno;
+    fmt::print(stderr, "cmake2nix: {}: {}\n", args[0], std::strerror(error));
+    return error == ENOENT ? 127 : 126;
+}
+
+Invocation parse(std::vector<std::string> args) {
+    Invocation invocation;
+    if (args.empty()) {
+        invocation.uncacheable = "no compiler";
+        invocation.args = std::move(args);
+        return invocation;
+    }
+
+    bool compile_only = false;
+    bool wants_depfile = false;
+    bool has_depfile = false;
+    bool has_target = false;
+    size_t inputs = 0;
+    invocation.preprocess.push_back(args[0]);
+    for (size_t i = 1; i < args.size(); ++i) {
+        std::string_view arg = args[i];
+        bool separate = std::find(separate_value_options.begin(), separate_value_options.end(),
+                                  arg) != separate_value_options.end();
+        std::string_view value;
+        if (separate) {
+            if (i + 1 == args.size()) {
+                invocation.uncacheable = fmt::format("{} without a value", arg);
+                break;
+            }
+            value = args[i + 1];
+        }
+
+        if (arg == "-o" || (arg.starts_with("-o") && arg.size() > 2)) {
+            invocation.output = separate ? value : arg.substr(2);
+        } else if (arg.starts_with("-MF")) {
+            has_depfile = true;
+            invocation.preprocess.emplace_back(arg);
+            if (separate) {
+                invocation.preprocess.emplace_back(value);
+            }
+        } else if (arg.starts_with("-MT") || arg.starts_with("-MQ")) {
+            has_target = true;
+            invocation.preprocess.emplace_back(arg);
+            if (separate) {
+                invocation.preprocess.emplace_back(value);
+            }
+        } else if (arg == "-MD" || arg == "-MMD" || arg == "-MP") {
+            wants_depfile = wants_depfile || arg != "-MP";
+            invocation.preprocess.emplace_back(arg);
+        } else if (arg == "-c") {
+            compile_only = true;
+            invocation.key_flags.emplace_back(arg);
+        } else if (arg == "-E" || arg == "-S" || arg == "-M" || arg == "-MM") {
+            invocation.uncacheable = fmt::format("{} doesn't compile to an object", arg);
+        } else if (arg.starts_with('@')) {
+            invocation.uncacheable = "response file";
+        } else if (starts_with_any(arg, uncacheable_prefixes)) {
+            invocation.uncacheable = fmt::format("{} writes more than the object", arg);
+        } else if (arg == "-" || !arg.starts_with('-')) {
+            if (arg == "-") {
+                invocation.uncacheable = "source from stdin";
+            }
+            invocation.source = arg;
+            inputs++;
+            invocation.preprocess.emplace_back(arg);
+        } else {
+            if (arg.starts_with("-g") && arg != "-g0") {
+                invocation.debug_info = true;
+            }
+            invocation.preprocess.emplace_back(arg);
+            invocation.key_flags.emplace_back(arg);
+            if (separate) {
+                invocation.preprocess.emplace_back(value);
+                invocation.key_flags.emplace_back(value);
+            }
+        }
+        if (separate) {
+            ++i;
+        }
+    }
+
+    // The wrapper's flags from NIX_CFLAGS_COMPILE and friends shape the object as
+    // much as argv does, yet show up in neither argv nor the preprocessed source
+    invocation.wrapper_flags = wrapper_flags();
+    for (std::string_view flag : invocation.wrapper_flags) {
+        if (flag.starts_with("-g") && flag != "-g0") {
+            invocation.debug_info = true;
+        } else if (starts_with_any(flag, uncacheable_prefixes)) {
+            invocation.uncacheable = fmt::format("{} writes more than the object", flag);
+        }
+    }
+
+    if (!invocation.uncacheable.empty()) {
+        invocation.args = std::move(args);
+        return invocation;
+    }
+    if (!compile_only) {
+        invocation.uncacheable = "not a compile (-c)";
+    } else if (invocation.output.empty()) {
+        invocation.uncacheable = "no -o";
+    } else if (inputs != 1) {
+        invocation.uncacheable = inputs == 0 ? "no input" : "several inputs";
+    } else if (wants_depfile && !has_depfile) {
+        invocation.uncacheable = "depfile without -MF";
+    }
+
+    invocation.preprocess.emplace_back("-E");
+    if (wants_depfile && !has_target) {
+        // What the depfile names by default when compiling with -o
+        invocation.preprocess.emplace_back("-MT");
+        invocation.preprocess.push_back(invocation.output);
+    }
+    invocation.args = std::move(args);
+    return invocation;
+}
+
+std::string canonicalize_store_paths(std::string_view text, bool line_markers_only) {
+    std::string out;
+    out.reserve(text.size());
+    if (!line_markers_only) {
+        append_canonical(out, text);
+        return out;
+    }
+    while (!text.empty()) {
+        auto newline = text.find('\n');
+        auto line = text.substr(0, newline == std::string_view::npos ? text.size() : newline + 1);
+        if (is_line_marker(line)) {
+            append_canonical(out, line);
+        } else {
+            out.append(line);
+        }
+        text.remove_prefix(line.size());
+    }
+    return out;
+}
+
+std::string compiler_identity(const std::string& compiler) {
+    fs::path path = compiler;
+    if (compiler.find('/') == std::string::npos) {
+        const char* search = std::getenv("PATH");
+        std::string_view dirs = search != nullptr ? search : "";
+        while (!dirs.empty()) {
+            auto colon = dirs.find(':');
+            auto candidate = fs::path(dirs.substr(0, colon)) / compiler;
+            if (::access(candidate.c_str(), X_OK) == 0) {
+                path = candidate;
+                break;
+            }
+            dirs.remove_prefix(colon == std::string_view::npos ? dirs.size() : colon + 1);
+        }
+    }
+    path = fs::canonical(path);
+    // A store path already names its exact contents
+    if (path.string().starts_with(store_dir)) {
+        return path.string();
+    }
+    return fmt::format("{} {} {}", path.string(), fs::file_size(path),
+                       fs::last_write_time(path).time_since_epoch().count());
+}
+
+std::vector<std::string> key_flags(const std::vector<std::string>& flags, bool canonical) {
+    std::vector<std::string> out;
+    out.reserve(flags.size());
+    bool include_dir = false; // The previous flag was a bare -I, -isystem, ...
+    for (const auto& flag : flags) {
+        bool after_include = std::exchange(
+            include_dir, std::find(include_dir_options.begin(), include_dir_options.end(),
+                                   flag) != include_dir_options.end());
+        auto file_option = std::find_if(file_value_options.begin(), file_value_options.end(),
+                                        [&](auto option) { return flag.starts_with(option); });
+        if (after_include || starts_with_any(flag, include_dir_options)) {
+            out.push_back(canonicalize_store_paths(flag));
+        } else if (flag.starts_with("-frandom-seed=")) {
+            // nixpkgs derives it from the output path, so it changes with any input; it
+            // only names symbols that would otherwise be random
+            continue;
+        } else if (file_option != file_value_options.end() &&
+                   fs::is_regular_file(flag.substr(file_option->size()))) {
+            auto contents = read_file(flag.substr(file_option->size()));
+            out.push_back(fmt::format("{}sha256:{}", *file_option, digest::sha256_hex(contents)));
+        } else {
+            out.push_back(canonical ? canonicalize_store_paths(flag) : flag);
+        }
+    }
+    return out;
+}
+
+std::string key(const Invocation& invocation, std::string_view compiler_identity,
+                std::string_view preprocessed) {
+    digest::Sha256 sha;
+    sha.update(fmt::format("cmake2nix compile cache {}\n", format_version));
+    sha.update(compiler_identity);
+    sha.update("\n");
+    if (invocation.debug_info) {
+        // DW_AT_comp_dir
+        sha.update(fs::current_path().string());
+        sha.update("\n");
+    }
+    bool canonical = !invocation.debug_info;
+    for (const auto* flags : {&invocation.key_flags, &invocation.wrapper_flags}) {
+        for (const auto& flag : key_flags(*flags, canonical)) {
+            sha.update(flag);
+            sha.update(std::string_view("\0", 1));
+        }
+        sha.update("\n");
+    }
+    sha.update(canonical ? canonicalize_store_paths(preprocessed, true) : preprocessed);
+    return digest::to_hex(sha.finish());
+}
+
+uint64_t parse_size(std::string_view size) {
+    uint64_t value = 0;
+    size_t i = 0;
+    for (; i < size.size() && size[i] >= '0' && size[i] <= '9'; ++i) {
+        value = value * 10 + uint64_t(size[i] - '0');
+    }
+    auto unit = size.substr(i);
+    if (i == 0 || unit.size() > 1) {
+        throw std::runtime_error(fmt::format("Invalid size: {}", size));
+    }
+    switch (unit.empty() ? ' ' : unit[0]) {
+    case ' ':
+        return value;
+    case 'k':
+    case 'K':
+        return value << 10;
+    case 'm':
+    case 'M':
+        return value << 20;
+    case 'g':
+    case 'G':
+        return value << 30;
+    case 't':
+    case 'T':
+        return value << 40;
+    default:
+        throw std::runtime_error(fmt::format("Invalid size: {}", size));
+    }
+}
+
+Cache::Cache(fs::path dir, uint64_t max_size) : dir_(std::move(dir)), max_size_(max_size) {}
+
+fs::path Cache::entry_path(const std::string& key, std::string_view extension) const {
+    return dir_ / "objects" / key.substr(0, 2) / (key + std::string(extension));
+}
+
+std::optional<std::string> Cache::restore(const std::string& key, const fs::path& output) {
+    auto object = entry_path(key, ".o");
+    std::error_code ec;
+    if (!fs::exists(object, ec)) {
+        return std::nullopt;
+    }
+    auto diagnostics = entry_path(key, ".stderr");
+    std::string text = fs::exists(diagnostics, ec) ? read_file(diagnostics) : std::string();
+
+    // Copied rather than linked: the build may modify or strip its objects
+    auto dir = output.has_parent_path() ? output.parent_path() : fs::path(".");
+    auto temp = fsutil::make_temp_file(dir, "." + output.filename().string() + ".");
+    try {
+        fs::copy_file(object, temp, fs::copy_options::overwrite_existing);
+        fs::rename(temp, output);
+    } catch (const fs::filesystem_error&) {
+        // Evicted while copying
+        fs::remove(temp, ec);
+        return std::nullopt;
+    }
+    fs::last_write_time(object, fs::file_time_type::clock::now(), ec);
+    return text;
+}
+
+void Cache::store(const std::string& key, const fs::path& object, std::string_view diagnostics) {
+    auto path = entry_path(key, ".o");
+    fs::create_directories(path.parent_path());
+    uint64_t size = fs::file_size(object);
+    if (!diagnostics.empty()) {
+        fsutil::write_atomic(entry_path(key, ".stderr"), diagnostics);
+        size += diagnostics.size();
+    }
+    // The object last: its presence is what makes the entry a hit
+    auto temp = fsutil::make_temp_file(path.parent_path(), ".tmp-");
+    try {
+        fs::copy_file(object, temp, fs::copy_options::overwrite_existing);
+        fs::rename(temp, path);
+    } catch (...) {
+        std::error_code ec;
+        fs::remove(temp, ec);
+        throw;
+    }
+
+    update_stats([&](Stats& stats) {
+        stats.bytes += size;
+        if (stats.bytes > max_size_) {
+            stats.bytes = evict(stats);
+        }
+    });
+}
+
+uint64_t Cache::evict(Stats& stats) {
+    struct Entry {
+        fs::file_time_type used;
+        uint64_t size = 0;
+        fs::path object;
+    };
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(dir_ / "objects", ec);
+         it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (!it->is_regular_file(ec)) {
+            continue;
+        }
+        // Diagnostics count towards the total and go with their object
+        uint64_t size = it->file_size(ec);
+        total += size;
+        if (it->path().extension() == ".o") {
+            entries.push_back({it->last_write_time(ec), size, it->path()});
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    uint64_t target = max_size_ / 10 * 9;
+    for (const auto& entry : entries) {
+        if (total <= target) {
+            break;
+        }
+        auto diagnostics = fs::path(entry.object).replace_extension(".stderr");
+        uint64_t diagnostics_size =
+            fs::exists(diagnostics, ec) ? fs::file_size(diagnostics, ec) : 0;
+        if (fs::remove(entry.object, ec)) {
+            total -= entry.size;
+            stats.evicted++;
+        }
+        if (diagnostics_size != 0 && fs::remove(diagnostics, ec)) {
+            total -= diagnostics_size;
+        }
+    }
+    return total;
+}
+
+template <typename Update> void Cache::update_stats(Update update) {
+    fs::create_directories(dir_);
+    fsutil::FileLock lock(dir_ / "lock", true);
+    auto file = dir_ / "stats.json";
+    Stats stats = load_stats(file);
+    update(stats);
+    fsutil::write_atomic(file, json{{"hits", stats.hits},
+                                    {"misses", stats.misses},
+                                    {"uncacheable", stats.uncacheable},
+                                    {"evicted", stats.evicted},
+                                    {"bytes", stats.bytes}}
+                                       .dump() +
+                                   "\n");
+}
+
+void Cache::count(uint64_t Stats::*counter) {
+    update_stats([&](Stats& stats) { (stats.*counter)++; });
+}
+
+Stats Cache::stats() const {
+    // Written by rename, so a read without the lock still sees a whole file
+    return load_stats(dir_ / "stats.json");
+}
+
+void Cache::clear() {
+    update_stats([&](Stats& stats) {
+        fs::remove_all(dir_ / "objects");
+        stats.bytes = 0;
+    });
+}
+
+void Cache::zero_stats() {
+    update_stats([](Stats& stats) { stats = Stats{.bytes = stats.bytes}; });
+}
+
+int compile(const Invocation& invocation, Cache& cache) {
+    if (!invocation.uncacheable.empty()) {
+        cache.count(&Stats::uncacheable);
+        return exec(invocation.args);
+    }
+
+    std::string key;
+    try {
+        // The preprocessor's diagnostics come again from the compile, if it happens
+        auto preprocessed = subprocess::run(invocation.preprocess);
+        if (!preprocessed.ok()) {
+            cache.count(&Stats::uncacheable);
+            return exec(invocation.args);
+        }
+        key = compile_cache::key(invocation, compiler_identity(invocation.args[0]),
+                                 preprocessed.out);
+        if (auto diagnostics = cache.restore(key, invocation.output)) {
+            cache.count(&Stats::hits);
+            write_out(stderr, *diagnostics);
+            return 0;
+        }
+        cache.count(&Stats::misses);
+    } catch (const std::exception& e) {
+        fmt::print(stderr, "cmake2nix: compile cache: {}\n", e.what());
+        return exec(invocation.args);
+    }
+
+    auto result = subprocess::run(invocation.args);
+    write_out(stdout, result.out);
+    write_out(stderr, result.err);
+    if (result.ok()) {
+        try {
+            cache.store(key, invocation.output, result.err);
+        } catch (const std::exception& e) {
+            // The object is there either way; the cache is best-effort
+            fmt::print(stderr, "cmake2nix: compile cache: {}\n", e.what());
+        }
+    }
+    return result.exit_code;
+}
+
+} // namespace cmake2nix::compile_cache
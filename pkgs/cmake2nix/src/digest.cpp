@@ -0,0 +1,320 @@
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cctype>
+#include <cstring>
+
+namespace cmake2nix::digest {
+
+namespace {
+constexpr std::array<uint32_t, 64> k = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2,
+};
+
+constexpr std::array<uint32_t, 8> initial_state = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+constexpr std::string_view base64_chars =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+// Nix's base-32 alphabet omits e, o, u and t
+constexpr std::string_view nix32_chars = "0123456789abcdfghijklmnpqrsvwxyz";
+constexpr size_t nix32_length = (32 * 8 - 1) / 5 + 1;
+
+int nibble(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Decodes text.size() / 2 bytes into out
+bool decode_hex(std::string_view text, uint8_t* out) {
+    for (size_t i = 0; i < text.size() / 2; ++i) {
+        int hi = nibble(text[i * 2]);
+        int lo = nibble(text[i * 2 + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = uint8_t(hi << 4 | lo);
+    }
+    return true;
+}
+
+std::optional<Sha256::Digest> from_hex(std::string_view text) {
+    Sha256::Digest out{};
+    if (!decode_hex(text, out.data())) {
+        return std::nullopt;
+    }
+    return out;
+}
+
+// Padded base64
+void append_base64(std::string& out, const uint8_t* data, size_t size) {
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        uint32_t v = uint32_t(data[i]) << 16 | uint32_t(data[i + 1]) << 8 | data[i + 2];
+        out += base64_chars[(v >> 18) & 63];
+        out += base64_chars[(v >> 12) & 63];
+        out += base64_chars[(v >> 6) & 63];
+        out += base64_chars[v & 63];
+    }
+    if (i + 1 == size) {
+        uint32_t v = uint32_t(data[i]) << 16;
+        out += base64_chars[(v >> 18) & 63];
+        out += base64_chars[(v >> 12) & 63];
+        out += "==";
+    } else if (i + 2 == size) {
+        uint32_t v = uint32_t(data[i]) << 16 | uint32_t(data[i + 1]) << 8;
+        out += base64_chars[(v >> 18) & 63];
+        out += base64_chars[(v >> 12) & 63];
+        out += base64_chars[(v >> 6) & 63];
+        out += '=';
+    }
+}
+
+// Nix32 is little-endian: the last character holds the lowest five bits
+std::optional<Sha256::Digest> from_nix32(std::string_view text) {
+    Sha256::Digest out{};
+    for (size_t n = 0; n < text.size(); ++n) {
+        auto digit = nix32_chars.find(text[text.size() - n - 1]);
+        if (digit == std::string_view::npos) {
+            return std::nullopt;
+        }
+        size_t bit = n * 5;
+        size_t i = bit / 8;
+        size_t j = bit % 8;
+        out[i] |= uint8_t(digit << j);
+        if (i + 1 < out.size()) {
+            out[i + 1] |= uint8_t(digit >> (8 - j));
+        } else if ((digit >> (8 - j)) != 0) {
+            return std::nullopt;
+        }
+    }
+    return out;
+}
+
+std::optional<Sha256::Digest> from_base64(std::string_view text) {
+    if (!text.ends_with('=') || text.ends_with("==")) {
+        return std::nullopt;
+    }
+    text.remove_suffix(1);
+
+    Sha256::Digest out{};
+    uint32_t bits = 0;
+    int pending = 0;
+    size_t i = 0;
+    for (char c : text) {
+        auto value = base64_chars.find(c);
+        if (value == std::string_view::npos) {
+            return std::nullopt;
+        }
+        bits = bits << 6 | uint32_t(value);
+        pending += 6;
+        if (pending >= 8) {
+            pending -= 8;
+            out[i++] = uint8_t(bits >> pending);
+        }
+    }
+    // The two bits left over from the last character must be zero
+    if ((bits & ((1u << pending) - 1)) != 0) {
+        return std::nullopt;
+    }
+    return out;
+}
+} // namespace
+
+Sha256::Sha256() : state_(initial_state) {}
+
+void Sha256::compress(const uint8_t* block) {
+    std::array<uint32_t, 64> w;
+    for (size_t i = 0; i < 16; ++i) {
+        w[i] = uint32_t(block[i * 4]) << 24 | uint32_t(block[i * 4 + 1]) << 16 |
+               uint32_t(block[i * 4 + 2]) << 8 | uint32_t(block[i * 4 + 3]);
+    }
+    for (size_t i = 16; i < 64; ++i) {
+        uint32_t s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    auto [a, b, c, d, e, f, g, h] = state_;
+    for (size_t i = 0; i < 64; ++i) {
+        uint32_t s1 = std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + k[i] + w[i];
+        uint32_t s0 = std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+    state_[4] += e;
+    state_[5] += f;
+    state_[6] += g;
+    state_[7] += h;
+}
+
+void Sha256::update(const void* data, size_t size) {
+    auto* bytes = static_cast<const uint8_t*>(data);
+    total_ += size;
+
+    if (buffered_ != 0) {
+        size_t take = std::min(size, buffer_.size() - buffered_);
+        std::memcpy(buffer_.data() + buffered_, bytes, take);
+        buffered_ += take;
+        bytes += take;
+        size -= take;
+        if (buffered_ < buffer_.size()) {
+            return;
+        }
+        compress(buffer_.data());
+        buffered_ = 0;
+    }
+
+    for (; size >= buffer_.size(); bytes += buffer_.size(), size -= buffer_.size()) {
+        compress(bytes);
+    }
+
+    std::memcpy(buffer_.data(), bytes, size);
+    buffered_ = size;
+}
+
+Sha256::Digest Sha256::finish() {
+    uint64_t bits = total_ * 8;
+
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    uint8_t zero = 0;
+    while (buffered_ != 56) {
+        update(&zero, 1);
+    }
+
+    std::array<uint8_t, 8> length;
+    for (size_t i = 0; i < 8; ++i) {
+        length[i] = uint8_t(bits >> (56 - i * 8));
+    }
+    update(length.data(), length.size());
+
+    Digest out;
+    for (size_t i = 0; i < 8; ++i) {
+        out[i * 4] = uint8_t(state_[i] >> 24);
+        out[i * 4 + 1] = uint8_t(state_[i] >> 16);
+        out[i * 4 + 2] = uint8_t(state_[i] >> 8);
+        out[i * 4 + 3] = uint8_t(state_[i]);
+    }
+    return out;
+}
+
+std::string to_hex(const Sha256::Digest& digest) {
+    static constexpr char chars[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(digest.size() * 2);
+    for (uint8_t byte : digest) {
+        out += chars[byte >> 4];
+        out += chars[byte & 0xf];
+    }
+    return out;
+}
+
+std::string to_sri(const Sha256::Digest& digest) {
+    std::string out = "sha256-";
+    append_base64(out, digest.data(), digest.size());
+    return out;
+}
+
+std::string to_nix32(const Sha256::Digest& digest) {
+    std::string out;
+    out.reserve(nix32_length);
+    for (size_t n = nix32_length; n-- > 0;) {
+        size_t bit = n * 5;
+        size_t i = bit / 8;
+        size_t j = bit % 8;
+        unsigned c = unsigned(digest[i]) >> j;
+        if (i + 1 < digest.size()) {
+            c |= unsigned(digest[i + 1]) << (8 - j);
+        }
+        out += nix32_chars[c & 0x1f];
+    }
+    return out;
+}
+
+std::optional<Sha256::Digest> parse_sha256(std::string_view hash) {
+    if (hash.starts_with("sha256-")) {
+        hash.remove_prefix(7);
+        return hash.size() == 44 ? from_base64(hash) : std::nullopt;
+    }
+    if (hash.starts_with("sha256:")) {
+        hash.remove_prefix(7);
+    }
+    switch (hash.size()) {
+    case 64:
+        return from_hex(hash);
+    case nix32_length:
+        return from_nix32(hash);
+    case 44:
+        return from_base64(hash);
+    default:
+        return std::nullopt;
+    }
+}
+
+std::optional<std::string> sri_from_hex(std::string_view algorithm, std::string_view hex) {
+    static constexpr std::array<std::pair<std::string_view, size_t>, 3> sizes = {{
+        {"sha1", 20},
+        {"sha256", 32},
+        {"sha512", 64},
+    }};
+    std::string name(algorithm);
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](char c) { return char(std::tolower(uint8_t(c))); });
+    auto it = std::find_if(sizes.begin(), sizes.end(),
+                           [&](const auto& entry) { return entry.first == name; });
+    if (it == sizes.end() || hex.size() != it->second * 2) {
+        return std::nullopt;
+    }
+
+    std::array<uint8_t, 64> bytes{};
+    if (!decode_hex(hex, bytes.data())) {
+        return std::nullopt;
+    }
+    std::string out = name + "-";
+    append_base64(out, bytes.data(), it->second);
+    return out;
+}
+
+std::string sha256_hex(std::string_view data) {
+    Sha256 sha;
+    sha.update(data);
+    return to_hex(sha.finish());
+}
+
+} // namespace cmake2nix::digest
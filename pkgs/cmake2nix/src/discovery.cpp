@@ -1,98 +1,528 @@
 #include "cmake2nix.hpp"
 
-#include <array>
+#include <algorithm>
 #include <cstdlib>
+#include <deque>
 #include <fmt/core.h>
 #include <fstream>
-#include <memory>
-#include <regex>
+#include <map>
+#include <set>
+#include <thread>
 
 namespace cmake2nix::discovery {
 
 namespace {
-std::string exec_command(const std::string& cmd) {
-    std::array<char, 128> buffer;
-    std::string result;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
+constexpr size_t log_tail_lines = 20;
 
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
-    }
+// Bump when the discovery derivation or log format changes incompatibly
+constexpr std::string_view fingerprint_version = "cmake2nix-discovery-v3";
 
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        result += buffer.data();
-    }
+std::optional<Dependency> parse_discovery_entry(const json& j);
+std::vector<Dependency> read_discovery_log(const fs::path& log_file);
 
-    return result;
+fs::path source_root(const Config& config) {
+    return fs::absolute(config.input_file).parent_path();
 }
-} // namespace
 
-std::vector<Dependency> run(const Config& config) {
-    fmt::print("cmake2nix: Discovering dependencies from {}\n", config.input_file.string());
+bool is_cmake_input(const fs::path& path) {
+    return path.filename() == "CMakeLists.txt" || path.extension() == ".cmake" ||
+           path.filename() == "CMakePresets.json";
+}
 
-    // Create discovery derivation path
-    auto discovery_path = create_discovery_derivation(config);
+// The files of a local nix-cmake checkout that discovery evaluates or runs: the
+// library, the hooks and their setup scripts
+bool is_nix_cmake_input(const fs::path& path) {
+    auto ext = path.extension();
+    return ext == ".nix" || ext == ".cmake" || ext == ".sh";
+}
 
-    // Parse discovery log
-    auto log_file = discovery_path / "discovery-log.json";
-    if (!fs::exists(log_file)) {
-        throw std::runtime_error("Discovery log not found: " + log_file.string());
+// Hash of the nix-cmake inputs under `root`, by relative path and content
+std::string tree_identity(const fs::path& root) {
+    std::vector<fs::path> files;
+    auto options = fs::directory_options::skip_permission_denied;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(root, options, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        const auto& path = it->path();
+        if (it->is_directory()) {
+            if (path.filename().string().starts_with('.') ||
+                fs::exists(path / "CMakeCache.txt")) {
+                it.disable_recursion_pending();
+            }
+        } else if (it->is_regular_file() && is_nix_cmake_input(path)) {
+            files.push_back(path);
+        }
+    }
+    std::sort(files.begin(), files.end());
+
+    digest::Sha256 sha;
+    for (const auto& path : files) {
+        sha.update(fs::relative(path, root).string());
+        sha.update("\0", 1);
+        fsutil::MappedFile file(path);
+        sha.update(digest::sha256_hex(file.text()));
     }
+    return digest::to_hex(sha.finish());
+}
 
-    return parse_discovery_log(log_file);
+// A local nixpkgs checkout is too large to hash; its revision identifies it
+std::string nixpkgs_identity(const fs::path& root) {
+    std::string identity;
+    auto add = [&](const fs::path& path) {
+        std::ifstream in(path);
+        std::string line;
+        std::getline(in, line);
+        identity += line + "\n";
+        return line;
+    };
+    add(root / ".git-revision");
+    add(root / ".version-suffix");
+    add(root / "lib" / ".version");
+    auto head = add(root / ".git" / "HEAD");
+    if (head.starts_with("ref: ")) {
+        add(root / ".git" / head.substr(5));
+    }
+    return identity;
 }
 
-fs::path create_discovery_derivation(const Config& config) {
-    fmt::print("cmake2nix: Creating discovery derivation...\n");
+// What the discovery expression imports besides the project, <nixpkgs> and
+// <nix-cmake>, as NIX_PATH resolves them. A store path stands for its contents; a
+// local checkout is identified by what discovery uses of it. Resolved once per run.
+const std::string& channel_identity() {
+    static const std::string identity = [] {
+        const char* nix_path = std::getenv("NIX_PATH");
+        std::string identity = nix_path ? nix_path : "";
+        subprocess::Result result;
+        try {
+            result = subprocess::run({"nix-instantiate", "--find-file", "nixpkgs", "nix-cmake"});
+        } catch (const std::exception&) {
+        }
+        if (!result.ok()) {
+            // Discovery itself will report what is wrong with NIX_PATH
+            return identity;
+        }
+
+        std::string_view lines = result.out;
+        for (std::string_view name : {"nixpkgs", "nix-cmake"}) {
+            auto nl = lines.find('\n');
+            fs::path path(lines.substr(0, nl));
+            lines.remove_prefix(nl == std::string_view::npos ? lines.size() : nl + 1);
+
+            std::error_code ec;
+            auto resolved = fs::weakly_canonical(path, ec).string();
+            identity += fmt::format("\n{}=", name);
+            if (resolved.starts_with("/nix/store/")) {
+                identity += resolved.substr(0, resolved.find('/', 11));
+            } else if (name == "nixpkgs") {
+                identity += nixpkgs_identity(resolved);
+            } else {
+                identity += tree_identity(fs::is_directory(resolved, ec)
+                                              ? fs::path(resolved)
+                                              : fs::path(resolved).parent_path());
+            }
+        }
+        return identity;
+    }();
+    return identity;
+}
+
+fs::path cache_dir(const Config& config) {
+    return config.cache_dir.empty() ? cache::default_dir() : config.cache_dir;
+}
 
-    // Build nix expression for discovery
-    std::string nix_expr = R"(
+fs::path cache_entry(const Config& config, const std::string& fingerprint) {
+    return cache_dir(config) / "discovery" / fingerprint.substr(0, 2) / (fingerprint + ".jsonl");
+}
+
+// Copy a finished discovery log into the cache; failures only cost a rediscovery
+void store_log(const fs::path& log_file, const fs::path& entry) {
+    try {
+        fsutil::MappedFile log(log_file);
+        fs::create_directories(entry.parent_path());
+        fsutil::write_atomic(entry, log.text());
+    } catch (const std::exception& e) {
+        fmt::print(stderr, "Warning: Failed to cache discovery result: {}\n", e.what());
+    }
+}
+
+std::string discovery_expression(std::string_view src, const std::vector<std::string>& flags) {
+    std::string expr = fmt::format(R"(
 let
-  pkgs = import <nixpkgs> {};
-  nix-cmake = pkgs.callPackage <nix-cmake> {};
+  pkgs = import <nixpkgs> {{}};
+  nix-cmake = pkgs.callPackage <nix-cmake> {{}};
   workspace = nix-cmake.workspace pkgs;
 in
-workspace.discoverDependencies {
-  src = )" + config.input_file.parent_path().string() +
-                           R"(;
-  cmakeFlags = [)";
+workspace.discoverDependencies {{
+  src = {};
+  cmakeFlags = [)",
+                                   src);
+    for (const auto& flag : flags) {
+        expr += " " + generator::nix_string(flag);
+    }
+    expr += " ];\n}\n";
+    return expr;
+}
 
+// The fixed-output fetcher call for a pinned dependency, e.g. pkgs.fetchFromGitHub { ... }
+std::string source_expression(const Dependency& dep) {
+    std::string expr = "pkgs." + dep.method + " {";
+    // Same store path as the checkout the prefetch registered (see prefetcher)
+    if (dep.method == "fetchgit" && !dep.args.contains("name")) {
+        expr += R"( name = "source";)";
+    }
+    for (const auto& [key, value] : dep.args.items()) {
+        if (value.is_string()) {
+            expr += fmt::format(" {} = {};", key,
+                                generator::nix_string(value.get_ref<const std::string&>()));
+        }
+    }
+    return expr + " }";
+}
+
+// Build a discovery expression and return its output path. The build log goes to
+// stderr and can be many megabytes, so stream it (echoing when verbose) and keep
+// only a short tail for errors.
+fs::path build_discovery(const std::string& nix_expr, bool verbose, std::string_view label,
+                         const DependencyCallback& on_dependency = {}) {
+    // Write to a per-run temp file so concurrent discoveries don't clobber each other
+    auto temp_file =
+        fsutil::make_temp_file(fs::temp_directory_path(), "cmake2nix-discovery-", ".nix");
+    fsutil::write_atomic(temp_file, nix_expr);
+
+    std::deque<std::string> log_tail;
+    subprocess::Options options;
+    options.capture_stderr = false;
+    options.on_stderr_line = [&](std::string_view line) {
+        // The hook echoes each intercepted dependency into the build log as it
+        // happens, possibly behind a "name> " prefix added by nix
+        if (auto marker = line.find(log_marker); on_dependency && marker != line.npos) {
+            try {
+                auto entry = json::parse(line.substr(marker + log_marker.size()));
+                if (auto dep = parse_discovery_entry(entry)) {
+                    on_dependency(*dep);
+                }
+            } catch (const json::exception&) {
+            }
+        }
+        if (verbose) {
+            fmt::print(stderr, "  {}{}\n", label, line);
+        }
+        log_tail.emplace_back(line);
+        if (log_tail.size() > log_tail_lines) {
+            log_tail.pop_front();
+        }
+    };
+
+    auto result = subprocess::run({"nix-build", "--no-out-link", temp_file.string()}, options);
+    fs::remove(temp_file);
+
+    if (!result.ok()) {
+        std::string log;
+        for (const auto& line : log_tail) {
+            log += "\n  " + line;
+        }
+        throw std::runtime_error(result.describe("nix-build") + log);
+    }
+
+    // nix-build prints the output path as the last line of stdout
+    std::string store_path = result.out;
+    store_path.erase(store_path.find_last_not_of(" \t\n\r") + 1);
+    store_path.erase(0, store_path.find_last_of('\n') + 1);
+    return fs::path(store_path);
+}
+
+// Identity of a BFS node: the same dependency at the same revision is only expanded once
+std::string node_key(const Dependency& dep) {
+    return dep.name + "@" + dep.args.value("rev", dep.version);
+}
+} // namespace
+
+std::string fingerprint(const Config& config) {
+    trace::Span span("fingerprint");
+    auto root = source_root(config);
+
+    // Every CMake input under the source tree, skipping VCS metadata and build trees
+    std::vector<fs::path> inputs;
+    auto options = fs::directory_options::skip_permission_denied;
+    for (auto it = fs::recursive_directory_iterator(root, options);
+         it != fs::recursive_directory_iterator(); ++it) {
+        const auto& path = it->path();
+        if (it->is_directory()) {
+            if (path.filename().string().starts_with('.') ||
+                fs::exists(path / "CMakeCache.txt")) {
+                it.disable_recursion_pending();
+            }
+        } else if (it->is_regular_file() && is_cmake_input(path)) {
+            inputs.push_back(path);
+        }
+    }
+    std::sort(inputs.begin(), inputs.end());
+
+    digest::Sha256 sha;
+    auto field = [&](std::string_view value) {
+        sha.update(value);
+        sha.update("\0", 1);
+    };
+
+    // Not --recursive: the cached log is the top-level configure, which is flat in both
+    // modes (create_discovery_derivation); run() drives recursion from it either way
+    field(fingerprint_version);
+    field(channel_identity());
     for (const auto& flag : config.cmake_flags) {
-        nix_expr += " \"" + flag + "\"";
+        field(flag);
+    }
+    field("files");
+    for (const auto& path : inputs) {
+        field(fs::relative(path, root).string());
+        fsutil::MappedFile source(path);
+        field(digest::sha256_hex(source.text()));
+    }
+
+    return digest::to_hex(sha.finish());
+}
+
+std::vector<Dependency> run(const Config& config, const DependencyCallback& on_dependency) {
+    trace::Span span("discovery");
+    fmt::print("cmake2nix: Discovering dependencies from {}\n", config.input_file.string());
+
+    // Unchanged CMake inputs give the same discovery log, so skip nix-build entirely
+    std::vector<Dependency> deps;
+    fs::path cached;
+    if (!config.no_cache) {
+        cached = cache_entry(config, fingerprint(config));
+    }
+    if (!cached.empty() && fs::exists(cached)) {
+        fmt::print("cmake2nix: Discovery cache hit ({})\n", cached.stem().string().substr(0, 12));
+        span.arg("cache", "hit");
+        deps = parse_discovery_log(cached);
+    } else {
+        span.arg("cache", cached.empty() ? "off" : "miss");
+        auto discovery_path = create_discovery_derivation(config, on_dependency);
+
+        auto log_file = discovery_path / "discovery-log.json";
+        if (!fs::exists(log_file)) {
+            throw std::runtime_error("Discovery log not found: " + log_file.string());
+        }
+        if (!cached.empty()) {
+            store_log(log_file, cached);
+        }
+        deps = parse_discovery_log(log_file);
     }
 
     if (config.recursive) {
-        nix_expr += " \"-DNIX_CMAKE_RECURSIVE_DISCOVERY=1\"";
+        deps = discover_recursive(config, std::move(deps));
     }
+    return deps;
+}
 
-    nix_expr += " ];\n}\n";
+fs::path create_discovery_derivation(const Config& config,
+                                     const DependencyCallback& on_dependency) {
+    trace::Span span("create_discovery_derivation");
+    fmt::print("cmake2nix: Creating discovery derivation...\n");
 
-    // Write to temp file
-    auto temp_file = fs::temp_directory_path() / "cmake2nix-discovery.nix";
-    std::ofstream out(temp_file);
-    out << nix_expr;
-    out.close();
+    // Always a flat (stubbed) configure: recursion is driven from here, one
+    // derivation per dependency, rather than by letting FetchContent proceed
+    auto store_path =
+        build_discovery(discovery_expression(source_root(config).string(), config.cmake_flags),
+                        config.verbose, "", on_dependency);
 
-    // Build derivation
-    std::string cmd = fmt::format("nix-build --no-out-link {} 2>&1", temp_file.string());
-    std::string output = exec_command(cmd);
+    fmt::print("cmake2nix: Discovery complete: {}\n", store_path.string());
+    return store_path;
+}
 
-    // Extract output path from nix-build output
-    // The last line should be the store path
-    size_t last_newline = output.find_last_of('\n', output.size() - 2);
-    std::string store_path = output.substr(last_newline + 1);
+std::vector<Dependency> discover_dependency(const Config& config, Dependency& dep) {
+    if (dep.method != "fetchFromGitHub" && dep.method != "fetchgit") {
+        return {};
+    }
+    trace::Span span(dep.name, "discover");
+    span.arg("method", dep.method);
+
+    // The discovery derivation needs a fixed-output source, so pin it first
+    if (!lockfile::is_pinned(dep)) {
+        std::optional<cache::PrefetchCache> prefetch_cache;
+        if (!config.no_cache) {
+            prefetch_cache.emplace(cache_dir(config));
+        }
+        // Checkouts are added to the store so the discovery build below finds its
+        // source there instead of fetching it again
+        prefetcher::Options options{.cache = prefetch_cache ? &*prefetch_cache : nullptr,
+                                    .external = config.external_prefetch,
+                                    .mirror_dir = config.no_cache ? fs::path()
+                                                                  : cache_dir(config) / "git",
+                                    .add_to_store = true};
+        auto rev = dep.args.value("rev", "HEAD");
+        dep.args[std::string(lockfile::hash_field(dep))] =
+            dep.method == "fetchFromGitHub"
+                ? prefetcher::prefetch_github(dep.args.value("owner", ""),
+                                              dep.args.value("repo", ""), rev, options)
+                : prefetcher::prefetch_git(dep.args.value("url", ""), rev, options);
+    }
 
-    // Trim whitespace
-    store_path.erase(0, store_path.find_first_not_of(" \t\n\r"));
-    store_path.erase(store_path.find_last_not_of(" \t\n\r") + 1);
+    // A pinned source never changes, so its fetcher call identifies the result, given
+    // the same hook and nixpkgs
+    auto nix_expr = discovery_expression(source_expression(dep), {});
+    fs::path cached;
+    if (!config.no_cache) {
+        std::string key = digest::sha256_hex(
+            fmt::format("{}\n{}\n{}", fingerprint_version, channel_identity(), nix_expr));
+        cached = cache_entry(config, key);
+        if (fs::exists(cached)) {
+            span.arg("cache", "hit");
+            return read_discovery_log(cached);
+        }
+    }
+    span.arg("cache", cached.empty() ? "off" : "miss");
 
-    fs::remove(temp_file);
+    auto log_file =
+        build_discovery(nix_expr, config.verbose, fmt::format("[{}] ", dep.name)) /
+        "discovery-log.json";
+    if (!fs::exists(log_file)) {
+        throw std::runtime_error("Discovery log not found: " + log_file.string());
+    }
+    if (!cached.empty()) {
+        store_log(log_file, cached);
+    }
+    return read_discovery_log(log_file);
+}
 
-    fmt::print("cmake2nix: Discovery complete: {}\n", store_path);
-    return fs::path(store_path);
+std::vector<Dependency> discover_recursive(const Config& config, std::vector<Dependency> roots) {
+    trace::Span span("discover_recursive");
+    // Lock entries in discovery order; like FetchContent, the first declaration of a
+    // name wins, and BFS order makes that the shallowest one
+    std::vector<Dependency> result;
+    std::map<std::string, size_t> index;
+    std::set<std::string> seen;
+    std::vector<size_t> frontier;
+
+    auto add = [&](Dependency dep) -> std::optional<size_t> {
+        if (!seen.insert(node_key(dep)).second) {
+            return std::nullopt;
+        }
+        if (auto it = index.find(dep.name); it != index.end()) {
+            const auto& kept = result[it->second];
+            fmt::print(stderr, "Warning: {} requested at {} but {} is already locked; keeping it\n",
+                       dep.name, node_key(dep), node_key(kept));
+            return std::nullopt;
+        }
+        index[dep.name] = result.size();
+        result.push_back(std::move(dep));
+        return result.size() - 1;
+    };
+
+    for (auto& dep : roots) {
+        if (auto i = add(std::move(dep))) {
+            frontier.push_back(*i);
+        }
+    }
+
+    unsigned workers = config.jobs != 0 ? config.jobs : std::thread::hardware_concurrency();
+    resolver::Resolver resolver(config.jobs, config.verbose);
+    for (unsigned level = 1; !frontier.empty(); ++level) {
+        fmt::print("cmake2nix: Recursive discovery level {}: {} dependencies\n", level,
+                   frontier.size());
+
+        // Nodes are pinned by commit, so aliases of one commit share cached results
+        std::vector<Dependency*> nodes;
+        for (auto i : frontier) {
+            nodes.push_back(&result[i]);
+        }
+        resolver.resolve_all(nodes);
+
+        // Every node of a level runs concurrently; the level takes as long as its slowest node
+        std::vector<std::vector<Dependency>> children(frontier.size());
+        std::atomic<size_t> next = 0;
+        auto worker = [&]() {
+            for (size_t i; (i = next++) < frontier.size();) {
+                auto& dep = result[frontier[i]];
+                try {
+                    children[i] = discover_dependency(config, dep);
+                    if (config.verbose) {
+                        fmt::print("  {}: {} dependencies\n", dep.name, children[i].size());
+                    }
+                } catch (const std::exception& e) {
+                    fmt::print(stderr, "  ✗ {} discovery failed: {}\n", dep.name, e.what());
+                }
+            }
+        };
+        {
+            std::vector<std::jthread> pool;
+            size_t count = std::clamp<size_t>(workers, 1, frontier.size());
+            for (size_t i = 0; i < count; ++i) {
+                pool.emplace_back(worker);
+            }
+        }
+
+        // Merge in frontier order so the lock doesn't depend on completion order
+        std::vector<size_t> next_frontier;
+        for (size_t i = 0; i < frontier.size(); ++i) {
+            std::set<std::string> edges;
+            for (auto& child : children[i]) {
+                edges.insert(child.name);
+                if (auto added = add(std::move(child))) {
+                    next_frontier.push_back(*added);
+                }
+            }
+            if (!edges.empty()) {
+                result[frontier[i]].metadata["dependencies"] = edges;
+            }
+        }
+        frontier = std::move(next_frontier);
+    }
+
+    fmt::print("cmake2nix: Recursive discovery found {} dependencies\n", result.size());
+    return result;
 }
 
-std::vector<Dependency> parse_discovery_log(const fs::path& log_file) {
+namespace {
+std::optional<Dependency> parse_discovery_entry(const json& j) {
+    Dependency dep;
+    dep.name = j.value("name", "");
+    dep.version = j.value("version", "unknown");
+
+    // Determine fetcher method from metadata
+    if (j.contains("gitRepository")) {
+        std::string repo = j["gitRepository"];
+
+        // Check if it's a GitHub URL
+        if (auto github = matchers::github_repo(repo)) {
+            dep.method = "fetchFromGitHub";
+            dep.args["owner"] = github->owner;
+            dep.args["repo"] = github->repo;
+            dep.args["rev"] = j.value("gitTag", "HEAD");
+            dep.args["hash"] = placeholder_hash;
+        } else {
+            dep.method = "fetchgit";
+            dep.args["url"] = repo;
+            dep.args["rev"] = j.value("gitTag", "HEAD");
+            dep.args["sha256"] = placeholder_hash;
+        }
+
+        // Store metadata
+        dep.metadata = j;
+    } else if (j.contains("url")) {
+        dep.method = "fetchurl";
+        dep.args["url"] = j["url"];
+        dep.args["sha256"] = placeholder_hash;
+
+        // URL_HASH <ALGO>=<hex> already pins the download; no need to fetch it
+        std::string url_hash = j.value("urlHash", "");
+        if (auto eq = url_hash.find('='); eq != std::string::npos) {
+            if (auto sri = digest::sri_from_hex(std::string_view(url_hash).substr(0, eq),
+                                                std::string_view(url_hash).substr(eq + 1))) {
+                dep.args.erase("sha256");
+                dep.args["hash"] = *sri;
+            }
+        }
+        dep.metadata = j;
+    }
+
+    if (dep.name.empty() || dep.method.empty()) {
+        return std::nullopt;
+    }
+    return dep;
+}
+
+std::vector<Dependency> read_discovery_log(const fs::path& log_file) {
     std::vector<Dependency> deps;
     std::ifstream file(log_file);
 
@@ -106,45 +536,21 @@ std::vector<Dependency> parse_discovery_log(const fs::path& log_file) {
             continue;
 
         try {
-            json j = json::parse(line);
-
-            Dependency dep;
-            dep.name = j.value("name", "");
-            dep.version = j.value("version", "unknown");
-
-            // Determine fetcher method from metadata
-            if (j.contains("gitRepository")) {
-                std::string repo = j["gitRepository"];
-
-                // Check if it's a GitHub URL
-                std::regex github_regex(R"(https?://github\.com/([^/]+)/([^/\.]+))");
-                std::smatch match;
-
-                if (std::regex_search(repo, match, github_regex)) {
-                    dep.method = "fetchFromGitHub";
-                    dep.args["owner"] = match[1].str();
-                    dep.args["repo"] = match[2].str();
-                    dep.args["rev"] = j.value("gitTag", "HEAD");
-                    dep.args["hash"] = "sha256-AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=";
-                } else {
-                    dep.method = "fetchgit";
-                    dep.args["url"] = repo;
-                    dep.args["rev"] = j.value("gitTag", "HEAD");
-                    dep.args["sha256"] = "sha256-AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=";
-                }
-
-                // Store metadata
-                dep.metadata = j;
-            }
-
-            if (!dep.name.empty()) {
-                deps.push_back(dep);
+            if (auto dep = parse_discovery_entry(json::parse(line))) {
+                deps.push_back(std::move(*dep));
             }
         } catch (const json::exception& e) {
             fmt::print(stderr, "Warning: Failed to parse discovery log line: {}\n", e.what());
         }
     }
 
+    return deps;
+}
+} // namespace
+
+std::vector<Dependency> parse_discovery_log(const fs::path& log_file) {
+    trace::Span span("parse_discovery_log");
+    auto deps = read_discovery_log(log_file);
     fmt::print("cmake2nix: Discovered {} dependencies\n", deps.size());
     return deps;
 }
@@ -0,0 +1,210 @@
+#include "cmake2nix.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cmake2nix::fsutil {
+
+MappedFile::MappedFile(const fs::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open " + path.string() + ": " +
+                                 std::strerror(errno));
+    }
+
+    struct stat st {};
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to stat " + path.string());
+    }
+
+    size_ = size_t(st.st_size);
+    if (size_ != 0) {
+        void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Failed to map " + path.string());
+        }
+        data_ = static_cast<const char*>(data);
+    }
+    ::close(fd);
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+    : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        if (data_ != nullptr) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+        data_ = std::exchange(other.data_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    if (data_ != nullptr) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+fs::path make_temp_file(const fs::path& dir, std::string_view prefix, std::string_view suffix) {
+    std::string pattern = (dir / prefix).string() + "XXXXXX" + std::string(suffix);
+    int fd = ::mkostemps(pattern.data(), int(suffix.size()), O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create temporary file in " + dir.string() + ": " +
+                                 std::strerror(errno));
+    }
+    ::close(fd);
+    return pattern;
+}
+
+TempDir::TempDir(std::string_view prefix, const fs::path& parent) {
+    std::string pattern = (parent / prefix).string() + "XXXXXX";
+    if (::mkdtemp(pattern.data()) == nullptr) {
+        throw std::runtime_error("Failed to create temporary directory in " + parent.string() +
+                                 ": " + std::strerror(errno));
+    }
+    path_ = pattern;
+}
+
+TempDir::~TempDir() {
+    std::error_code ec;
+    if (fs::remove_all(path_, ec) != static_cast<std::uintmax_t>(-1)) {
+        return;
+    }
+    // Unpacked archives may contain read-only directories; make them writable and retry
+    for (auto it = fs::recursive_directory_iterator(path_, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_directory(ec) && !it->is_symlink(ec)) {
+            fs::permissions(it->path(), fs::perms::owner_all, fs::perm_options::add, ec);
+        }
+    }
+    fs::remove_all(path_, ec);
+}
+
+FileLock::FileLock(const fs::path& path, bool exclusive) {
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd_ < 0) {
+        throw std::runtime_error(
+            fmt::format("Failed to open lock {}: {}", path.string(), std::strerror(errno)));
+    }
+    while (::flock(fd_, exclusive ? LOCK_EX : LOCK_SH) != 0) {
+        if (errno != EINTR) {
+            int err = errno;
+            ::close(fd_);
+            throw std::runtime_error(
+                fmt::format("Failed to lock {}: {}", path.string(), std::strerror(err)));
+        }
+    }
+}
+
+FileLock::~FileLock() {
+    ::close(fd_); // Releases the lock
+}
+
+AtomicFile::AtomicFile(fs::path path) : path_(std::move(path)) {
+    static std::atomic<unsigned> counter = 0;
+
+    auto dir = path_.parent_path().empty() ? fs::path(".") : path_.parent_path();
+
+    // O_EXCL with a pid+counter name rather than mkstemp, so the file gets the
+    // normal umask-derived mode instead of 0600
+    for (int attempt = 0; fd_ < 0 && attempt < 100; ++attempt) {
+        temp_ = dir / fmt::format(".{}.tmp-{}-{}", path_.filename().string(), ::getpid(),
+                                  counter++);
+        fd_ = ::open(temp_.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd_ < 0 && errno != EEXIST) {
+            break;
+        }
+    }
+    if (fd_ < 0) {
+        throw std::runtime_error(
+            fmt::format("Failed to create {}: {}", temp_.string(), std::strerror(errno)));
+    }
+    buffer_.reserve(buffer_limit);
+}
+
+AtomicFile::~AtomicFile() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        ::unlink(temp_.c_str());
+    }
+}
+
+void AtomicFile::fail(std::string_view what) {
+    int err = errno;
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    ::unlink(temp_.c_str());
+    throw std::runtime_error(
+        fmt::format("Failed to {} {}: {}", what, path_.string(), std::strerror(err)));
+}
+
+void AtomicFile::flush() {
+    for (size_t written = 0; written < buffer_.size();) {
+        ssize_t n = ::write(fd_, buffer_.data() + written, buffer_.size() - written);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail("write");
+        }
+        written += size_t(n);
+    }
+    buffer_.clear();
+}
+
+void AtomicFile::commit(bool durable) {
+    flush();
+    if (durable && ::fsync(fd_) != 0) {
+        fail("sync");
+    }
+    int fd = std::exchange(fd_, -1);
+    if (::close(fd) != 0) {
+        fail("close");
+    }
+    if (::rename(temp_.c_str(), path_.c_str()) != 0) {
+        fail("rename");
+    }
+
+    if (durable) {
+        // Persist the rename itself
+        auto dir = path_.parent_path().empty() ? fs::path(".") : path_.parent_path();
+        int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            ::fsync(dir_fd);
+            ::close(dir_fd);
+        }
+    }
+}
+
+void write_atomic(const fs::path& path, std::string_view content, bool durable) {
+    AtomicFile file(path);
+    file.write(content);
+    file.commit(durable);
+}
+
+bool write_if_changed(const fs::path& path, std::string_view content) {
+    std::error_code ec;
+    if (fs::is_regular_file(path, ec)) {
+        MappedFile existing(path);
+        if (existing.text() == content) {
+            return false;
+        }
+    }
+    write_atomic(path, content);
+    return true;
+}
+
+} // namespace cmake2nix::fsutil
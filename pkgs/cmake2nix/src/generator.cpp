@@ -1,57 +1,229 @@
 #include "cmake2nix.hpp"
 
+#include <algorithm>
 #include <fmt/format.h>
 #include <fstream>
+#include <iterator>
 #include <set>
-#include <sstream>
 
 namespace cmake2nix::generator {
 
-std::string generate_packages_nix(const LockFile& lock) {
-    std::ostringstream oss;
+namespace {
+// Bump when the generated files change shape so old stamps stop matching
+constexpr std::string_view stamp_version = "cmake2nix-generate-v1";
+// The shard files the last write_all wrote, one per line, kept in the shard directory
+constexpr std::string_view shard_manifest = ".cmake2nix-shards";
+
+// Per-output-directory record of the inputs and outputs of the last write_all
+fs::path stamp_path(const Config& config) {
+    auto dir = config.cache_dir.empty() ? cache::default_dir() : config.cache_dir;
+    auto key = digest::sha256_hex(fs::absolute(config.output_dir).lexically_normal().string());
+    return dir / "generate" / key.substr(0, 2) / (key + ".json");
+}
+
+// Everything the generated files are derived from
+std::string inputs_fingerprint(const Config& config, const ProjectInfo& info) {
+    digest::Sha256 sha;
+    auto field = [&](std::string_view value) {
+        sha.update(value);
+        sha.update("\0", 1);
+    };
+
+    fsutil::MappedFile lock(config.lock_file);
+    field(stamp_version);
+    field(digest::sha256_hex(lock.text()));
+    field(info.pname);
+    field(info.version);
+    field(config.packages_nix);
+    field(config.env_nix);
+    field(config.composition_nix);
+    field(config.shard ? "shard:" + config.shard_dir : "single");
+    return digest::to_hex(sha.finish());
+}
+
+constexpr bool is_ident_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '-' || c == '\'';
+}
+
+constexpr bool is_path_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+           c == '_' || c == '-' || c == '.' || c == '+' || c == '/';
+}
+
+// Attribute name, quoted unless it is a plain identifier
+std::string nix_attr(std::string_view name) {
+    static constexpr std::array<std::string_view, 10> keywords = {
+        "assert", "else", "if", "in", "inherit", "let", "or", "rec", "then", "with"};
+    bool plain = !name.empty() && !(name.front() >= '0' && name.front() <= '9') &&
+                 name.front() != '-' && name.front() != '\'' &&
+                 std::all_of(name.begin(), name.end(), is_ident_char) &&
+                 std::find(keywords.begin(), keywords.end(), name) == keywords.end();
+    return plain ? std::string(name) : nix_string(name);
+}
+
+// Path relative to the generated file; falls back to string concatenation when the
+// path isn't valid as a path literal
+std::string nix_path(std::string_view relative) {
+    if (std::all_of(relative.begin(), relative.end(), is_path_char) &&
+        relative.find("//") == std::string_view::npos && !relative.ends_with('/')) {
+        return fmt::format("./{}", relative);
+    }
+    return fmt::format("(./. + {})", nix_string(fmt::format("/{}", relative)));
+}
 
-    // Collect unique fetcher methods
-    std::set<std::string> methods;
+std::set<std::string_view> fetcher_methods(const LockFile& lock) {
+    std::set<std::string_view> methods;
     for (const auto& [name, dep] : lock.dependencies) {
         if (!dep.method.empty()) {
             methods.insert(dep.method);
         }
     }
+    return methods;
+}
+
+// Header with imports: the fetchers the file uses
+void append_header(std::string& out, const std::set<std::string_view>& methods) {
+    out += "# Generated by cmake2nix\n";
+    out += "# Do not edit this file manually\n";
+    if (methods.empty()) {
+        out += "{ }:\n\n";
+        return;
+    }
+    char separator = '{';
+    for (auto method : methods) {
+        fmt::format_to(std::back_inserter(out), "{} {}\n", separator, method);
+        separator = ',';
+    }
+    out += "}:\n\n";
+}
+
+// Attributes of one dependency: name, version and the fetcher call for src
+void append_dependency(std::string& out, const Dependency& dep, std::string_view indent) {
+    auto it = std::back_inserter(out);
+    fmt::format_to(it, "{}name = {};\n", indent, nix_string(dep.name));
+    fmt::format_to(it, "{}version = {};\n", indent, nix_string(dep.version));
+    fmt::format_to(it, "{}src = {} {{\n", indent, dep.method);
 
-    // Header with imports
-    oss << "# Generated by cmake2nix\n";
-    oss << "# Do not edit this file manually\n";
-    oss << "{\n";
-    for (const auto& method : methods) {
-        oss << ", " << method << "\n";
+    for (const auto& [key, value] : dep.args.items()) {
+        if (value.is_string()) {
+            fmt::format_to(it, "{}  {} = {};\n", indent, nix_attr(key),
+                           nix_string(value.get_ref<const std::string&>()));
+        } else if (value.is_number()) {
+            fmt::format_to(it, "{}  {} = {};\n", indent, nix_attr(key), value.dump());
+        } else if (value.is_boolean()) {
+            fmt::format_to(it, "{}  {} = {};\n", indent, nix_attr(key),
+                           value.get<bool>() ? "true" : "false");
+        }
     }
-    oss << "}:\n\n";
+
+    fmt::format_to(it, "{}}};\n", indent);
+}
+} // namespace
+
+std::string generate_packages_nix(const LockFile& lock) {
+    trace::Span span("generate_packages_nix");
+    std::string out;
+    out.reserve(256 + lock.dependencies.size() * 320);
+    append_header(out, fetcher_methods(lock));
 
     // Dependencies
-    oss << "{\n";
+    out += "{\n";
     for (const auto& [name, dep] : lock.dependencies) {
-        oss << "  " << name << " = {\n";
-        oss << "    name = \"" << dep.name << "\";\n";
-        oss << "    version = \"" << dep.version << "\";\n";
-        oss << "    src = " << dep.method << " {\n";
-
-        // Generate args
-        for (const auto& [key, value] : dep.args.items()) {
-            if (value.is_string()) {
-                oss << "      " << key << " = \"" << value.get<std::string>() << "\";\n";
-            } else if (value.is_number()) {
-                oss << "      " << key << " = " << value << ";\n";
-            } else if (value.is_boolean()) {
-                oss << "      " << key << " = " << (value.get<bool>() ? "true" : "false") << ";\n";
-            }
+        fmt::format_to(std::back_inserter(out), "  {} = {{\n", nix_attr(name));
+        append_dependency(out, dep, "    ");
+        out += "  };\n\n";
+    }
+    out += "}\n";
+
+    return out;
+}
+
+// Nix string literal with `"`, `\` and `${` escaped
+std::string nix_string(std::string_view value) {
+    std::string out;
+    out.reserve(value.size() + 2);
+    out += '"';
+    for (size_t i = 0; i < value.size(); ++i) {
+        char c = value[i];
+        switch (c) {
+        case '"':
+        case '\\':
+            out += '\\';
+            out += c;
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\r':
+            out += "\\r";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        case '$':
+            out += (i + 1 < value.size() && value[i + 1] == '{') ? "\\$" : "$";
+            break;
+        default:
+            out += c;
         }
+    }
+    out += '"';
+    return out;
+}
 
-        oss << "    };\n";
-        oss << "  };\n\n";
+std::string shard_file_name(std::string_view name) {
+    std::string file(name);
+    bool replaced = false;
+    for (auto& c : file) {
+        if (!is_path_char(c) || c == '/') {
+            c = '_';
+            replaced = true;
+        }
     }
-    oss << "}\n";
+    if (file.empty() || file.front() == '.') {
+        file.insert(0, "_");
+        replaced = true;
+    }
+    // Keep sanitised names distinct from each other and from real names
+    if (replaced) {
+        file += "-" + digest::sha256_hex(name).substr(0, 8);
+    }
+    return file + ".nix";
+}
 
-    return oss.str();
+std::string generate_package_nix(const Dependency& dep) {
+    std::string out;
+    out.reserve(512);
+    std::set<std::string_view> methods;
+    if (!dep.method.empty()) {
+        methods.insert(dep.method);
+    }
+    append_header(out, methods);
+
+    out += "{\n";
+    append_dependency(out, dep, "  ");
+    out += "}\n";
+    return out;
+}
+
+std::string generate_packages_index(const LockFile& lock, std::string_view shard_dir) {
+    std::string out;
+    out.reserve(256 + lock.dependencies.size() * 96);
+    append_header(out, fetcher_methods(lock));
+
+    // Attribute values are thunks, so a shard is only read when its dependency is forced
+    out += "{\n";
+    for (const auto& [name, dep] : lock.dependencies) {
+        fmt::format_to(std::back_inserter(out), "  {} = import {} {{", nix_attr(name),
+                       nix_path(fmt::format("{}/{}", shard_dir, shard_file_name(name))));
+        if (!dep.method.empty()) {
+            fmt::format_to(std::back_inserter(out), " inherit {};", dep.method);
+        }
+        out += " };\n";
+    }
+    out += "}\n";
+    return out;
 }
 
 std::string generate_env_nix(const std::string& nix_cmake_path) {
@@ -107,8 +279,8 @@ in
 rec {{
   # The main package
   package = cmakeEnv.buildCMakePackage {{
-    pname = "{}";
-    version = "{}";
+    pname = {};
+    version = {};
     src = ./.;
 
     # Auto-inject dependencies from lock file
@@ -130,43 +302,101 @@ rec {{
   }};
 }}
 )",
-                       info.pname, info.version);
+                       nix_string(info.pname), nix_string(info.version));
+}
+
+bool up_to_date(const Config& config, const ProjectInfo& info) {
+    if (config.no_cache) {
+        return false;
+    }
+    try {
+        fsutil::MappedFile file(stamp_path(config));
+        json stamp = json::parse(file.text());
+        if (stamp.value("inputs", "") != inputs_fingerprint(config, info)) {
+            return false;
+        }
+        // Regenerate if an output was deleted or edited by hand
+        for (const auto& [name, expected] : stamp.at("outputs").items()) {
+            fsutil::MappedFile output(config.output_dir / name);
+            if (digest::sha256_hex(output.text()) != expected) {
+                return false;
+            }
+        }
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
 }
 
 void write_all(const Config& config, const LockFile& lock, const ProjectInfo& info) {
+    trace::Span span("generate");
     fs::create_directories(config.output_dir);
 
-    // Generate and write cmake-packages.nix
-    {
-        auto path = config.output_dir / config.packages_nix;
-        std::ofstream file(path);
-        if (!file) {
-            throw std::runtime_error("Failed to write " + path.string());
+    // Only files whose content differs are rewritten, so unchanged outputs keep
+    // their mtime and don't wake up watchers or downstream evaluation
+    json outputs = json::object();
+    auto write = [&](const std::string& name, const std::string& content) {
+        trace::Span file_span(name, "file");
+        bool written = fsutil::write_if_changed(config.output_dir / name, content);
+        outputs[name] = digest::sha256_hex(content);
+        file_span.arg("written", written ? "yes" : "no");
+        return written;
+    };
+    auto write_top = [&](const std::string& name, const std::string& content) {
+        bool written = write(name, content);
+        fmt::print("cmake2nix: {} {}\n", written ? "Generated" : "Unchanged",
+                   (config.output_dir / name).string());
+    };
+
+    if (config.shard) {
+        auto shard_dir = config.output_dir / config.shard_dir;
+        fs::create_directories(shard_dir);
+
+        size_t written = 0;
+        std::set<std::string> current;
+        for (const auto& [name, dep] : lock.dependencies) {
+            auto file = shard_file_name(name);
+            written += write(config.shard_dir + "/" + file, generate_package_nix(dep)) ? 1 : 0;
+            current.insert(std::move(file));
         }
-        file << generate_packages_nix(lock);
-        fmt::print("cmake2nix: Generated {}\n", path.string());
-    }
 
-    // Generate and write cmake-env.nix
-    {
-        auto path = config.output_dir / config.env_nix;
-        std::ofstream file(path);
-        if (!file) {
-            throw std::runtime_error("Failed to write " + path.string());
+        // Drop shards of dependencies that left the lock. Only files a previous run
+        // listed in the manifest: the shard directory may hold the user's own files.
+        size_t removed = 0;
+        auto manifest = shard_dir / shard_manifest;
+        std::ifstream previous(manifest);
+        for (std::string file; std::getline(previous, file);) {
+            if (!file.empty() && file.find('/') == std::string::npos && file != "." &&
+                file != ".." && !current.contains(file) && fs::remove(shard_dir / file)) {
+                removed++;
+            }
+        }
+        previous.close();
+        std::string listing;
+        for (const auto& file : current) {
+            listing += file + "\n";
         }
-        file << generate_env_nix("<nix-cmake>");
-        fmt::print("cmake2nix: Generated {}\n", path.string());
+        fsutil::write_if_changed(manifest, listing);
+
+        fmt::print("cmake2nix: Updated {} of {} dependency files in {}{}\n", written,
+                   lock.dependencies.size(), shard_dir.string(),
+                   removed != 0 ? fmt::format(", removed {} stale", removed) : "");
+        write_top(config.packages_nix, generate_packages_index(lock, config.shard_dir));
+    } else {
+        write_top(config.packages_nix, generate_packages_nix(lock));
     }
+    write_top(config.env_nix, generate_env_nix("<nix-cmake>"));
+    write_top(config.composition_nix, generate_default_nix(info));
 
-    // Generate and write default.nix
-    {
-        auto path = config.output_dir / config.composition_nix;
-        std::ofstream file(path);
-        if (!file) {
-            throw std::runtime_error("Failed to write " + path.string());
+    // Best-effort: without a stamp the next generate simply runs again
+    if (!config.no_cache) {
+        try {
+            auto stamp = stamp_path(config);
+            fs::create_directories(stamp.parent_path());
+            json entry = {{"inputs", inputs_fingerprint(config, info)}, {"outputs", outputs}};
+            fsutil::write_atomic(stamp, entry.dump() + "\n");
+        } catch (const std::exception&) {
         }
-        file << generate_default_nix(info);
-        fmt::print("cmake2nix: Generated {}\n", path.string());
     }
 
     fmt::print("\ncmake2nix: ✓ Generation complete\n");
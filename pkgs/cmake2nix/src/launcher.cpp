@@ -0,0 +1,113 @@
+// nix-compiler-launcher / nix-linker-launcher: CMAKE_<LANG>_COMPILER_LAUNCHER and
+// CMAKE_<LANG>_LINKER_LAUNCHER for the Nix toolchain. Puts the flags baked into
+// launcher-config.hpp in front of the compiler's own arguments and execs it, like
+// the nix-*-launcher scripts of pkgs/cmake-compiler-launchers without the shell:
+//
+//   nix-compiler-launcher <compiler> <args>...
+//
+// Runs once per translation unit, so it does nothing but the argv rebuild.
+// NIX_DEBUG_CMAKE=1 echoes the command line to stderr. With NIX_CMAKE_COMPILE_CACHE
+// set, compiles go through `cmake2nix compile` instead (see compile_cache.cpp), if
+// cmake2nix is on PATH.
+
+#include "launcher-config.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <unistd.h>
+
+namespace {
+
+#ifdef CMAKE2NIX_LAUNCHER_LINK
+constexpr const char* nix_flags[] = {CMAKE2NIX_LAUNCHER_LINK_FLAGS nullptr};
+constexpr const char* label = "NIX CMAKE LINKER LAUNCHER:";
+#else
+constexpr const char* nix_flags[] = {CMAKE2NIX_LAUNCHER_COMPILE_FLAGS nullptr};
+constexpr const char* label = "NIX CMAKE COMPILER LAUNCHER:";
+#endif
+constexpr size_t nix_flag_count = std::size(nix_flags) - 1;
+
+// Unbuffered, so no stdio: the echo only runs when debugging anyway
+void put(const char* text) {
+    size_t size = std::strlen(text);
+    while (size > 0) {
+        ssize_t n = ::write(STDERR_FILENO, text, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        text += n;
+        size -= size_t(n);
+    }
+}
+
+void echo(char** argv) {
+    put(label);
+    for (char** arg = argv; *arg != nullptr; ++arg) {
+        put(" ");
+        put(*arg);
+    }
+    put("\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        put("usage: ");
+        put(argv[0] != nullptr ? argv[0] : "nix-compiler-launcher");
+        put(" <compiler> [args...]\n");
+        return 2;
+    }
+
+    // "cmake2nix compile" for the cache, compiler, baked-in flags, the compiler's own
+    // arguments, terminator
+    size_t count = 2 + 1 + nix_flag_count + size_t(argc - 2) + 1;
+    auto** cached = static_cast<char**>(std::malloc(count * sizeof(char*)));
+    if (cached == nullptr) {
+        put("nix-compiler-launcher: out of memory\n");
+        return 127;
+    }
+    cached[0] = const_cast<char*>("cmake2nix");
+    cached[1] = const_cast<char*>("compile");
+    char** args = cached + 2;
+    char** out = args;
+    *out++ = argv[1];
+    for (size_t i = 0; i < nix_flag_count; ++i) {
+        *out++ = const_cast<char*>(nix_flags[i]);
+    }
+    for (int i = 2; i < argc; ++i) {
+        *out++ = argv[i];
+    }
+    *out = nullptr;
+
+    const char* debug = std::getenv("NIX_DEBUG_CMAKE");
+    if (debug != nullptr && std::strcmp(debug, "1") == 0) {
+        echo(args);
+    }
+
+#ifndef CMAKE2NIX_LAUNCHER_LINK
+    const char* cache = std::getenv("NIX_CMAKE_COMPILE_CACHE");
+    if (cache != nullptr && *cache != '\0') {
+        // Only returns if there is no cmake2nix to run
+        ::execvp(cached[0], cached);
+    }
+#endif
+
+    // CMake passes the compiler's absolute path, which execvp hands straight to
+    // execve; a bare name is looked up on PATH like the scripts' exec did
+    ::execvp(args[0], args);
+
+    int error = errno;
+    put(argv[0]);
+    put(": ");
+    put(args[0]);
+    put(": ");
+    put(std::strerror(error));
+    put("\n");
+    return error == ENOENT ? 127 : 126;
+}
@@ -1,7 +1,7 @@
 #include "cmake2nix.hpp"
 
+#include <algorithm>
 #include <fmt/core.h>
-#include <fstream>
 
 namespace cmake2nix {
 
@@ -47,56 +47,497 @@ LockFile LockFile::from_json(const json& j) {
 
 namespace cmake2nix::lockfile {
 
+namespace {
+// SAX handler that fills a LockFile directly from the token stream. Only the
+// free-form args/metadata subtrees are materialised as json values; everything
+// else is assigned field by field, and unknown keys are skipped without
+// building anything.
+class LockReader : public nlohmann::json_sax<json> {
+  public:
+    LockReader(LockFile& lock, const fs::path& path) : lock_(lock), path_(path) {}
+
+    bool null() override {
+        return scalar(nullptr);
+    }
+    bool boolean(bool value) override {
+        return scalar(value);
+    }
+    bool number_integer(number_integer_t value) override {
+        return scalar(value);
+    }
+    bool number_unsigned(number_unsigned_t value) override {
+        return scalar(value);
+    }
+    bool number_float(number_float_t value, const string_t&) override {
+        return scalar(value);
+    }
+    bool string(string_t& value) override {
+        return scalar(std::move(value));
+    }
+    bool binary(binary_t& value) override {
+        return scalar(json::binary(std::move(value)));
+    }
+    bool key(string_t& value) override {
+        key_ = std::move(value);
+        return true;
+    }
+    bool start_object(std::size_t) override {
+        return start(json::object());
+    }
+    bool end_object() override {
+        return end();
+    }
+    bool start_array(std::size_t) override {
+        return start(json::array());
+    }
+    bool end_array() override {
+        return end();
+    }
+    bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception& e) override {
+        throw std::runtime_error("Failed to parse lock file " + path_.string() + ": " + e.what());
+    }
+
+  private:
+    enum class Scope { Root, Dependencies, Dependency };
+
+    [[noreturn]] void fail(std::string_view what) const {
+        throw std::runtime_error(fmt::format("Invalid lock file {}: {}", path_.string(), what));
+    }
+
+    std::string expect_string(json&& value) const {
+        if (!value.is_string()) {
+            fail(fmt::format("\"{}\" must be a string", key_));
+        }
+        return std::move(value.get_ref<std::string&>());
+    }
+
+    json* insert(json&& value) {
+        json& parent = *tree_.back();
+        if (parent.is_array()) {
+            parent.push_back(std::move(value));
+            return &parent.back();
+        }
+        json& slot = parent[key_];
+        slot = std::move(value);
+        return &slot;
+    }
+
+    bool scalar(json&& value) {
+        if (skip_ != 0) {
+            return true;
+        }
+        if (!tree_.empty()) {
+            insert(std::move(value));
+            return true;
+        }
+        if (scopes_.empty()) {
+            fail("top level must be an object");
+        }
+        switch (scopes_.back()) {
+        case Scope::Root:
+            if (key_ == "version") {
+                lock_.version = expect_string(std::move(value));
+            }
+            break;
+        case Scope::Dependencies:
+            fail(fmt::format("dependency \"{}\" must be an object", key_));
+        case Scope::Dependency:
+            if (key_ == "name") {
+                dep_.name = expect_string(std::move(value));
+            } else if (key_ == "version") {
+                dep_.version = expect_string(std::move(value));
+            } else if (key_ == "method") {
+                dep_.method = expect_string(std::move(value));
+            } else if (key_ == "args") {
+                dep_.args = std::move(value);
+            } else if (key_ == "metadata") {
+                dep_.metadata = std::move(value);
+            }
+            break;
+        }
+        return true;
+    }
+
+    bool start(json&& container) {
+        if (skip_ != 0) {
+            skip_++;
+            return true;
+        }
+        if (!tree_.empty()) {
+            tree_.push_back(insert(std::move(container)));
+            return true;
+        }
+        if (scopes_.empty()) {
+            if (!container.is_object()) {
+                fail("top level must be an object");
+            }
+            scopes_.push_back(Scope::Root);
+            return true;
+        }
+        switch (scopes_.back()) {
+        case Scope::Root:
+            if (key_ == "dependencies" && container.is_object()) {
+                scopes_.push_back(Scope::Dependencies);
+            } else {
+                skip_++;
+            }
+            break;
+        case Scope::Dependencies:
+            if (!container.is_object()) {
+                fail(fmt::format("dependency \"{}\" must be an object", key_));
+            }
+            // Same defaults as LockFile::from_json
+            dep_ = Dependency{key_, "unknown", "", json::object(), json::object()};
+            dep_key_ = key_;
+            scopes_.push_back(Scope::Dependency);
+            break;
+        case Scope::Dependency:
+            if (key_ == "args") {
+                dep_.args = std::move(container);
+                tree_.push_back(&dep_.args);
+            } else if (key_ == "metadata") {
+                dep_.metadata = std::move(container);
+                tree_.push_back(&dep_.metadata);
+            } else {
+                skip_++;
+            }
+            break;
+        }
+        return true;
+    }
+
+    bool end() {
+        if (skip_ != 0) {
+            skip_--;
+        } else if (!tree_.empty()) {
+            tree_.pop_back();
+        } else {
+            if (scopes_.back() == Scope::Dependency) {
+                lock_.dependencies[dep_key_] = std::move(dep_);
+            }
+            scopes_.pop_back();
+        }
+        return true;
+    }
+
+    LockFile& lock_;
+    const fs::path& path_;
+    std::vector<Scope> scopes_;
+    std::vector<json*> tree_; // Open containers inside args/metadata
+    size_t skip_ = 0;         // Depth inside an ignored container
+    std::string key_;
+    std::string dep_key_;
+    Dependency dep_;
+};
+
+// Canonical order for fetcher arguments, matching how they read in Nix; any
+// other keys follow alphabetically
+constexpr std::array<std::string_view, 7> arg_order = {"owner", "repo", "url",   "rev",
+                                                       "tag",   "hash", "sha256"};
+
+// Streams a LockFile in `json::dump(2)` layout without building a DOM. Field
+// order is fixed (schema order, fetcher order for args, sorted elsewhere) so
+// the same lock always serialises to the same bytes.
+class LockWriter {
+  public:
+    explicit LockWriter(fsutil::AtomicFile& out) : out_(out) {}
+
+    void write(const LockFile& lock) {
+        out_.put('{');
+        depth_++;
+        first_ = true;
+        field("version");
+        string(lock.version);
+        field("dependencies");
+        if (lock.dependencies.empty()) {
+            out_.write("{}");
+        } else {
+            open('{');
+            for (const auto& [name, dep] : lock.dependencies) {
+                field(name);
+                open('{');
+                field("name");
+                string(dep.name);
+                field("version");
+                string(dep.version);
+                field("method");
+                string(dep.method);
+                field("args");
+                args(dep.args);
+                field("metadata");
+                value(dep.metadata);
+                close('}');
+            }
+            close('}');
+        }
+        close('}');
+        out_.put('\n');
+    }
+
+  private:
+    void newline() {
+        out_.put('\n');
+        for (unsigned i = 0; i < depth_; ++i) {
+            out_.write("  ");
+        }
+    }
+
+    void open(char bracket) {
+        out_.put(bracket);
+        depth_++;
+        first_ = true;
+    }
+
+    void close(char bracket) {
+        depth_--;
+        newline();
+        out_.put(bracket);
+        first_ = false;
+    }
+
+    // Separator and indentation before the next element of the open container
+    void element() {
+        if (!first_) {
+            out_.put(',');
+        }
+        first_ = false;
+        newline();
+    }
+
+    void field(std::string_view key) {
+        element();
+        string(key);
+        out_.write(": ");
+    }
+
+    void string(std::string_view text) {
+        static constexpr char hex[] = "0123456789abcdef";
+        out_.put('"');
+        size_t run = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            auto c = static_cast<unsigned char>(text[i]);
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                continue;
+            }
+            out_.write(text.substr(run, i - run));
+            run = i + 1;
+            switch (c) {
+            case '"':
+                out_.write("\\\"");
+                break;
+            case '\\':
+                out_.write("\\\\");
+                break;
+            case '\b':
+                out_.write("\\b");
+                break;
+            case '\f':
+                out_.write("\\f");
+                break;
+            case '\n':
+                out_.write("\\n");
+                break;
+            case '\r':
+                out_.write("\\r");
+                break;
+            case '\t':
+                out_.write("\\t");
+                break;
+            default:
+                out_.write("\\u00");
+                out_.put(hex[c >> 4]);
+                out_.put(hex[c & 0xf]);
+                break;
+            }
+        }
+        out_.write(text.substr(run));
+        out_.put('"');
+    }
+
+    void value(const json& j) {
+        if (j.is_object()) {
+            if (j.empty()) {
+                out_.write("{}");
+                return;
+            }
+            open('{');
+            for (const auto& [key, item] : j.items()) {
+                field(key);
+                value(item);
+            }
+            close('}');
+        } else if (j.is_array()) {
+            if (j.empty()) {
+                out_.write("[]");
+                return;
+            }
+            open('[');
+            for (const auto& item : j) {
+                element();
+                value(item);
+            }
+            close(']');
+        } else if (j.is_string()) {
+            string(j.get_ref<const std::string&>());
+        } else {
+            out_.write(j.dump());
+        }
+    }
+
+    void args(const json& j) {
+        if (!j.is_object() || j.empty()) {
+            value(j);
+            return;
+        }
+        open('{');
+        for (auto key : arg_order) {
+            if (auto it = j.find(key); it != j.end()) {
+                field(key);
+                value(*it);
+            }
+        }
+        for (const auto& [key, item] : j.items()) {
+            if (std::find(arg_order.begin(), arg_order.end(), key) == arg_order.end()) {
+                field(key);
+                value(item);
+            }
+        }
+        close('}');
+    }
+
+    fsutil::AtomicFile& out_;
+    unsigned depth_ = 0;
+    bool first_ = true;
+};
+} // namespace
+
 LockFile load(const fs::path& path) {
+    trace::Span span("load_lock");
     if (!fs::exists(path)) {
         throw std::runtime_error("Lock file not found: " + path.string());
     }
 
-    std::ifstream file(path);
-    if (!file) {
-        throw std::runtime_error("Failed to open lock file: " + path.string());
-    }
+    // Parse straight from the mapping into the LockFile, with no intermediate DOM
+    fsutil::MappedFile file(path);
+    auto text = file.text();
 
-    json j;
-    file >> j;
+    LockFile lock;
+    LockReader reader(lock, path);
+    json::sax_parse(text.begin(), text.end(), &reader);
 
-    return LockFile::from_json(j);
+    return lock;
 }
 
 void save(const LockFile& lock, const fs::path& path) {
-    std::ofstream file(path);
-    if (!file) {
-        throw std::runtime_error("Failed to write lock file: " + path.string());
+    trace::Span span("save_lock");
+    // Temp file + fsync + rename: a crash leaves either the old lock or the new one
+    fsutil::AtomicFile file(path);
+    LockWriter(file).write(lock);
+    file.commit(/*durable=*/true);
+
+    fmt::print("cmake2nix: Lock file saved: {}\n", path.string());
+}
+
+bool ChangeSet::is_dirty(const std::string& name) const {
+    auto it = changes.find(name);
+    return it != changes.end() && it->second != Change::Unchanged;
+}
+
+size_t ChangeSet::count(Change kind) const {
+    return size_t(std::count_if(changes.begin(), changes.end(),
+                                [&](const auto& entry) { return entry.second == kind; }));
+}
+
+size_t ChangeSet::dirty_count() const {
+    return changes.size() - count(Change::Unchanged);
+}
+
+std::string_view hash_field(const Dependency& dep) {
+    if (dep.args.contains("hash")) {
+        return "hash";
     }
+    if (dep.args.contains("sha256")) {
+        return "sha256";
+    }
+    return dep.method == "fetchFromGitHub" ? "hash" : "sha256";
+}
 
-    json j = lock.to_json();
-    file << j.dump(2) << "\n";
+bool is_pinned(const Dependency& dep) {
+    if (!dep.args.is_object()) {
+        return false;
+    }
+    auto it = dep.args.find(hash_field(dep));
+    if (it == dep.args.end() || !it->is_string()) {
+        return false;
+    }
+    const auto& hash = it->get_ref<const std::string&>();
+    return !hash.empty() && hash != placeholder_hash;
+}
 
-    fmt::print("cmake2nix: Lock file saved: {}\n", path.string());
+bool same_source(const Dependency& a, const Dependency& b) {
+    if (a.method != b.method) {
+        return false;
+    }
+    if (!a.args.is_object() || !b.args.is_object()) {
+        return a.args == b.args;
+    }
+    auto is_hash = [](const std::string& key) { return key == "hash" || key == "sha256"; };
+    size_t compared = 0;
+    for (const auto& [key, value] : a.args.items()) {
+        if (is_hash(key)) {
+            continue;
+        }
+        auto it = b.args.find(key);
+        if (it == b.args.end() || *it != value) {
+            return false;
+        }
+        compared++;
+    }
+    size_t other = 0;
+    for (const auto& [key, value] : b.args.items()) {
+        other += is_hash(key) ? 0 : 1;
+    }
+    return compared == other;
 }
 
-LockFile merge(const LockFile& old_lock, const std::vector<Dependency>& new_deps) {
-    LockFile merged = old_lock;
+MergeResult merge(const LockFile& old_lock, const std::vector<Dependency>& new_deps) {
+    trace::Span span("merge");
+    // Entries discovery no longer reports are kept as they were
+    MergeResult result{old_lock, {}};
+    auto& merged = result.lock.dependencies;
+    auto& changes = result.changes.changes;
+    for (const auto& [name, dep] : merged) {
+        changes[name] = is_pinned(dep) ? Change::Unchanged : Change::Unpinned;
+    }
 
-    // Add or update dependencies
     for (const auto& dep : new_deps) {
-        auto it = merged.dependencies.find(dep.name);
-        if (it != merged.dependencies.end()) {
-            // Preserve existing hash if version matches
-            if (it->second.version == dep.version) {
-                // Keep old args (which may have real hash)
-                // Only update if new dep has a hash
-                if (dep.args.contains("hash") || dep.args.contains("sha256")) {
-                    it->second = dep;
-                }
-                continue;
-            }
+        auto it = merged.find(dep.name);
+        if (it == merged.end()) {
+            merged.emplace(dep.name, dep);
+            changes[dep.name] = Change::Added;
+            continue;
+        }
+
+        auto& current = it->second;
+        if (current.version != dep.version) {
+            current = dep;
+            changes[dep.name] = Change::VersionChanged;
+        } else if (!same_source(current, dep)) {
+            current = dep;
+            changes[dep.name] = Change::RevChanged;
+        } else if (is_pinned(dep) && (!is_pinned(current) || current.args != dep.args)) {
+            // A hash declared in the CMake sources (URL_HASH) is authoritative
+            bool repinned = is_pinned(current);
+            current = dep;
+            changes[dep.name] = repinned ? Change::HashChanged : Change::Unchanged;
+        } else {
+            // Same source: keep the pinned hash and refresh the metadata
+            current.metadata = dep.metadata;
+            changes[dep.name] = is_pinned(current) ? Change::Unchanged : Change::Unpinned;
         }
-        // New dependency or version changed
-        merged.dependencies[dep.name] = dep;
     }
 
-    return merged;
+    return result;
 }
 
 } // namespace cmake2nix::lockfile
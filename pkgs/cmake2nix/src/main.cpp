@@ -1,12 +1,25 @@
 #include "cmake2nix.hpp"
 
 #include <CLI/CLI.hpp>
+#include <cstdlib>
 #include <fmt/core.h>
 #include <iostream>
 
 using namespace cmake2nix;
 
 int main(int argc, char** argv) {
+    // nix-compiler-launcher's cache mode, once per translation unit: no CLI setup, and
+    // everything after the subcommand is the compiler's command line
+    if (argc > 1 && std::string_view(argv[1]) == "compile") {
+        try {
+            return commands::compile({argv + 2, argv + argc});
+        } catch (const std::exception& e) {
+            fmt::print(stderr, "Error: {}\n", e.what());
+            return 1;
+        }
+    }
+
+    auto process_start = trace::Clock::now();
     CLI::App app{"cmake2nix - Generate Nix expressions for CMake projects"};
     app.require_subcommand(0, 1);
 
@@ -20,57 +33,177 @@ int main(int argc, char** argv) {
     app.add_option("--packages-nix", config.packages_nix, "Packages file name");
     app.add_option("--env-nix", config.env_nix, "Environment file name");
     app.add_option("--composition", config.composition_nix, "Composition file name");
+    app.add_flag("--shard", config.shard,
+                 "Generate one file per dependency, imported lazily from the packages file");
+    app.add_option("--shard-dir", config.shard_dir, "Directory for per-dependency files");
     app.add_option("--cmake-flags", config.cmake_flags, "CMake flags for discovery");
     app.add_flag("--recursive", config.recursive, "Enable recursive discovery");
     app.add_flag("--no-prefetch", config.no_prefetch, "Skip hash prefetching");
     app.add_flag("-v,--verbose", config.verbose, "Verbose output");
+    app.add_option("-j,--jobs", config.jobs, "Parallel prefetch workers (default: number of cores)");
+    app.add_option("--host-jobs", config.host_jobs, "Maximum concurrent prefetches per host");
+    app.add_option("--cache-dir", config.cache_dir,
+                   "Prefetch cache directory (default: $XDG_CACHE_HOME/cmake2nix)");
+    app.add_flag("--external-prefetch", config.external_prefetch,
+                 "Hash sources with nix-prefetch-github/-git/-url instead of in-process");
+    app.add_flag("--no-cache", config.no_cache,
+                 "Don't read or write the prefetch, discovery or generate caches");
+    app.add_option("--trace", config.trace_file,
+                   "Write a Chrome trace of the run (chrome://tracing, ui.perfetto.dev)");
+    app.add_flag("--stats", config.stats,
+                 "Print time per phase, the slowest dependencies and child process time");
+
+    // Commands start recording once the options are known; startup is everything before
+    auto traced = [&](std::string_view name, std::function<void()> command) {
+        return [&config, process_start, name, command = std::move(command)]() {
+            if (!config.trace_file.empty() || config.stats) {
+                trace::start(process_start);
+                trace::record("startup", "phase", process_start, trace::Clock::now());
+            }
+            trace::Span span(name, "command");
+            command();
+        };
+    };
 
     // Subcommands
     auto* discover_cmd = app.add_subcommand("discover", "Discover dependencies by running CMake");
-    discover_cmd->callback([&]() { commands::discover(config); });
+    discover_cmd->callback(traced("discover", [&]() { commands::discover(config); }));
 
     auto* prefetch_cmd =
         app.add_subcommand("prefetch", "Prefetch hashes for dependencies in lock file");
-    prefetch_cmd->callback([&]() { commands::prefetch(config); });
+    prefetch_cmd->callback(traced("prefetch", [&]() { commands::prefetch(config); }));
 
     auto* generate_cmd = app.add_subcommand("generate", "Generate Nix expressions from lock file");
-    generate_cmd->callback([&]() { commands::generate(config); });
+    generate_cmd->callback(traced("generate", [&]() { commands::generate(config); }));
 
     auto* lock_cmd = app.add_subcommand("lock", "Update lock file (discover + prefetch)");
-    lock_cmd->callback([&]() { commands::lock(config); });
+    lock_cmd->callback(traced("lock", [&]() { commands::lock(config); }));
+
+    auto* scan_cmd = app.add_subcommand(
+        "scan", "Statically scan CMake files for project info and candidate dependencies");
+    scan_cmd->callback(traced("scan", [&]() { commands::scan(config); }));
+
+    auto* manifest_cmd = app.add_subcommand(
+        "deps-manifest",
+        "Write the dependency search paths of the build environment for cmakeBuildHook.cmake");
+    fs::path manifest_file = "nix-deps.cmake";
+    int host_offset = 0;
+    int target_offset = 0;
+    manifest_cmd->add_option("file", manifest_file, "Manifest location");
+    manifest_cmd->add_option("--host-offset", host_offset, "NIX_HOST_OFFSET of the build");
+    manifest_cmd->add_option("--target-offset", target_offset, "NIX_TARGET_OFFSET of the build");
+    manifest_cmd->callback(traced("deps-manifest", [&]() {
+        commands::deps_manifest(manifest_file, host_offset, target_offset);
+    }));
+
+    auto* index_cmd = app.add_subcommand(
+        "index-prefixes", "Index the CMake package config files of the dependency prefixes");
+    fs::path index_file = "nix-packages.cmake";
+    std::vector<std::string> index_prefixes;
+    index_cmd->add_option("file", index_file, "Index location");
+    index_cmd->add_option("--prefix", index_prefixes,
+                          "Prefix to index, in search order (default: the build environment's)");
+    index_cmd->callback(traced("index-prefixes", [&]() {
+        commands::index_prefixes(index_file, index_prefixes, config.jobs);
+    }));
+
+    auto* targets_cmd = app.add_subcommand(
+        "deps-targets", "List the FetchContent targets of a configured build (File API reply)");
+    fs::path reply_dir = ".cmake/api/v1/reply";
+    bool targets_all = false;
+    bool targets_outputs = false;
+    targets_cmd->add_option("reply-dir", reply_dir, "File API reply directory");
+    targets_cmd->add_flag("--all", targets_all,
+                          "Every dependency target, not just those the project depends on");
+    targets_cmd->add_flag("--outputs", targets_outputs,
+                          "List their object directories and artifacts instead");
+    targets_cmd->callback(traced("deps-targets", [&]() {
+        commands::deps_targets(reply_dir, targets_all, targets_outputs);
+    }));
+
+    auto* codemodel_cmd = app.add_subcommand(
+        "codemodel", "Summarize the targets of a configured build (File API reply) for Nix");
+    fs::path codemodel_reply_dir = ".cmake/api/v1/reply";
+    fs::path codemodel_file;
+    codemodel_cmd->add_option("reply-dir", codemodel_reply_dir, "File API reply directory");
+    codemodel_cmd->add_option("file", codemodel_file,
+                              "Summary to write, a Nix expression if it ends in .nix "
+                              "(default: JSON to stdout)");
+    codemodel_cmd->callback(traced("codemodel", [&]() {
+        commands::codemodel_summary(codemodel_reply_dir, codemodel_file, config.jobs);
+    }));
+
+    auto* cache_cmd = app.add_subcommand(
+        "compile-cache", "Show the statistics of the compiler launcher's compile cache");
+    fs::path cache_dir;
+    bool cache_clear = false;
+    bool cache_zero_stats = false;
+    cache_cmd->add_option("directory", cache_dir,
+                          "Cache directory (default: $NIX_CMAKE_COMPILE_CACHE)");
+    cache_cmd->add_flag("--clear", cache_clear, "Remove every cached object");
+    cache_cmd->add_flag("--zero-stats", cache_zero_stats, "Reset the hit and miss counters");
+    cache_cmd->callback(traced("compile-cache", [&]() {
+        if (cache_dir.empty()) {
+            const char* dir = std::getenv("NIX_CMAKE_COMPILE_CACHE");
+            if (dir == nullptr || *dir == '\0') {
+                throw std::runtime_error(
+                    "No cache directory given and NIX_CMAKE_COMPILE_CACHE is not set");
+            }
+            cache_dir = dir;
+        }
+        commands::compile_cache(cache_dir, cache_clear, cache_zero_stats);
+    }));
 
     auto* init_cmd = app.add_subcommand("init", "Scaffold a new nix-cmake project");
     std::string init_dir = ".";
     init_cmd->add_option("directory", init_dir, "Project directory");
-    init_cmd->callback([&]() { commands::init(init_dir); });
+    init_cmd->callback(traced("init", [&]() { commands::init(init_dir); }));
 
     auto* shell_cmd = app.add_subcommand("shell", "Enter development shell");
-    shell_cmd->callback([&]() { commands::shell(config); });
+    shell_cmd->callback(traced("shell", [&]() { commands::shell(config); }));
 
     auto* build_cmd = app.add_subcommand("build", "Build the project");
-    build_cmd->callback([&]() { commands::build(config); });
+    build_cmd->callback(traced("build", [&]() { commands::build(config); }));
 
     // Default command (no subcommand): full workflow
+    auto workflow = traced("workflow", [&]() {
+        // Full workflow: discover + prefetch + generate
+        fmt::print("cmake2nix: Running full workflow (discover + prefetch + generate)\n");
+        commands::discover(config);
+        if (!config.no_prefetch) {
+            commands::prefetch(config);
+        }
+        commands::generate(config);
+    });
     app.callback([&]() {
         if (app.get_subcommands().empty()) {
-            // Full workflow: discover + prefetch + generate
-            fmt::print("cmake2nix: Running full workflow (discover + prefetch + generate)\n");
-            commands::discover(config);
-            if (!config.no_prefetch) {
-                commands::prefetch(config);
-            }
-            commands::generate(config);
+            workflow();
         }
     });
 
+    int status = 0;
     try {
         app.parse(argc, argv);
     } catch (const CLI::ParseError& e) {
         return app.exit(e);
     } catch (const std::exception& e) {
         fmt::print(stderr, "Error: {}\n", e.what());
-        return 1;
+        status = 1;
     }
 
-    return 0;
+    // Also after a failure: a trace of where it failed is the point
+    if (trace::enabled()) {
+        try {
+            if (!config.trace_file.empty()) {
+                trace::write(config.trace_file);
+            }
+            if (config.stats) {
+                trace::print_stats();
+            }
+        } catch (const std::exception& e) {
+            fmt::print(stderr, "Error: Failed to write trace: {}\n", e.what());
+            status = 1;
+        }
+    }
+    return status;
 }
@@ -0,0 +1,293 @@
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <thread>
+
+extern char** environ;
+
+namespace cmake2nix::manifest {
+
+namespace {
+// The stdenv dependency variables with their (host, target) offsets, in the order
+// cmakeBuildHook.cmake walks them
+struct DependencyVariable {
+    const char* name;
+    int host;
+    int target;
+};
+
+constexpr std::array<DependencyVariable, 12> dependency_variables = {{
+    {"depsBuildBuild", -1, -1},
+    {"nativeBuildInputs", -1, 0},
+    {"depsBuildTarget", -1, 1},
+    {"depsHostHost", 0, 0},
+    {"buildInputs", 0, 1},
+    {"depsTargetTarget", 1, 1},
+    {"depsBuildBuildPropagated", -1, -1},
+    {"propagatedNativeBuildInputs", -1, 0},
+    {"depsBuildTargetPropagated", -1, 1},
+    {"depsHostHostPropagated", 0, 0},
+    {"propagatedBuildInputs", 0, 1},
+    {"depsTargetTargetPropagated", 1, 1},
+}};
+
+// Sibling outputs of a multi-output store path that are probed for
+constexpr std::array<std::string_view, 8> nix_outputs = {"dev",    "lib", "bin", "out",
+                                                         "static", "doc", "man", "info"};
+
+// Appends unless already present; the first occurrence keeps its position, as with
+// list(REMOVE_DUPLICATES) after all appends
+void add(PathList& list, std::string path) {
+    if (list.seen.insert(path).second) {
+        list.paths.push_back(std::move(path));
+    }
+}
+
+bool path_exists(const std::string& path) {
+    std::error_code ec;
+    return fs::exists(path, ec);
+}
+
+// One store path, classified like process_nix_dependency() in cmakeBuildHook.cmake
+void classify(SearchPaths& out, const std::string& dep, int host, int target) {
+    add(out.prefix, dep);
+
+    bool native_tool = host == -1 && (target == -1 || target == 0 || target == 1);
+    bool target_library = host == 0 && target == 1;
+    if (native_tool && path_exists(dep + "/bin")) {
+        add(out.program, dep + "/bin");
+    } else if (target_library) {
+        for (auto [dir, list] : {std::pair{"/include", &out.include},
+                                 {"/lib", &out.library},
+                                 {"/Library/Frameworks", &out.framework},
+                                 {"/Applications", &out.appbundle}}) {
+            if (path_exists(dep + dir)) {
+                add(*list, dep + dir);
+            }
+        }
+    }
+
+    // Multi-output packages: /nix/store/<hash>-zlib-1.3-dev also has -out, -lib, ...
+    auto dash = dep.rfind('-');
+    if (dash == std::string::npos || dash == 0 || dash + 1 == dep.size()) {
+        return;
+    }
+    std::string_view base = std::string_view(dep).substr(0, dash);
+    std::string_view current = std::string_view(dep).substr(dash + 1);
+    for (auto output : nix_outputs) {
+        if (output == current) {
+            continue;
+        }
+        auto path = fmt::format("{}-{}", base, output);
+        if (!path_exists(path)) {
+            continue;
+        }
+        add(out.prefix, path);
+        if (target_library) {
+            if (output == "dev" && path_exists(path + "/include")) {
+                add(out.include, path + "/include");
+            }
+            if ((output == "lib" || output == "out") && path_exists(path + "/lib")) {
+                add(out.library, path + "/lib");
+            }
+        } else if (native_tool && (output == "bin" || output == "out") &&
+                   path_exists(path + "/bin")) {
+            add(out.program, path + "/bin");
+        }
+    }
+}
+
+// Quoted CMake argument; ';' is left alone since these are list values
+std::string cmake_string(std::string_view value) {
+    std::string out = "\"";
+    for (char c : value) {
+        if (c == '\\' || c == '"' || c == '$') {
+            out += '\\';
+        }
+        out += c;
+    }
+    return out + '"';
+}
+
+std::string lowercase(std::string_view text) {
+    std::string out(text);
+    std::transform(out.begin(), out.end(), out.begin(),
+                   [](unsigned char c) { return char(std::tolower(c)); });
+    return out;
+}
+
+// Package a config file is for: <Name>Config.cmake or <name>-config.cmake. Names
+// that can't appear in a ${...} variable reference are left out.
+std::optional<std::string> config_package(std::string_view file) {
+    auto is_name_char = [](unsigned char c) {
+        return std::isalnum(c) || c == '_' || c == '.' || c == '+' || c == '-';
+    };
+    for (std::string_view suffix : {"Config.cmake", "-config.cmake"}) {
+        if (file.size() > suffix.size() && file.ends_with(suffix)) {
+            auto name = file.substr(0, file.size() - suffix.size());
+            if (std::all_of(name.begin(), name.end(), is_name_char)) {
+                return std::string(name);
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<fs::path> sorted_subdirectories(const fs::path& dir) {
+    std::vector<fs::path> dirs;
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_directory(ec)) {
+            dirs.push_back(it->path());
+        }
+    }
+    std::sort(dirs.begin(), dirs.end());
+    return dirs;
+}
+
+// Config files of one prefix, first match per package in find_package()'s order
+std::vector<std::pair<std::string, std::string>> scan_prefix(const fs::path& prefix) {
+    // <name>* candidates, each with the directory name it was matched through
+    std::vector<std::pair<std::string, fs::path>> candidates;
+    static constexpr std::array<std::string_view, 5> bases = {"lib", "lib64", "lib32", "libx32",
+                                                              "share"};
+    for (auto base : bases) {
+        for (const auto& dir : sorted_subdirectories(prefix / base / "cmake")) {
+            candidates.emplace_back(lowercase(dir.filename().string()), dir);
+        }
+    }
+    for (auto base : bases) {
+        for (const auto& dir : sorted_subdirectories(prefix / base)) {
+            auto name = lowercase(dir.filename().string());
+            candidates.emplace_back(name, dir);
+            candidates.emplace_back(name, dir / "cmake");
+            candidates.emplace_back(name, dir / "CMake");
+        }
+    }
+
+    std::vector<std::pair<std::string, std::string>> found;
+    std::set<std::string> seen;
+    for (const auto& [matched, dir] : candidates) {
+        std::error_code ec;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            auto package = config_package(it->path().filename().string());
+            if (!package) {
+                continue;
+            }
+            // find_package(<name>) only descends into directories named <name>*
+            auto key = lowercase(*package);
+            if (matched.starts_with(key) && seen.insert(key).second) {
+                found.emplace_back(std::move(key), dir.string());
+            }
+        }
+    }
+    return found;
+}
+
+void append_list(std::string& out, std::string_view name, const PathList& list) {
+    fmt::format_to(std::back_inserter(out), "set({}", name);
+    for (const auto& path : list.paths) {
+        out += "\n    ";
+        out += cmake_string(path);
+    }
+    out += ")\n";
+}
+} // namespace
+
+SearchPaths collect(int host_offset, int target_offset) {
+    SearchPaths paths;
+    for (const auto& variable : dependency_variables) {
+        const char* value = std::getenv(variable.name);
+        if (value == nullptr) {
+            continue;
+        }
+        std::string_view deps = value;
+        while (!deps.empty()) {
+            auto space = deps.find(' ');
+            std::string dep(deps.substr(0, space));
+            deps.remove_prefix(space == std::string_view::npos ? deps.size() : space + 1);
+            if (!dep.empty() && path_exists(dep)) {
+                classify(paths, dep, variable.host - host_offset, variable.target - target_offset);
+            }
+        }
+    }
+
+    constexpr std::string_view source_dir_prefix = "FETCHCONTENT_SOURCE_DIR_";
+    for (char** env = environ; *env != nullptr; ++env) {
+        std::string_view entry = *env;
+        auto eq = entry.find('=');
+        if (entry.starts_with(source_dir_prefix) && eq != std::string_view::npos &&
+            eq > source_dir_prefix.size()) {
+            paths.source_dirs.emplace(entry.substr(0, eq), entry.substr(eq + 1));
+        }
+    }
+    return paths;
+}
+
+std::string generate(const SearchPaths& paths, int host_offset, int target_offset) {
+    std::string out;
+    out += "# Generated by cmake2nix deps-manifest\n";
+    out += "# Do not edit this file manually\n";
+    fmt::format_to(std::back_inserter(out), "set(NIX_DEPS_MANIFEST_VERSION {})\n",
+                   format_version);
+    fmt::format_to(std::back_inserter(out), "set(NIX_DEPS_HOST_OFFSET {})\n", host_offset);
+    fmt::format_to(std::back_inserter(out), "set(NIX_DEPS_TARGET_OFFSET {})\n", target_offset);
+    append_list(out, "NIX_DEPS_PREFIX_PATH", paths.prefix);
+    append_list(out, "NIX_DEPS_INCLUDE_PATH", paths.include);
+    append_list(out, "NIX_DEPS_LIBRARY_PATH", paths.library);
+    append_list(out, "NIX_DEPS_PROGRAM_PATH", paths.program);
+    append_list(out, "NIX_DEPS_FRAMEWORK_PATH", paths.framework);
+    append_list(out, "NIX_DEPS_APPBUNDLE_PATH", paths.appbundle);
+
+    out += "set(NIX_DEPS_FETCHCONTENT_SOURCE_DIRS";
+    for (const auto& [variable, dir] : paths.source_dirs) {
+        fmt::format_to(std::back_inserter(out), "\n    {} {}", variable, cmake_string(dir));
+    }
+    out += ")\n";
+    return out;
+}
+
+std::map<std::string, std::string> index_packages(const std::vector<std::string>& prefixes,
+                                                  unsigned jobs) {
+    std::vector<std::vector<std::pair<std::string, std::string>>> found(prefixes.size());
+    std::atomic<size_t> next = 0;
+    {
+        unsigned workers = jobs != 0 ? jobs : std::thread::hardware_concurrency();
+        std::vector<std::jthread> pool;
+        size_t count = std::clamp<size_t>(workers, 1, std::max<size_t>(prefixes.size(), 1));
+        for (size_t i = 0; i < count; ++i) {
+            pool.emplace_back([&] {
+                for (size_t j; (j = next++) < prefixes.size();) {
+                    found[j] = scan_prefix(prefixes[j]);
+                }
+            });
+        }
+    }
+
+    // Earlier prefixes win, as they are searched first
+    std::map<std::string, std::string> index;
+    for (auto& packages : found) {
+        for (auto& [name, dir] : packages) {
+            index.emplace(std::move(name), std::move(dir));
+        }
+    }
+    return index;
+}
+
+std::string generate_package_index(const std::map<std::string, std::string>& index) {
+    std::string out;
+    out += "# Generated by cmake2nix index-prefixes\n";
+    out += "# Do not edit this file manually\n";
+    fmt::format_to(std::back_inserter(out), "set(NIX_PACKAGE_INDEX_VERSION {})\n",
+                   package_index_version);
+    for (const auto& [name, dir] : index) {
+        fmt::format_to(std::back_inserter(out), "set(NIX_PACKAGE_INDEX_{} {})\n", name,
+                       cmake_string(dir));
+    }
+    return out;
+}
+
+} // namespace cmake2nix::manifest
@@ -0,0 +1,138 @@
+#include "cmake2nix.hpp"
+
+namespace cmake2nix::matchers {
+
+namespace {
+constexpr bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+constexpr bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool is_word(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+constexpr bool is_base64(char c) {
+    return is_digit(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '+' ||
+           c == '/' || c == '=';
+}
+
+constexpr size_t skip_space(std::string_view s, size_t pos) {
+    while (pos < s.size() && is_space(s[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+template <typename Pred> constexpr size_t skip_while(std::string_view s, size_t pos, Pred pred) {
+    while (pos < s.size() && pred(s[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+// [0-9]+ "." [0-9]+ ( "." [0-9]+ )?  starting at pos; returns the match length
+constexpr size_t match_version_number(std::string_view s, size_t pos) {
+    size_t major_end = skip_while(s, pos, is_digit);
+    if (major_end == pos || major_end >= s.size() || s[major_end] != '.') {
+        return 0;
+    }
+    size_t minor_end = skip_while(s, major_end + 1, is_digit);
+    if (minor_end == major_end + 1) {
+        return 0;
+    }
+    if (minor_end < s.size() && s[minor_end] == '.') {
+        size_t patch_end = skip_while(s, minor_end + 1, is_digit);
+        if (patch_end != minor_end + 1) {
+            return patch_end - pos;
+        }
+    }
+    return minor_end - pos;
+}
+
+static_assert(match_version_number("1.2.3", 0) == 5);
+static_assert(match_version_number("10.2.", 0) == 4);
+static_assert(match_version_number("1.", 0) == 0);
+} // namespace
+
+std::optional<GitHubRepo> github_repo(std::string_view url) {
+    // Equivalent to: https?://github\.com/([^/]+)/([^/\.]+)
+    static constexpr std::string_view host = "github.com/";
+    for (size_t pos = url.find("http"); pos != std::string_view::npos;
+         pos = url.find("http", pos + 1)) {
+        size_t p = pos + 4;
+        if (p < url.size() && url[p] == 's') {
+            p++;
+        }
+        if (url.substr(p, 3) != "://" || url.substr(p + 3, host.size()) != host) {
+            continue;
+        }
+        p += 3 + host.size();
+
+        size_t owner_end = url.find('/', p);
+        if (owner_end == std::string_view::npos || owner_end == p) {
+            continue;
+        }
+        size_t repo_begin = owner_end + 1;
+        size_t repo_end = skip_while(url, repo_begin, [](char c) { return c != '/' && c != '.'; });
+        if (repo_end == repo_begin) {
+            continue;
+        }
+        return GitHubRepo{url.substr(p, owner_end - p),
+                          url.substr(repo_begin, repo_end - repo_begin)};
+    }
+    return std::nullopt;
+}
+
+std::string_view find_sri_sha256(std::string_view text) {
+    // Equivalent to: sha256-[A-Za-z0-9+/=]+
+    static constexpr std::string_view prefix = "sha256-";
+    for (size_t pos = text.find(prefix); pos != std::string_view::npos;
+         pos = text.find(prefix, pos + 1)) {
+        size_t end = skip_while(text, pos + prefix.size(), is_base64);
+        if (end != pos + prefix.size()) {
+            return text.substr(pos, end - pos);
+        }
+    }
+    return {};
+}
+
+std::optional<std::string_view> project_name(std::string_view content) {
+    // Equivalent to: project\s*\(\s*(\w+)
+    static constexpr std::string_view keyword = "project";
+    for (size_t pos = content.find(keyword); pos != std::string_view::npos;
+         pos = content.find(keyword, pos + 1)) {
+        size_t p = skip_space(content, pos + keyword.size());
+        if (p >= content.size() || content[p] != '(') {
+            continue;
+        }
+        size_t name_begin = skip_space(content, p + 1);
+        size_t name_end = skip_while(content, name_begin, is_word);
+        if (name_end != name_begin) {
+            return content.substr(name_begin, name_end - name_begin);
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<std::string_view> version(std::string_view content) {
+    // Equivalent to: VERSION\s+([0-9]+\.[0-9]+(?:\.[0-9]+)?)
+    static constexpr std::string_view keyword = "VERSION";
+    for (size_t pos = content.find(keyword); pos != std::string_view::npos;
+         pos = content.find(keyword, pos + 1)) {
+        size_t p = pos + keyword.size();
+        size_t number = skip_space(content, p);
+        if (number == p) {
+            continue;
+        }
+        if (size_t len = match_version_number(content, number); len != 0) {
+            return content.substr(number, len);
+        }
+    }
+    return std::nullopt;
+}
+
+} // namespace cmake2nix::matchers
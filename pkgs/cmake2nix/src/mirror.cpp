@@ -0,0 +1,253 @@
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <fmt/core.h>
+#include <map>
+#include <utility>
+
+namespace cmake2nix::mirror {
+
+namespace {
+subprocess::Result git(const fs::path& git_dir, std::vector<std::string> args) {
+    args.insert(args.begin(), {"git", "--git-dir=" + git_dir.string()});
+    return subprocess::run(args);
+}
+
+// Run git against a mirror and return its trimmed stdout
+std::string run_git(const fs::path& git_dir, std::vector<std::string> args) {
+    auto result = git(git_dir, std::move(args));
+    if (!result.ok()) {
+        throw std::runtime_error(result.describe("git"));
+    }
+    while (!result.out.empty() && std::isspace(uint8_t(result.out.back()))) {
+        result.out.pop_back();
+    }
+    return std::move(result.out);
+}
+
+void to_lower(std::string& text, size_t begin, size_t end) {
+    std::transform(text.begin() + ptrdiff_t(begin), text.begin() + ptrdiff_t(end),
+                   text.begin() + ptrdiff_t(begin), [](char c) { return char(std::tolower(c)); });
+}
+
+// Readable, collision-free directory name: <repo>-<hash of the normalized URL>
+std::string mirror_name(const std::string& normalized) {
+    auto slash = normalized.find_last_of("/:");
+    std::string base = normalized.substr(slash == std::string::npos ? 0 : slash + 1, 40);
+    for (auto& c : base) {
+        if (!std::isalnum(uint8_t(c)) && c != '-' && c != '_' && c != '.') {
+            c = '_';
+        }
+    }
+    return fmt::format("{}-{}", base, digest::sha256_hex(normalized).substr(0, 16));
+}
+
+struct Submodule {
+    std::string path;
+    std::string url;
+};
+
+// Submodules declared in a checkout's .gitmodules, by name
+std::map<std::string, Submodule> read_gitmodules(const fs::path& dir) {
+    auto result = subprocess::run({"git", "-C", dir.string(), "config", "-f", ".gitmodules",
+                                   "--get-regexp", R"(^submodule\..*\.(path|url)$)"});
+    std::map<std::string, Submodule> modules;
+    std::string_view out = result.out;
+    while (!out.empty()) {
+        auto nl = out.find('\n');
+        auto line = out.substr(0, nl);
+        out.remove_prefix(nl == std::string_view::npos ? out.size() : nl + 1);
+
+        // submodule.<name>.<key> <value>; the name itself may contain dots
+        auto space = line.find(' ');
+        auto dot = line.rfind('.', space);
+        if (space == std::string_view::npos || dot == std::string_view::npos || dot < 10) {
+            continue;
+        }
+        auto& module = modules[std::string(line.substr(10, dot - 10))];
+        (line.substr(dot + 1, space - dot - 1) == "path" ? module.path : module.url) =
+            line.substr(space + 1);
+    }
+    return modules;
+}
+} // namespace
+
+std::string normalize_url(std::string_view url) {
+    while (!url.empty() && std::isspace(uint8_t(url.front()))) {
+        url.remove_prefix(1);
+    }
+    while (!url.empty() && std::isspace(uint8_t(url.back()))) {
+        url.remove_suffix(1);
+    }
+
+    std::string out(url);
+    auto scheme = out.find("://");
+    if (scheme == std::string::npos) {
+        // scp-like syntax: [user@]host:path, as long as no slash precedes the colon
+        auto colon = out.find(':');
+        if (colon != std::string::npos && out.find('/') > colon) {
+            out = fmt::format("ssh://{}/{}", out.substr(0, colon), out.substr(colon + 1));
+            scheme = 3;
+        }
+    }
+    if (scheme != std::string::npos) {
+        // Scheme and host are case-insensitive, the path is not
+        auto host_begin = scheme + 3;
+        auto host_end = std::min(out.find('/', host_begin), out.size());
+        auto at = out.rfind('@', host_end);
+        to_lower(out, 0, scheme);
+        to_lower(out, at != std::string::npos && at >= host_begin ? at + 1 : host_begin,
+                 host_end);
+    }
+
+    while (out.ends_with('/')) {
+        out.pop_back();
+    }
+    if (out.ends_with(".git")) {
+        out.resize(out.size() - 4);
+    }
+    while (out.ends_with('/')) {
+        out.pop_back();
+    }
+    return out;
+}
+
+std::string resolve_url(std::string_view base, std::string_view relative) {
+    if (!relative.starts_with("./") && !relative.starts_with("../")) {
+        return std::string(relative);
+    }
+    std::string out(base);
+    while (out.ends_with('/')) {
+        out.pop_back();
+    }
+    while (true) {
+        if (relative.starts_with("./")) {
+            relative.remove_prefix(2);
+        } else if (relative.starts_with("../")) {
+            relative.remove_prefix(3);
+            auto slash = out.find_last_of("/:");
+            out.resize(slash == std::string::npos ? 0 : slash);
+        } else {
+            break;
+        }
+    }
+    return fmt::format("{}/{}", out, relative);
+}
+
+Repository::Repository(const fs::path& root, std::string url)
+    : root_(root), url_(std::move(url)) {
+    auto name = mirror_name(normalize_url(url_));
+    path_ = root_ / (name + ".git");
+    lock_path_ = root_ / (name + ".lock");
+    fs::create_directories(root_);
+}
+
+// Under the exclusive lock. Built aside and renamed so an interrupted init never
+// leaves a half-configured mirror behind.
+void Repository::initialize() {
+    if (fs::exists(path_ / "HEAD")) {
+        return;
+    }
+    fsutil::TempDir staging(".init-", root_);
+    auto repo = staging.path() / "repo.git";
+    auto result = subprocess::run(
+        {"git", "-c", "init.defaultBranch=main", "init", "-q", "--bare", repo.string()});
+    if (!result.ok()) {
+        throw std::runtime_error(result.describe("git init"));
+    }
+    run_git(repo, {"remote", "add", "origin", url_});
+    fs::rename(repo, path_);
+}
+
+std::string Repository::fetch(const std::string& rev) {
+    fsutil::FileLock lock(lock_path_, true);
+    initialize();
+
+    if (resolver::is_commit_id(rev) && git(path_, {"cat-file", "-e", rev + "^{commit}"}).ok()) {
+        return rev;
+    }
+
+    // Forget worktrees whose checkouts have since been deleted
+    git(path_, {"worktree", "prune"});
+
+    std::string commit;
+    if (git(path_, {"fetch", "-q", "--depth", "1", "--no-tags", "origin", rev}).ok()) {
+        commit = run_git(path_, {"rev-parse", "FETCH_HEAD^{commit}"});
+    } else {
+        // Servers may refuse to serve an unadvertised commit; fetch every ref instead
+        run_git(path_, {"fetch", "-q", "origin", "+refs/heads/*:refs/heads/*",
+                        "+refs/tags/*:refs/tags/*"});
+        commit = run_git(path_, {"rev-parse", rev + "^{commit}"});
+    }
+
+    // gc prunes unreachable objects, so keep every fetched commit referenced
+    run_git(path_, {"update-ref", "refs/cmake2nix/" + commit, commit});
+    return commit;
+}
+
+Checkout Repository::checkout(const std::string& commit, const fs::path& dir) {
+    Checkout checkout(dir);
+    checkout_into(commit, dir, checkout);
+    return checkout;
+}
+
+void Repository::checkout_into(const std::string& commit, const fs::path& dir,
+                               Checkout& checkout) {
+    // Registering a worktree picks its name from the directory name, which races, so
+    // that part is exclusive; populating it only touches the worktree's own index
+    {
+        fsutil::FileLock lock(lock_path_, true);
+        run_git(path_,
+                {"worktree", "add", "-q", "--no-checkout", "--detach", dir.string(), commit});
+    }
+    checkout.mirrors_.push_back(*this);
+    {
+        fsutil::FileLock lock(lock_path_, false);
+        auto result = subprocess::run({"git", "-C", dir.string(), "reset", "-q", "--hard"});
+        if (!result.ok()) {
+            throw std::runtime_error(result.describe("git reset"));
+        }
+    }
+    if (!fs::exists(dir / ".gitmodules")) {
+        return;
+    }
+
+    for (const auto& [name, module] : read_gitmodules(dir)) {
+        if (module.path.empty() || module.url.empty()) {
+            continue;
+        }
+        // "160000 commit <id>\t<path>" for a gitlink; anything else isn't a submodule
+        auto entry = run_git(path_, {"ls-tree", commit, "--", module.path});
+        if (!entry.starts_with("160000 commit ")) {
+            continue;
+        }
+        auto id = entry.substr(14, entry.find('\t') - 14);
+
+        Repository submodule(root_, resolve_url(url_, module.url));
+        submodule.checkout_into(submodule.fetch(id), dir / module.path, checkout);
+    }
+}
+
+Checkout::Checkout(Checkout&& other) noexcept
+    : dir_(std::exchange(other.dir_, {})), mirrors_(std::move(other.mirrors_)) {}
+
+Checkout::~Checkout() {
+    if (dir_.empty()) {
+        return;
+    }
+    // The worktrees' .git files may be gone already (see prefetcher::hash_git), so
+    // `git worktree remove` can't find them; prune drops registrations of missing
+    // directories, and the lock keeps it off a worktree that is still being added
+    std::error_code ec;
+    fs::remove_all(dir_, ec);
+    for (const auto& mirror : mirrors_) {
+        try {
+            fsutil::FileLock lock(mirror.lock_path_, true);
+            git(mirror.path_, {"worktree", "prune"});
+        } catch (const std::exception&) {
+        }
+    }
+}
+
+} // namespace cmake2nix::mirror
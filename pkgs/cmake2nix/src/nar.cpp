@@ -0,0 +1,200 @@
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cmake2nix::nar {
+
+namespace {
+constexpr size_t read_chunk = 64 * 1024;
+
+struct Dumper {
+    Encoder& encoder;
+    const Filter& skip;
+    std::vector<char> buffer = std::vector<char>(read_chunk);
+
+    void file(const fs::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd < 0) {
+            throw std::runtime_error(
+                fmt::format("Failed to open {}: {}", path.string(), std::strerror(errno)));
+        }
+        struct stat st {};
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw std::runtime_error("Failed to stat " + path.string());
+        }
+
+        encoder.regular((st.st_mode & S_IXUSR) != 0, uint64_t(st.st_size));
+        while (true) {
+            ssize_t n = ::read(fd, buffer.data(), buffer.size());
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                int err = errno;
+                ::close(fd);
+                throw std::runtime_error(
+                    fmt::format("Failed to read {}: {}", path.string(), std::strerror(err)));
+            }
+            if (n == 0) {
+                break;
+            }
+            encoder.contents({buffer.data(), size_t(n)});
+        }
+        ::close(fd);
+        encoder.end_regular();
+    }
+
+    void node(const fs::path& path) {
+        auto status = fs::symlink_status(path);
+        switch (status.type()) {
+        case fs::file_type::symlink:
+            encoder.symlink(fs::read_symlink(path).string());
+            break;
+        case fs::file_type::regular:
+            file(path);
+            break;
+        case fs::file_type::directory: {
+            std::vector<std::string> names;
+            for (const auto& entry : fs::directory_iterator(path)) {
+                auto name = entry.path().filename().string();
+                if (!skip || !skip(name)) {
+                    names.push_back(std::move(name));
+                }
+            }
+            std::sort(names.begin(), names.end());
+
+            encoder.begin_directory();
+            for (const auto& name : names) {
+                encoder.entry(name);
+                node(path / name);
+                encoder.end_entry();
+            }
+            encoder.end_directory();
+            break;
+        }
+        default:
+            throw std::runtime_error("Cannot archive special file " + path.string());
+        }
+    }
+};
+} // namespace
+
+Encoder::Encoder(digest::Sha256& sha) : sha_(sha) {
+    token("nix-archive-1");
+}
+
+void Encoder::number(uint64_t value) {
+    std::array<uint8_t, 8> bytes;
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        bytes[i] = uint8_t(value >> (i * 8));
+    }
+    sha_.update(bytes.data(), bytes.size());
+}
+
+void Encoder::pad(uint64_t size) {
+    static constexpr std::array<uint8_t, 8> zeros{};
+    if (size % 8 != 0) {
+        sha_.update(zeros.data(), 8 - size % 8);
+    }
+}
+
+// Strings are length-prefixed and zero-padded to a multiple of eight bytes
+void Encoder::token(std::string_view value) {
+    number(value.size());
+    sha_.update(value);
+    pad(value.size());
+}
+
+void Encoder::regular(bool executable, uint64_t size) {
+    token("(");
+    token("type");
+    token("regular");
+    if (executable) {
+        token("executable");
+        token("");
+    }
+    token("contents");
+    number(size);
+    size_ = size;
+    remaining_ = size;
+}
+
+void Encoder::contents(std::string_view data) {
+    if (data.size() > remaining_) {
+        throw std::runtime_error("NAR: file is larger than its declared size");
+    }
+    sha_.update(data);
+    remaining_ -= data.size();
+}
+
+void Encoder::end_regular() {
+    if (remaining_ != 0) {
+        throw std::runtime_error("NAR: file is smaller than its declared size");
+    }
+    pad(size_);
+    token(")");
+}
+
+void Encoder::symlink(std::string_view target) {
+    token("(");
+    token("type");
+    token("symlink");
+    token("target");
+    token(target);
+    token(")");
+}
+
+void Encoder::begin_directory() {
+    token("(");
+    token("type");
+    token("directory");
+    last_entry_.emplace_back();
+}
+
+void Encoder::entry(std::string_view name) {
+    if (name.empty() || name == "." || name == ".." ||
+        name.find_first_of(std::string_view("/\0", 2)) != std::string_view::npos) {
+        throw std::runtime_error(fmt::format("NAR: invalid entry name '{}'", name));
+    }
+    auto& last = last_entry_.back();
+    if (!last.empty() && name <= last) {
+        throw std::runtime_error(
+            fmt::format("NAR: entry '{}' is out of order or duplicated after '{}'", name, last));
+    }
+    last = name;
+
+    token("entry");
+    token("(");
+    token("name");
+    token(name);
+    token("node");
+}
+
+void Encoder::end_entry() {
+    token(")");
+}
+
+void Encoder::end_directory() {
+    last_entry_.pop_back();
+    token(")");
+}
+
+void dump(const fs::path& path, Encoder& encoder, const Filter& skip) {
+    Dumper{encoder, skip}.node(path);
+}
+
+digest::Sha256::Digest hash_path(const fs::path& path, const Filter& skip) {
+    digest::Sha256 sha;
+    Encoder encoder(sha);
+    dump(path, encoder, skip);
+    return sha.finish();
+}
+
+} // namespace cmake2nix::nar
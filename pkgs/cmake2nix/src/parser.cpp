@@ -1,49 +1,541 @@
 #include "cmake2nix.hpp"
 
-#include <fstream>
-#include <regex>
-#include <sstream>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fmt/core.h>
+#include <mutex>
+#include <set>
+#include <thread>
 
 namespace cmake2nix::parser {
 
-ProjectInfo parse_cmake_lists(const fs::path& path) {
-    std::ifstream file(path);
-    if (!file) {
-        throw std::runtime_error("Failed to open " + path.string());
+namespace {
+
+bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+bool is_identifier_start(char c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') || c == '_';
+}
+
+bool is_identifier(char c) {
+    return is_identifier_start(c) || (c >= '0' && c <= '9');
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) ==
+                      std::tolower(static_cast<unsigned char>(y));
+           });
+}
+
+// Hand-written lexer for cmake-language(7). Arguments are views into the source;
+// escapes and variable references are left for the consumer.
+class Lexer {
+  public:
+    explicit Lexer(std::string_view src) : src_(src) {}
+
+    void run(const std::function<void(const Command&)>& visit) {
+        while (pos_ < src_.size()) {
+            char c = src_[pos_];
+            if (c == '\n') {
+                pos_++;
+                line_++;
+            } else if (is_space(c)) {
+                pos_++;
+            } else if (c == '#') {
+                skip_comment();
+            } else if (is_identifier_start(c)) {
+                command(visit);
+            } else {
+                error("unexpected character");
+            }
+        }
+    }
+
+  private:
+    [[noreturn]] void error(std::string_view what) const {
+        throw std::runtime_error(fmt::format("line {}: {}", line_, what));
+    }
+
+    // Length of a bracket opener "[==[" at pos, or 0 (sets level to the '=' count)
+    size_t bracket_open(size_t pos, size_t& level) const {
+        if (pos >= src_.size() || src_[pos] != '[') {
+            return 0;
+        }
+        size_t p = pos + 1;
+        while (p < src_.size() && src_[p] == '=') {
+            p++;
+        }
+        if (p >= src_.size() || src_[p] != '[') {
+            return 0;
+        }
+        level = p - pos - 1;
+        return p - pos + 1;
+    }
+
+    // Consumes a bracket argument/comment body; returns the content between the brackets
+    std::string_view bracket_body(size_t open_len, size_t level) {
+        size_t begin = pos_ + open_len;
+        std::string close = "]" + std::string(level, '=') + "]";
+        size_t end = src_.find(close, begin);
+        if (end == std::string_view::npos) {
+            error("unterminated bracket");
+        }
+        std::string_view body = src_.substr(begin, end - begin);
+        line_ += size_t(std::count(body.begin(), body.end(), '\n'));
+        pos_ = end + close.size();
+        // A newline directly after the opening bracket is not part of the content
+        if (body.starts_with("\r\n")) {
+            body.remove_prefix(2);
+        } else if (body.starts_with('\n')) {
+            body.remove_prefix(1);
+        }
+        return body;
+    }
+
+    void skip_comment() {
+        size_t level = 0;
+        if (size_t open = bracket_open(pos_ + 1, level); open != 0) {
+            pos_++;
+            bracket_body(open, level);
+            return;
+        }
+        size_t nl = src_.find('\n', pos_);
+        pos_ = nl == std::string_view::npos ? src_.size() : nl;
+    }
+
+    void command(const std::function<void(const Command&)>& visit) {
+        size_t begin = pos_;
+        while (pos_ < src_.size() && is_identifier(src_[pos_])) {
+            pos_++;
+        }
+        command_.name = src_.substr(begin, pos_ - begin);
+        command_.line = line_;
+        command_.arguments.clear();
+
+        while (pos_ < src_.size() && is_space(src_[pos_])) {
+            pos_++;
+        }
+        if (pos_ >= src_.size() || src_[pos_] != '(') {
+            error(fmt::format("expected '(' after {}", command_.name));
+        }
+        pos_++;
+
+        size_t depth = 0;
+        while (true) {
+            if (pos_ >= src_.size()) {
+                error(fmt::format("unterminated call to {}", command_.name));
+            }
+            char c = src_[pos_];
+            if (c == '\n') {
+                pos_++;
+                line_++;
+            } else if (is_space(c)) {
+                pos_++;
+            } else if (c == '#') {
+                skip_comment();
+            } else if (c == '(') {
+                // Nested parentheses (e.g. in if()) are kept as literal arguments
+                command_.arguments.push_back({Argument::Kind::Unquoted, src_.substr(pos_, 1)});
+                depth++;
+                pos_++;
+            } else if (c == ')') {
+                pos_++;
+                if (depth == 0) {
+                    break;
+                }
+                command_.arguments.push_back(
+                    {Argument::Kind::Unquoted, src_.substr(pos_ - 1, 1)});
+                depth--;
+            } else if (c == '"') {
+                quoted();
+            } else if (size_t level = 0, open = bracket_open(pos_, level); open != 0) {
+                command_.arguments.push_back({Argument::Kind::Bracket, bracket_body(open, level)});
+            } else {
+                unquoted();
+            }
+        }
+
+        visit(command_);
+    }
+
+    void quoted() {
+        size_t begin = ++pos_;
+        while (pos_ < src_.size() && src_[pos_] != '"') {
+            if (src_[pos_] == '\\') {
+                pos_++;
+            }
+            if (pos_ < src_.size() && src_[pos_] == '\n') {
+                line_++;
+            }
+            pos_++;
+        }
+        if (pos_ >= src_.size()) {
+            error("unterminated quoted argument");
+        }
+        command_.arguments.push_back({Argument::Kind::Quoted, src_.substr(begin, pos_ - begin)});
+        pos_++;
+    }
+
+    void unquoted() {
+        size_t begin = pos_;
+        while (pos_ < src_.size()) {
+            char c = src_[pos_];
+            if (c == '\\') {
+                pos_ += 2;
+            } else if (c == '"') {
+                // Legacy unquoted arguments may embed quoted sections: -DFOO="a b"
+                size_t close = src_.find('"', pos_ + 1);
+                pos_ = close == std::string_view::npos ? src_.size() : close + 1;
+            } else if (is_space(c) || c == '\n' || c == '(' || c == ')' || c == '#') {
+                break;
+            } else {
+                pos_++;
+            }
+        }
+        pos_ = std::min(pos_, src_.size());
+        command_.arguments.push_back(
+            {Argument::Kind::Unquoted, src_.substr(begin, pos_ - begin)});
+    }
+
+    std::string_view src_;
+    size_t pos_ = 0;
+    size_t line_ = 1;
+    Command command_;
+};
+
+// Index of the value following `keyword` in args, if present
+std::optional<std::string_view> keyword_value(const std::vector<Argument>& args,
+                                              std::string_view keyword, size_t from = 1) {
+    for (size_t i = from; i + 1 < args.size(); ++i) {
+        if (args[i].kind == Argument::Kind::Unquoted && args[i].text == keyword) {
+            return args[i + 1].text;
+        }
+    }
+    return std::nullopt;
+}
+
+// The argument's text, unless it references a variable we cannot expand without
+// configuring (it would also read as an interpolation in generated Nix)
+std::optional<std::string_view> literal(std::optional<std::string_view> text) {
+    if (!text) {
+        return std::nullopt;
+    }
+    for (std::string_view ref : {"${", "$ENV{", "$CACHE{"}) {
+        if (text->find(ref) != std::string_view::npos) {
+            return std::nullopt;
+        }
+    }
+    return text;
+}
+
+// project(<name> [VERSION <version>] ...); unknown fields are left empty
+ProjectInfo project_info(const std::vector<Argument>& args) {
+    ProjectInfo info;
+    info.pname = literal(args[0].text).value_or("");
+    info.version = literal(keyword_value(args, "VERSION")).value_or("");
+    return info;
+}
+
+// CPM's single-string shorthand: "gh:owner/repo@1.2.3#tag", "gl:...", or a URL
+void parse_cpm_shorthand(std::string_view uri, CandidateDependency& dep) {
+    if (auto hash = uri.find('#'); hash != std::string_view::npos) {
+        dep.git_tag = uri.substr(hash + 1);
+        uri = uri.substr(0, hash);
+    }
+    if (auto at = uri.rfind('@'); at != std::string_view::npos && !uri.starts_with("git@")) {
+        dep.version = uri.substr(at + 1);
+        uri = uri.substr(0, at);
+    }
+
+    std::string_view path;
+    if (uri.starts_with("gh:")) {
+        path = uri.substr(3);
+        dep.git_repository = fmt::format("https://github.com/{}.git", path);
+    } else if (uri.starts_with("gl:")) {
+        path = uri.substr(3);
+        dep.git_repository = fmt::format("https://gitlab.com/{}.git", path);
+    } else if (uri.ends_with(".git")) {
+        path = uri.substr(0, uri.size() - 4);
+        dep.git_repository = uri;
+    } else {
+        path = uri;
+        dep.url = uri;
+    }
+
+    auto slash = path.find_last_of('/');
+    dep.name = path.substr(slash == std::string_view::npos ? 0 : slash + 1);
+    if (dep.git_tag.empty() && !dep.version.empty() && !dep.git_repository.empty()) {
+        dep.git_tag = "v" + dep.version;
+    }
+}
+
+struct FileResult {
+    std::vector<CandidateDependency> dependencies;
+    std::vector<fs::path> children;
+    std::optional<ProjectInfo> project;
+};
+
+// Resolves include(<file|module>) against the directory being processed
+std::optional<fs::path> resolve_include(std::string_view arg, const fs::path& dir,
+                                        const std::vector<fs::path>& module_path) {
+    std::string file(arg);
+    for (std::string_view var : {"${CMAKE_CURRENT_SOURCE_DIR}", "${CMAKE_CURRENT_LIST_DIR}",
+                                 "${PROJECT_SOURCE_DIR}", "${CMAKE_SOURCE_DIR}"}) {
+        if (file.starts_with(var)) {
+            file = dir.string() + file.substr(var.size());
+        }
+    }
+    if (file.find("${") != std::string::npos) {
+        return std::nullopt;
+    }
+
+    if (file.ends_with(".cmake")) {
+        fs::path p = fs::path(file).is_absolute() ? fs::path(file) : dir / file;
+        return fs::is_regular_file(p) ? std::optional(p) : std::nullopt;
+    }
+
+    // Module name: search CMAKE_MODULE_PATH entries seen so far, then ./cmake
+    for (const auto& base : module_path) {
+        if (auto p = base / (file + ".cmake"); fs::is_regular_file(p)) {
+            return p;
+        }
     }
+    if (auto p = dir / "cmake" / (file + ".cmake"); fs::is_regular_file(p)) {
+        return p;
+    }
+    return std::nullopt;
+}
+
+FileResult scan_file(const fs::path& file, const fs::path& dir) {
+    FileResult result;
+    fsutil::MappedFile source(file);
+    std::vector<fs::path> module_path;
+
+    tokenize(source.text(), [&](const Command& cmd) {
+        const auto& args = cmd.arguments;
+        auto candidate = [&](std::string_view kind) {
+            CandidateDependency dep;
+            dep.kind = kind;
+            dep.file = file;
+            dep.line = cmd.line;
+            return dep;
+        };
+
+        if (iequals(cmd.name, "project") && !args.empty() && !result.project) {
+            result.project = project_info(args);
+        } else if (iequals(cmd.name, "FetchContent_Declare") && !args.empty()) {
+            auto dep = candidate("FetchContent_Declare");
+            dep.name = args[0].text;
+            dep.git_repository = keyword_value(args, "GIT_REPOSITORY").value_or("");
+            dep.git_tag = keyword_value(args, "GIT_TAG").value_or("");
+            dep.url = keyword_value(args, "URL").value_or("");
+            dep.url_hash = keyword_value(args, "URL_HASH").value_or("");
+            result.dependencies.push_back(std::move(dep));
+        } else if (iequals(cmd.name, "CPMAddPackage") && !args.empty()) {
+            auto dep = candidate("CPMAddPackage");
+            if (auto uri = keyword_value(args, "URI", 0)) {
+                parse_cpm_shorthand(*uri, dep);
+            } else if (!keyword_value(args, "NAME", 0)) {
+                parse_cpm_shorthand(args[0].text, dep);
+            } else {
+                dep.name = keyword_value(args, "NAME", 0).value_or("");
+                dep.version = keyword_value(args, "VERSION", 0).value_or("");
+                dep.git_tag = keyword_value(args, "GIT_TAG", 0).value_or("");
+                dep.url = keyword_value(args, "URL", 0).value_or("");
+                dep.url_hash = keyword_value(args, "URL_HASH", 0).value_or("");
+                if (auto gh = keyword_value(args, "GITHUB_REPOSITORY", 0)) {
+                    dep.git_repository = fmt::format("https://github.com/{}.git", *gh);
+                } else if (auto gl = keyword_value(args, "GITLAB_REPOSITORY", 0)) {
+                    dep.git_repository = fmt::format("https://gitlab.com/{}.git", *gl);
+                } else {
+                    dep.git_repository = keyword_value(args, "GIT_REPOSITORY", 0).value_or("");
+                }
+                if (dep.git_tag.empty() && !dep.version.empty() && !dep.git_repository.empty()) {
+                    dep.git_tag = "v" + dep.version;
+                }
+            }
+            if (!dep.name.empty()) {
+                result.dependencies.push_back(std::move(dep));
+            }
+        } else if (iequals(cmd.name, "find_package") && !args.empty()) {
+            auto dep = candidate("find_package");
+            dep.name = args[0].text;
+            if (args.size() > 1 && !args[1].text.empty() &&
+                std::isdigit(static_cast<unsigned char>(args[1].text[0]))) {
+                dep.version = args[1].text;
+            }
+            result.dependencies.push_back(std::move(dep));
+        } else if (iequals(cmd.name, "add_subdirectory") && !args.empty()) {
+            auto sub = dir / args[0].text / "CMakeLists.txt";
+            if (args[0].text.find("${") == std::string_view::npos && fs::is_regular_file(sub)) {
+                result.children.push_back(sub);
+            }
+        } else if (iequals(cmd.name, "include") && !args.empty()) {
+            if (auto inc = resolve_include(args[0].text, dir, module_path)) {
+                result.children.push_back(*inc);
+            }
+        } else if ((iequals(cmd.name, "list") || iequals(cmd.name, "set")) && args.size() > 1) {
+            // Track CMAKE_MODULE_PATH so include(<Module>) can be resolved
+            size_t first = iequals(cmd.name, "list") ? 2 : 1;
+            if (args[first - 1].text == "CMAKE_MODULE_PATH") {
+                for (size_t i = first; i < args.size(); ++i) {
+                    std::string entry(args[i].text);
+                    for (std::string_view var :
+                         {"${CMAKE_CURRENT_SOURCE_DIR}", "${CMAKE_CURRENT_LIST_DIR}",
+                          "${PROJECT_SOURCE_DIR}", "${CMAKE_SOURCE_DIR}"}) {
+                        if (entry.starts_with(var)) {
+                            entry = dir.string() + entry.substr(var.size());
+                        }
+                    }
+                    if (entry.find("${") == std::string::npos) {
+                        fs::path path(entry);
+                        module_path.push_back(path.is_absolute() ? path : dir / path);
+                    }
+                }
+            }
+        }
+    });
+
+    return result;
+}
+
+} // namespace
+
+void tokenize(std::string_view source, const std::function<void(const Command&)>& visit) {
+    Lexer(source).run(visit);
+}
 
-    std::stringstream buffer;
-    buffer << file.rdbuf();
-    std::string content = buffer.str();
+ScanResult scan_tree(const fs::path& root, unsigned jobs) {
+    // Work queue of (file, directory it is evaluated in). include() keeps the
+    // including directory; add_subdirectory() switches to the new one.
+    struct Work {
+        fs::path file;
+        fs::path dir;
+    };
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Work> queue;
+    std::set<fs::path> seen;
+    std::map<fs::path, FileResult> results;
+    std::map<fs::path, std::string> errors;
+    size_t active = 0;
+
+    auto root_file = fs::weakly_canonical(root);
+    queue.push_back({root_file, root_file.parent_path()});
+    seen.insert(root_file);
+
+    auto worker = [&]() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            cv.wait(lock, [&] { return !queue.empty() || active == 0; });
+            if (queue.empty()) {
+                return;
+            }
+            Work work = std::move(queue.front());
+            queue.pop_front();
+            active++;
+            lock.unlock();
+
+            FileResult result;
+            std::string error;
+            try {
+                result = scan_file(work.file, work.dir);
+            } catch (const std::exception& e) {
+                error = fmt::format("{}: {}", work.file.string(), e.what());
+            }
+
+            lock.lock();
+            active--;
+            for (const auto& child : result.children) {
+                auto canonical = fs::weakly_canonical(child);
+                if (seen.insert(canonical).second) {
+                    bool is_subdir = canonical.filename() == "CMakeLists.txt";
+                    queue.push_back({canonical, is_subdir ? canonical.parent_path() : work.dir});
+                }
+            }
+            if (!error.empty()) {
+                errors[work.file] = std::move(error);
+            }
+            results[work.file] = std::move(result);
+            cv.notify_all();
+        }
+    };
+
+    {
+        unsigned workers = jobs != 0 ? jobs : std::max(1u, std::thread::hardware_concurrency());
+        std::vector<std::jthread> pool;
+        for (unsigned i = 0; i < workers; ++i) {
+            pool.emplace_back(worker);
+        }
+    }
+
+    // Unparseable includes are reported; an unparseable root is fatal
+    if (auto it = errors.find(root_file); it != errors.end()) {
+        throw std::runtime_error(it->second);
+    }
+
+    // Deterministic output regardless of which worker finished first
+    ScanResult scan;
+    scan.project = results[root_file].project;
+    for (auto& [file, error] : errors) {
+        scan.errors.push_back(std::move(error));
+    }
+    for (auto& [file, result] : results) {
+        scan.files.push_back(file);
+        for (auto& dep : result.dependencies) {
+            scan.dependencies.push_back(std::move(dep));
+        }
+    }
+    return scan;
+}
+
+ProjectInfo parse_cmake_lists(const fs::path& path) {
+    fsutil::MappedFile source(path);
 
     ProjectInfo info;
-    info.pname = extract_project_name(content).value_or("cmake-project");
-    info.version = extract_version(content).value_or("0.1.0");
+    try {
+        bool found = false;
+        tokenize(source.text(), [&](const Command& cmd) {
+            if (found || !iequals(cmd.name, "project") || cmd.arguments.empty()) {
+                return;
+            }
+            info = project_info(cmd.arguments);
+            found = true;
+        });
+    } catch (const std::runtime_error&) {
+        // Syntax we don't understand: fall back to a plain text search
+        std::string content(source.text());
+        info.pname = extract_project_name(content).value_or("");
+        info.version = extract_version(content).value_or("");
+    }
 
+    if (info.pname.empty()) {
+        info.pname = "cmake-project";
+    }
+    if (info.version.empty()) {
+        info.version = "0.1.0";
+    }
     return info;
 }
 
 std::optional<std::string> extract_project_name(const std::string& content) {
     // Match: project(name ...)
-    std::regex project_regex(R"(project\s*\(\s*(\w+))");
-    std::smatch match;
-
-    if (std::regex_search(content, match, project_regex)) {
-        return match[1].str();
+    if (auto name = matchers::project_name(content)) {
+        return std::string(*name);
     }
-
     return std::nullopt;
 }
 
 std::optional<std::string> extract_version(const std::string& content) {
     // Match: VERSION x.y.z in project() call
-    std::regex version_regex(R"(VERSION\s+([0-9]+\.[0-9]+(?:\.[0-9]+)?))");
-    std::smatch match;
-
-    if (std::regex_search(content, match, version_regex)) {
-        return match[1].str();
+    if (auto version = matchers::version(content)) {
+        return std::string(*version);
     }
-
     return std::nullopt;
 }
 
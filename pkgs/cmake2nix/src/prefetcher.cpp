@@ -1,145 +1,594 @@
 #include "cmake2nix.hpp"
 
-#include <array>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
 #include <fmt/core.h>
-#include <memory>
-#include <regex>
+#include <iterator>
+#include <list>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
 
 namespace cmake2nix::prefetcher {
 
 namespace {
-std::string exec_command(const std::string& cmd) {
-    std::array<char, 128> buffer;
-    std::string result;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd.c_str(), "r"), pclose);
+// Run a tool directly (no shell) and return its stdout; stderr is kept only for
+// error reporting and the hash-scraping fallback.
+subprocess::Result run_tool(const std::vector<std::string>& argv) {
+    auto result = subprocess::run(argv);
+    if (!result.ok()) {
+        throw std::runtime_error(result.describe(argv[0]));
+    }
+    return result;
+}
+
+struct Job {
+    std::string name;
+    std::string key; // Source identity, see source_key()
+    std::string method;
+    std::string host;
+    std::string owner;
+    std::string repo;
+    std::string url;
+    std::string rev;
+    std::string remote; // Where a symbolic rev is resolved, see resolver::remote_url()
+    std::string commit; // What it resolved to
+
+    std::string hash;
+    std::string error;
+    std::chrono::duration<double> elapsed{0};
+};
+
+std::string extract_hash(const subprocess::Result& result) {
+    // Look for sha256- prefixed hash
+    auto hash = matchers::find_sri_sha256(result.out);
+    if (hash.empty()) {
+        hash = matchers::find_sri_sha256(result.err);
+    }
+    return std::string(hash);
+}
 
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
+// The tools print nix32, hex or SRI depending on their version; lock files hold SRI
+std::string normalize_hash(std::string_view hash, std::string_view tool) {
+    auto digest = digest::parse_sha256(hash);
+    if (!digest) {
+        throw std::runtime_error(fmt::format("Unrecognised hash '{}' from {}", hash, tool));
     }
+    return digest::to_sri(*digest);
+}
 
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        result += buffer.data();
+// Hash from the JSON the nix-prefetch-git/-github tools print: newer versions
+// add an SRI "hash", older ones only have a nix32 "sha256"
+std::string hash_from_json(const subprocess::Result& result, std::string_view tool) {
+    try {
+        json j = json::parse(result.out);
+        for (const char* field : {"hash", "sha256"}) {
+            if (j.contains(field) && j[field].is_string()) {
+                return normalize_hash(j[field].get_ref<const std::string&>(), tool);
+            }
+        }
+    } catch (const json::exception&) {
+        // Fall back to hash extraction from output
     }
 
-    return result;
+    std::string hash = extract_hash(result);
+    if (hash.empty()) {
+        throw std::runtime_error(fmt::format("Failed to extract hash from {} output", tool));
+    }
+    return hash;
 }
 
-std::string extract_hash(const std::string& output) {
-    // Look for sha256- prefixed hash
-    std::regex hash_regex(R"(sha256-[A-Za-z0-9+/=]+)");
-    std::smatch match;
+std::string run_prefetch_github(const std::string& owner, const std::string& repo,
+                                const std::string& rev) {
+    auto result = run_tool({"nix-prefetch-github", owner, repo, "--rev", rev});
+    return hash_from_json(result, "nix-prefetch-github");
+}
+
+std::string run_prefetch_git(const std::string& url, const std::string& rev) {
+    auto result = run_tool({"nix-prefetch-git", "--url", url, "--rev", rev});
+    return hash_from_json(result, "nix-prefetch-git");
+}
+
+// nix-prefetch-url prints the hash (nix32) as the last line of stdout; progress goes
+// to stderr
+std::string hash_from_last_line(const subprocess::Result& result) {
+    std::string_view out = result.out;
+    while (!out.empty() && (out.back() == '\n' || out.back() == ' ')) {
+        out.remove_suffix(1);
+    }
+    if (auto nl = out.rfind('\n'); nl != std::string_view::npos) {
+        out.remove_prefix(nl + 1);
+    }
+    if (out.empty()) {
+        throw std::runtime_error("Failed to extract hash from nix-prefetch-url output");
+    }
+    return normalize_hash(out, "nix-prefetch-url");
+}
+
+std::string run_prefetch_url(const std::string& url) {
+    return hash_from_last_line(run_tool({"nix-prefetch-url", url}));
+}
+
+// In-process equivalents of the fetchers: fetch the source and hash it the way the
+// fixed-output derivation will.
 
-    if (std::regex_search(output, match, hash_regex)) {
-        return match[0].str();
+// Where GitHub archives come from; overridable for mirrors and offline tests
+std::string github_archive_url(const std::string& owner, const std::string& repo,
+                               const std::string& rev) {
+    std::string base = "https://codeload.github.com";
+    if (const char* url = std::getenv("CMAKE2NIX_GITHUB_URL"); url && *url) {
+        base = url;
     }
+    return fmt::format("{}/{}/{}/tar.gz/{}", base, owner, repo, rev);
+}
+
+// curl exit codes worth another attempt: resolve/connect failures, timeouts and
+// connections dropped mid-transfer
+bool transient_curl_error(int exit_code) {
+    static constexpr std::array<int, 8> codes = {5, 6, 7, 18, 28, 35, 52, 56};
+    return std::find(codes.begin(), codes.end(), exit_code) != codes.end();
+}
 
-    return "";
+// Stream a download through a hasher (update()/finish()) without touching disk.
+// curl's own --retry would replay bytes already delivered, so each attempt starts
+// over with a fresh hasher instead.
+template <typename Hasher>
+std::string download_hash(const std::string& url) {
+    constexpr int attempts = 3;
+    for (int attempt = 1;; ++attempt) {
+        Hasher hasher;
+        subprocess::Options options;
+        options.capture_stdout = false;
+        options.on_stdout_data = [&](std::string_view data) { hasher.update(data); };
+        auto result = subprocess::run({"curl", "-fsSL", url}, std::move(options));
+        if (result.ok()) {
+            return digest::to_sri(hasher.finish());
+        }
+        if (attempt == attempts || !transient_curl_error(result.exit_code)) {
+            throw std::runtime_error(result.describe("curl"));
+        }
+    }
+}
+
+// fetchFromGitHub: the codeload tarball, decompressed, untarred and NAR-hashed in a
+// single pass with the root directory stripped
+std::string hash_github(const std::string& owner, const std::string& repo,
+                        const std::string& rev) {
+    return download_hash<archive::TarballHasher>(github_archive_url(owner, repo, rev));
+}
+
+// Best effort: with the source registered under the fetcher's output path, a later
+// build of the fixed-output derivation is satisfied without fetching again
+void add_to_store(const fs::path& source) {
+    subprocess::run({"nix-store", "--add-fixed", "--recursive", "sha256", source.string()});
+}
+
+// fetchgit: a checkout of the rev with submodules, without any .git. Checkouts come
+// from the persistent mirror, or from a throwaway one when there is no cache.
+std::string hash_git(const std::string& url, const std::string& rev, const Options& options) {
+    fsutil::TempDir tmp("cmake2nix-git-");
+    auto mirror_dir = options.mirror_dir.empty() ? tmp.path() / "mirror" : options.mirror_dir;
+    mirror::Repository repo(mirror_dir, url);
+    // The fetchers' default store name
+    auto checkout = repo.checkout(repo.fetch(rev), tmp.path() / "source");
+    const auto& source = checkout.path();
+
+    auto is_git = [](std::string_view name) { return name == ".git"; };
+    if (!options.add_to_store) {
+        return digest::to_sri(nar::hash_path(source, is_git));
+    }
+    std::vector<fs::path> links;
+    for (auto it = fs::recursive_directory_iterator(source);
+         it != fs::recursive_directory_iterator(); ++it) {
+        if (is_git(it->path().filename().string())) {
+            links.push_back(it->path());
+            it.disable_recursion_pending();
+        }
+    }
+    for (const auto& link : links) {
+        fs::remove_all(link);
+    }
+    auto hash = digest::to_sri(nar::hash_path(source));
+    add_to_store(source);
+    return hash;
+}
+
+// fetchurl: the flat hash of the file
+std::string hash_url(const std::string& url) {
+    return download_hash<digest::Sha256>(url);
+}
+
+std::string run_prefetch_zip(const std::string& url) {
+    return hash_from_last_line(run_tool({"nix-prefetch-url", "--unpack", url}));
+}
+
+// fetchzip unpacks anything nix can (zip, tar with any compression); only gzip'd tar
+// is streamed in-process. Whether a URL names one of the others, by its file name.
+bool is_other_archive(std::string_view url) {
+    url = url.substr(0, url.find_first_of("?#"));
+    std::string name(url.substr(url.rfind('/') + 1));
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](char c) { return char(std::tolower(uint8_t(c))); });
+    if (name.ends_with(".tar.gz") || name.ends_with(".tgz")) {
+        return false;
+    }
+    for (std::string_view ext : {".zip", ".tar", ".xz", ".txz", ".bz2", ".tbz", ".tbz2",
+                                 ".zst", ".tzst", ".lz", ".lzma", ".7z", ".jar"}) {
+        if (name.ends_with(ext)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct NotGzip : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// TarballHasher that gives up at once on a stream without the gzip magic, for URLs
+// whose name doesn't tell the format (e.g. codeload's .../tar.gz/<rev>)
+class GzipTarballHasher {
+  public:
+    void update(std::string_view data) {
+        static constexpr unsigned char magic[] = {0x1f, 0x8b};
+        for (size_t i = 0; checked_ < std::size(magic) && i < data.size(); ++i, ++checked_) {
+            if (uint8_t(data[i]) != magic[checked_]) {
+                throw NotGzip("not a gzip stream");
+            }
+        }
+        hasher_.update(data);
+    }
+    digest::Sha256::Digest finish() {
+        return hasher_.finish();
+    }
+
+  private:
+    archive::TarballHasher hasher_;
+    size_t checked_ = 0;
+};
+
+// fetchzip: like a GitHub archive, the unpacked tree with its root stripped. Other
+// formats go through nix-prefetch-url --unpack.
+std::string hash_zip(const std::string& url) {
+    if (is_other_archive(url)) {
+        return run_prefetch_zip(url);
+    }
+    try {
+        return download_hash<GzipTarballHasher>(url);
+    } catch (const NotGzip&) {
+        return run_prefetch_zip(url);
+    }
+}
+
+// Serve a prefetch from the persistent cache, or run it and remember the result.
+// "HEAD" can move between runs, so it is never cached.
+template <typename Fetch>
+std::string with_cache(cache::PrefetchCache* cache, std::string_view method,
+                       std::string_view source, std::string_view rev, Fetch&& fetch) {
+    if (cache == nullptr || rev == "HEAD") {
+        trace::annotate("cache", cache == nullptr ? "off" : "head");
+        return fetch();
+    }
+
+    auto key = cache::PrefetchCache::key(method, source, rev);
+    // Older versions could store nix32 digests behind an SRI prefix; refetch those
+    if (auto hit = cache->lookup(key); hit && hit->starts_with("sha256-") &&
+                                       digest::parse_sha256(*hit)) {
+        trace::annotate("cache", "hit");
+        return *hit;
+    }
+    trace::annotate("cache", "miss");
+
+    std::string hash = fetch();
+    cache->store(key, hash);
+    return hash;
 }
 } // namespace
 
-void prefetch_all(LockFile& lock, bool verbose) {
-    fmt::print("cmake2nix: Prefetching {} dependencies...\n", lock.dependencies.size());
+std::string host_of(const Dependency& dep) {
+    if (dep.method == "fetchFromGitHub") {
+        return "github.com";
+    }
 
-    int prefetched = 0;
-    for (auto& [name, dep] : lock.dependencies) {
-        // Skip if already has a non-placeholder hash
-        if (dep.args.contains("hash")) {
-            std::string hash = dep.args["hash"];
-            if (hash != "sha256-AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=") {
-                if (verbose) {
-                    fmt::print("  {} already has hash, skipping\n", name);
+    // Strip scheme, userinfo and port: https://user@host:port/path -> host
+    std::string url = dep.args.value("url", "");
+    auto scheme = url.find("://");
+    auto begin = scheme == std::string::npos ? 0 : scheme + 3;
+    auto end = url.find_first_of("/?#", begin);
+    std::string authority = url.substr(begin, end == std::string::npos ? end : end - begin);
+    if (auto at = authority.rfind('@'); at != std::string::npos) {
+        authority.erase(0, at + 1);
+    }
+    if (auto colon = authority.find(':'); colon != std::string::npos) {
+        authority.erase(colon);
+    }
+    return authority;
+}
+
+std::string source_key(const Dependency& dep) {
+    if (dep.method == "fetchFromGitHub") {
+        return cache::PrefetchCache::key(
+            dep.method, dep.args.value("owner", "") + "/" + dep.args.value("repo", ""),
+            dep.args.value("rev", ""));
+    }
+    bool is_download = dep.method == "fetchurl" || dep.method == "fetchzip";
+    return cache::PrefetchCache::key(dep.method, dep.args.value("url", ""),
+                                     is_download ? "" : dep.args.value("rev", "HEAD"));
+}
+
+// Jobs are handed out in submission order, skipping jobs whose host is already
+// running `host_jobs` prefetches so one slow forge can't starve the pool.
+struct Pipeline::State {
+    Options options;
+    unsigned max_workers = 1;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Job> jobs; // Stable addresses while workers hold a Job*
+    std::list<size_t> pending;
+    std::map<std::string, unsigned> active;
+    std::set<std::string> submitted;
+    bool closed = false;
+
+    std::mutex output_mutex;
+    std::vector<std::jthread> pool;
+
+    Job* acquire() {
+        std::unique_lock lock(mutex);
+        while (true) {
+            for (auto it = pending.begin(); it != pending.end(); ++it) {
+                Job& job = jobs[*it];
+                auto& running = active[job.host];
+                if (running < std::max(options.host_jobs, 1u)) {
+                    running++;
+                    pending.erase(it);
+                    return &job;
                 }
-                continue;
             }
+            if (closed && pending.empty()) {
+                return nullptr;
+            }
+            cv.wait(lock);
         }
+    }
 
-        try {
-            std::string hash;
-
-            if (dep.method == "fetchFromGitHub") {
-                std::string owner = dep.args["owner"];
-                std::string repo = dep.args["repo"];
-                std::string rev = dep.args["rev"];
-                hash = prefetch_github(owner, repo, rev);
-                dep.args["hash"] = hash;
-            } else if (dep.method == "fetchgit") {
-                std::string url = dep.args["url"];
-                std::string rev = dep.args.value("rev", "HEAD");
-                hash = prefetch_git(url, rev);
-                dep.args["sha256"] = hash;
-            } else if (dep.method == "fetchurl") {
-                std::string url = dep.args["url"];
-                hash = prefetch_url(url);
-                dep.args["sha256"] = hash;
+    void release(const std::string& host) {
+        {
+            std::lock_guard lock(mutex);
+            active[host]--;
+        }
+        cv.notify_all();
+    }
+
+    // Fetch by commit, so the cache entry is shared by every ref naming it
+    void resolve(Job& job) {
+        if (options.resolver == nullptr || job.remote.empty() ||
+            resolver::is_commit_id(job.rev)) {
+            return;
+        }
+        if (auto commit = options.resolver->resolve(job.remote, job.rev)) {
+            job.commit = job.rev = *commit;
+            job.key = cache::PrefetchCache::key(
+                job.method, job.method == "fetchFromGitHub" ? job.owner + "/" + job.repo : job.url,
+                job.rev);
+        }
+    }
+
+    void work() {
+        using clock = std::chrono::steady_clock;
+        while (Job* job = acquire()) {
+            auto start = clock::now();
+            trace::Span span(job->name, "prefetch");
+            span.arg("method", job->method);
+            span.arg("host", job->host);
+            try {
+                resolve(*job);
+                if (job->method == "fetchFromGitHub") {
+                    job->hash = prefetch_github(job->owner, job->repo, job->rev, options);
+                } else if (job->method == "fetchgit") {
+                    job->hash = prefetch_git(job->url, job->rev, options);
+                } else if (job->method == "fetchurl") {
+                    job->hash = prefetch_url(job->url, options);
+                } else if (job->method == "fetchzip") {
+                    job->hash = prefetch_zip(job->url, options);
+                }
+            } catch (const std::exception& e) {
+                job->error = e.what();
             }
+            job->elapsed = clock::now() - start;
+            span.arg("rev", job->rev);
+            span.arg("result", job->error.empty() ? "ok" : "failed");
+            release(job->host);
 
-            if (!hash.empty()) {
-                fmt::print("  ✓ {} ({})\n", name, hash.substr(0, 16) + "...");
-                prefetched++;
+            std::lock_guard lock(output_mutex);
+            if (!job->error.empty()) {
+                fmt::print(stderr, "  ✗ {} failed: {}\n", job->name, job->error);
+            } else if (!job->hash.empty()) {
+                fmt::print("  ✓ {} ({})\n", job->name, job->hash.substr(0, 16) + "...");
             }
-        } catch (const std::exception& e) {
-            fmt::print(stderr, "  ✗ {} failed: {}\n", name, e.what());
         }
     }
+};
 
-    fmt::print("cmake2nix: Prefetched {}/{} dependencies\n", prefetched, lock.dependencies.size());
+Pipeline::Pipeline(const Options& options) : state_(std::make_unique<State>()) {
+    state_->options = options;
+    state_->max_workers =
+        std::max(options.jobs != 0 ? options.jobs : std::thread::hardware_concurrency(), 1u);
 }
 
-std::string prefetch_github(const std::string& owner, const std::string& repo,
-                            const std::string& rev) {
-    std::string cmd = fmt::format("nix-prefetch-github {} {} --rev {} 2>&1", owner, repo, rev);
-    std::string output = exec_command(cmd);
+Pipeline::~Pipeline() {
+    finish();
+}
 
-    // nix-prefetch-github outputs JSON
-    try {
-        json j = json::parse(output);
-        if (j.contains("hash")) {
-            return j["hash"];
+void Pipeline::submit(const Dependency& dep) {
+    // Snapshot the work so workers never touch the caller's json values
+    Job job;
+    job.name = dep.name;
+    job.key = source_key(dep);
+    job.method = dep.method;
+    job.host = host_of(dep);
+    job.remote = resolver::remote_url(dep);
+    if (dep.method == "fetchFromGitHub") {
+        job.owner = dep.args.value("owner", "");
+        job.repo = dep.args.value("repo", "");
+        job.rev = dep.args.value("rev", "");
+    } else {
+        job.url = dep.args.value("url", "");
+        job.rev = dep.args.value("rev", "HEAD");
+    }
+
+    auto& state = *state_;
+    {
+        std::lock_guard lock(state.mutex);
+        if (state.closed || !state.submitted.insert(job.key).second) {
+            return;
+        }
+        state.jobs.push_back(std::move(job));
+        state.pending.push_back(state.jobs.size() - 1);
+
+        // Grow the pool lazily, never beyond the amount of work seen so far
+        if (state.pool.size() < state.max_workers && state.pool.size() < state.jobs.size()) {
+            state.pool.emplace_back([&state] { state.work(); });
         }
-    } catch (...) {
-        // Fall back to hash extraction from output
     }
+    state.cv.notify_one();
+}
 
-    std::string hash = extract_hash(output);
-    if (hash.empty()) {
-        throw std::runtime_error("Failed to extract hash from nix-prefetch-github output");
+std::vector<Pipeline::Result> Pipeline::finish() {
+    auto& state = *state_;
+    {
+        std::lock_guard lock(state.mutex);
+        state.closed = true;
     }
+    state.cv.notify_all();
+    state.pool.clear(); // Joins
 
-    return hash;
+    std::vector<Result> results;
+    results.reserve(state.jobs.size());
+    for (auto& job : state.jobs) {
+        results.push_back({std::move(job.name), std::move(job.key), std::move(job.commit),
+                           std::move(job.hash), std::move(job.error), job.elapsed});
+    }
+    state.jobs.clear();
+    state.pending.clear();
+    return results;
 }
 
-std::string prefetch_git(const std::string& url, const std::string& rev) {
-    std::string cmd = fmt::format("nix-prefetch-git --url {} --rev {} 2>&1", url, rev);
-    std::string output = exec_command(cmd);
+unsigned Pipeline::workers() const {
+    std::lock_guard lock(state_->mutex);
+    return unsigned(state_->pool.size());
+}
 
-    // nix-prefetch-git outputs JSON
-    try {
-        json j = json::parse(output);
-        if (j.contains("sha256")) {
-            return "sha256-" + std::string(j["sha256"]);
+std::chrono::duration<double> Pipeline::elapsed() const {
+    return std::chrono::steady_clock::now() - state_->start;
+}
+
+size_t prefetch_all(LockFile& lock, const Options& options) {
+    trace::Span span("prefetch");
+    std::vector<Dependency*> targets;
+    for (auto& [name, dep] : lock.dependencies) {
+        if (options.changes != nullptr && !options.changes->is_dirty(name)) {
+            continue;
         }
-    } catch (...) {
-        // Fall back to hash extraction
+        // Skip if already pinned, whichever field holds the hash
+        if (lockfile::is_pinned(dep)) {
+            if (options.verbose) {
+                fmt::print("  {} already has hash, skipping\n", name);
+            }
+            continue;
+        }
+        targets.push_back(&dep);
     }
 
-    std::string hash = extract_hash(output);
-    if (hash.empty()) {
-        throw std::runtime_error("Failed to extract hash from nix-prefetch-git output");
+    // Pin tags and branches first: the lock records commits, and every cache below
+    // is keyed by them
+    std::vector<std::string> revs;
+    for (auto* dep : targets) {
+        revs.push_back(dep->args.value("rev", ""));
     }
+    resolver::Resolver own_resolver(options.jobs, options.verbose);
+    (options.resolver != nullptr ? *options.resolver : own_resolver).resolve_all(targets);
 
-    return hash;
-}
+    fmt::print("cmake2nix: Prefetching {} of {} dependencies...\n", targets.size(),
+               lock.dependencies.size());
 
-std::string prefetch_url(const std::string& url) {
-    std::string cmd = fmt::format("nix-prefetch-url {} 2>&1", url);
-    std::string output = exec_command(cmd);
+    Pipeline pipeline(options);
+    for (auto* dep : targets) {
+        pipeline.submit(*dep);
+    }
+    unsigned workers = pipeline.workers();
+    auto results = pipeline.finish();
+    auto wall_time = pipeline.elapsed();
 
-    std::string hash = extract_hash(output);
-    if (hash.empty()) {
-        throw std::runtime_error("Failed to extract hash from nix-prefetch-url output");
+    // Entries sharing a source were fetched once; apply in lock order so the result
+    // doesn't depend on completion order
+    std::map<std::string, std::string> hashes;
+    std::chrono::duration<double> child_time{0};
+    for (auto& result : results) {
+        child_time += result.elapsed;
+        if (!result.hash.empty()) {
+            hashes.emplace(std::move(result.key), std::move(result.hash));
+        }
+    }
+    size_t prefetched = 0;
+    size_t updated = 0;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        auto* dep = targets[i];
+        bool hashed = false;
+        if (auto it = hashes.find(source_key(*dep)); it != hashes.end()) {
+            dep->args[std::string(lockfile::hash_field(*dep))] = it->second;
+            prefetched++;
+            hashed = true;
+        }
+        if (hashed || dep->args.value("rev", "") != revs[i]) {
+            updated++;
+        }
     }
 
-    return hash;
+    fmt::print("cmake2nix: Prefetched {}/{} dependencies\n", prefetched, targets.size());
+    if (!targets.empty()) {
+        fmt::print("cmake2nix: {:.2f}s wall, {:.2f}s summed child time ({:.1f}x, {} workers)\n",
+                   wall_time.count(), child_time.count(),
+                   child_time.count() / std::max(wall_time.count(), 1e-9), workers);
+    }
+    if (options.verbose && options.cache != nullptr) {
+        fmt::print("cmake2nix: Prefetch cache: {} hits, {} misses\n", options.cache->hits(),
+                   options.cache->misses());
+    }
+    return updated;
+}
+
+std::string prefetch_github(const std::string& owner, const std::string& repo,
+                            const std::string& rev, const Options& options) {
+    return with_cache(options.cache, "fetchFromGitHub", owner + "/" + repo, rev, [&] {
+        return options.external ? run_prefetch_github(owner, repo, rev)
+                                : hash_github(owner, repo, rev);
+    });
+}
+
+std::string prefetch_git(const std::string& url, const std::string& rev,
+                         const Options& options) {
+    return with_cache(options.cache, "fetchgit", url, rev, [&] {
+        return options.external ? run_prefetch_git(url, rev) : hash_git(url, rev, options);
+    });
+}
+
+std::string prefetch_url(const std::string& url, const Options& options) {
+    return with_cache(options.cache, "fetchurl", url, "", [&] {
+        return options.external ? run_prefetch_url(url) : hash_url(url);
+    });
+}
+
+std::string prefetch_zip(const std::string& url, const Options& options) {
+    return with_cache(options.cache, "fetchzip", url, "", [&] {
+        return options.external ? run_prefetch_zip(url) : hash_zip(url);
+    });
 }
 
 } // namespace cmake2nix::prefetcher
@@ -0,0 +1,243 @@
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <fmt/core.h>
+#include <thread>
+
+namespace cmake2nix::resolver {
+
+namespace {
+bool is_hex(std::string_view text) {
+    return std::all_of(text.begin(), text.end(),
+                       [](char c) { return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'); });
+}
+
+// GIT_TAG may name an abbreviated commit, which no remote advertises; those are
+// left for the mirror to expand when the source is fetched
+bool is_abbreviated_commit(std::string_view rev) {
+    return rev.size() >= 7 && rev.size() < 40 && is_hex(rev);
+}
+
+// Names a requested ref may be advertised under, best first: a peeled annotated tag
+// before the tag object, tags before branches (as git itself prefers)
+std::vector<std::string> candidates(const std::string& ref) {
+    if (ref == "HEAD" || ref.starts_with("refs/")) {
+        return {ref + "^{}", ref};
+    }
+    return {"refs/tags/" + ref + "^{}", "refs/tags/" + ref, "refs/heads/" + ref, ref};
+}
+
+// "<oid>\t<refname>" per line
+std::map<std::string_view, std::string_view> parse_advertisement(std::string_view out) {
+    std::map<std::string_view, std::string_view> refs;
+    while (!out.empty()) {
+        auto nl = out.find('\n');
+        auto line = out.substr(0, nl);
+        out.remove_prefix(nl == std::string_view::npos ? out.size() : nl + 1);
+
+        auto tab = line.find('\t');
+        if (tab != std::string_view::npos && is_commit_id(line.substr(0, tab))) {
+            refs.emplace(line.substr(tab + 1), line.substr(0, tab));
+        }
+    }
+    return refs;
+}
+} // namespace
+
+bool is_commit_id(std::string_view rev) {
+    return (rev.size() == 40 || rev.size() == 64) && is_hex(rev);
+}
+
+std::string remote_url(const Dependency& dep) {
+    if (dep.method == "fetchFromGitHub") {
+        return fmt::format("https://github.com/{}/{}.git", dep.args.value("owner", ""),
+                           dep.args.value("repo", ""));
+    }
+    if (dep.method == "fetchgit") {
+        return dep.args.value("url", "");
+    }
+    return {};
+}
+
+void pin(Dependency& dep, const std::string& commit) {
+    auto rev = dep.args.value("rev", "HEAD");
+    if (!is_commit_id(rev)) {
+        dep.metadata["ref"] = rev;
+    }
+    dep.args["rev"] = commit;
+}
+
+bool apply_locked(Dependency& dep, const LockFile& lock) {
+    auto rev = dep.args.value("rev", "HEAD");
+    if (remote_url(dep).empty() || is_commit_id(rev)) {
+        return false;
+    }
+    auto it = lock.dependencies.find(dep.name);
+    if (it == lock.dependencies.end() || !it->second.metadata.is_object() ||
+        it->second.metadata.value("ref", "") != rev) {
+        return false;
+    }
+    const auto& locked = it->second;
+    auto commit = locked.args.value("rev", "");
+    if (!is_commit_id(commit)) {
+        return false;
+    }
+
+    // Only if nothing but the ref differs; a changed URL must be resolved again
+    Dependency pinned = dep;
+    pin(pinned, commit);
+    if (!lockfile::same_source(pinned, locked)) {
+        return false;
+    }
+    dep = std::move(pinned);
+    return true;
+}
+
+Resolver::Resolver(unsigned jobs, bool verbose) : jobs_(jobs), verbose_(verbose) {}
+
+std::optional<std::string> Resolver::lookup(const std::string& key, const std::string& ref) {
+    std::lock_guard lock(mutex_);
+    auto repo = known_.find(key);
+    if (repo == known_.end()) {
+        return std::nullopt;
+    }
+    auto it = repo->second.find(ref);
+    return it == repo->second.end() ? std::nullopt : std::optional(it->second);
+}
+
+bool Resolver::query(const std::string& url, const std::vector<std::string>& refs) {
+    // ls-remote patterns match ref name suffixes, so "v1.0" asks for its tag and
+    // branch forms (over protocol v2 only those refs are advertised at all); the
+    // peeled "^{}" line of an annotated tag is only listed if asked for as well
+    std::vector<std::string> argv = {"git", "ls-remote", url};
+    for (const auto& ref : refs) {
+        argv.push_back(ref);
+        argv.push_back(ref + "^{}");
+    }
+    remote_calls_++;
+    auto result = subprocess::run(argv);
+
+    auto key = mirror::normalize_url(url);
+    std::lock_guard lock(mutex_);
+    auto& known = known_[key];
+    if (!result.ok()) {
+        unreachable_.insert(key);
+        for (const auto& ref : refs) {
+            known.emplace(ref, "");
+        }
+        fmt::print(stderr, "Warning: Could not list refs of {}: {}\n", url,
+                   result.describe("git ls-remote"));
+        return false;
+    }
+
+    auto advertised = parse_advertisement(result.out);
+    for (const auto& ref : refs) {
+        std::string commit;
+        for (const auto& name : candidates(ref)) {
+            if (auto it = advertised.find(name); it != advertised.end()) {
+                commit = it->second;
+                break;
+            }
+        }
+        known[ref] = std::move(commit);
+    }
+    return true;
+}
+
+std::optional<std::string> Resolver::resolve(const std::string& url, const std::string& ref) {
+    if (is_commit_id(ref)) {
+        return ref;
+    }
+    if (is_abbreviated_commit(ref)) {
+        return std::nullopt;
+    }
+    auto key = mirror::normalize_url(url);
+    auto commit = lookup(key, ref);
+    if (!commit) {
+        query(url, {ref});
+        commit = lookup(key, ref);
+    }
+    if (!commit || commit->empty()) {
+        return std::nullopt;
+    }
+    return commit;
+}
+
+size_t Resolver::resolve_all(const std::vector<Dependency*>& deps) {
+    trace::Span span("resolve");
+    auto start = std::chrono::steady_clock::now();
+
+    // Every ref not known yet, grouped by repository: one remote call each
+    struct Repository {
+        std::string url;
+        std::vector<std::string> refs;
+    };
+    std::map<std::string, Repository> repositories;
+    std::vector<std::pair<Dependency*, std::string>> targets; // With normalized URL
+    for (auto* dep : deps) {
+        auto url = remote_url(*dep);
+        auto rev = dep->args.value("rev", "HEAD");
+        if (url.empty() || is_commit_id(rev) || is_abbreviated_commit(rev)) {
+            continue;
+        }
+        auto key = mirror::normalize_url(url);
+        targets.emplace_back(dep, key);
+        if (lookup(key, rev)) {
+            continue;
+        }
+        auto& repository = repositories[key];
+        repository.url = url;
+        if (std::find(repository.refs.begin(), repository.refs.end(), rev) ==
+            repository.refs.end()) {
+            repository.refs.push_back(std::move(rev));
+        }
+    }
+    if (targets.empty()) {
+        return 0;
+    }
+
+    std::vector<const Repository*> pending;
+    for (const auto& [key, repository] : repositories) {
+        pending.push_back(&repository);
+    }
+    std::atomic<size_t> next = 0;
+    if (!pending.empty()) {
+        unsigned workers = jobs_ != 0 ? jobs_ : std::thread::hardware_concurrency();
+        std::vector<std::jthread> pool;
+        size_t count = std::clamp<size_t>(workers, 1, pending.size());
+        for (size_t i = 0; i < count; ++i) {
+            pool.emplace_back([&] {
+                for (size_t j; (j = next++) < pending.size();) {
+                    query(pending[j]->url, pending[j]->refs);
+                }
+            });
+        }
+    }
+
+    // Applied in input order so the output doesn't depend on completion order
+    size_t resolved = 0;
+    for (auto& [dep, key] : targets) {
+        auto rev = dep->args.value("rev", "HEAD");
+        auto commit = lookup(key, rev).value_or("");
+        if (commit.empty()) {
+            std::lock_guard lock(mutex_);
+            if (!unreachable_.contains(key)) {
+                fmt::print(stderr, "Warning: {}: '{}' not found in {}; keeping it unresolved\n",
+                           dep->name, rev, remote_url(*dep));
+            }
+            continue;
+        }
+        if (verbose_) {
+            fmt::print("  {}: {} -> {}\n", dep->name, rev, commit.substr(0, 12));
+        }
+        pin(*dep, commit);
+        resolved++;
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    fmt::print("cmake2nix: Resolved {} of {} refs with {} ls-remote calls ({:.2f}s)\n", resolved,
+               targets.size(), repositories.size(), elapsed.count());
+    return resolved;
+}
+
+} // namespace cmake2nix::resolver
@@ -0,0 +1,419 @@
+#include "cmake2nix.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <mutex>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+namespace cmake2nix::subprocess {
+
+namespace {
+constexpr size_t read_chunk = 64 * 1024;
+constexpr auto kill_grace = std::chrono::seconds(2);
+// How often to check whether a child with open pipes has exited. A helper it left
+// behind may hold the pipes long after the child itself is gone.
+constexpr auto exit_check_interval = std::chrono::milliseconds(100);
+// How often to check on a child that closed its pipes but has not exited yet, or
+// that exited while its process group still holds the pipes
+constexpr auto reap_interval = std::chrono::milliseconds(10);
+
+// Children run in their own process groups, out of reach of the terminal's Ctrl-C.
+// SIGINT and SIGTERM wake every running loop through this pipe (never drained) so it
+// can stop its children; without a loop the signal does what it always did.
+int interrupt_pipe[2] = {-1, -1};
+std::atomic<int> active_loops = 0;
+volatile std::sig_atomic_t interrupt_signal = 0;
+
+void on_interrupt(int sig) {
+    if (active_loops.load() == 0) {
+        std::signal(sig, SIG_DFL);
+        std::raise(sig);
+        return;
+    }
+    interrupt_signal = sig;
+    int saved = errno;
+    [[maybe_unused]] auto n = ::write(interrupt_pipe[1], "", 1);
+    errno = saved;
+}
+
+void install_interrupt_handler() {
+    static std::once_flag once;
+    std::call_once(once, [] {
+        if (::pipe2(interrupt_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+            throw std::runtime_error(std::string("pipe() failed: ") + std::strerror(errno));
+        }
+        struct sigaction action {};
+        action.sa_handler = on_interrupt;
+        sigemptyset(&action.sa_mask);
+        for (int sig : {SIGINT, SIGTERM}) {
+            ::sigaction(sig, &action, nullptr);
+        }
+    });
+}
+
+// Splits a byte stream into lines for the callback; a trailing partial line is
+// held back until more data (or EOF) arrives.
+struct Stream {
+    int fd = -1;
+    bool capture = true;
+    std::function<void(std::string_view)> on_data;
+    std::function<void(std::string_view)> on_line;
+    std::string* sink = nullptr;
+    std::string partial;
+
+    void feed(std::string_view data) {
+        if (capture) {
+            sink->append(data);
+        }
+        if (on_data) {
+            on_data(data);
+        }
+        if (!on_line) {
+            return;
+        }
+        size_t start = 0;
+        for (size_t nl = data.find('\n'); nl != std::string_view::npos;
+             nl = data.find('\n', start)) {
+            if (partial.empty()) {
+                on_line(data.substr(start, nl - start));
+            } else {
+                partial.append(data.substr(start, nl - start));
+                on_line(partial);
+                partial.clear();
+            }
+            start = nl + 1;
+        }
+        partial.append(data.substr(start));
+    }
+
+    // Reads what is buffered without waiting for writers that may never close
+    void drain(std::vector<char>& buffer) {
+        if (fd < 0) {
+            return;
+        }
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        ssize_t n;
+        while ((n = ::read(fd, buffer.data(), buffer.size())) > 0 || (n < 0 && errno == EINTR)) {
+            if (n > 0) {
+                feed({buffer.data(), size_t(n)});
+            }
+        }
+        finish();
+    }
+
+    void finish() {
+        if (on_line && !partial.empty()) {
+            on_line(partial);
+            partial.clear();
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};
+
+void close_pipe(int (&fds)[2]) {
+    for (int& fd : fds) {
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+}
+} // namespace
+
+struct EventLoop::Child {
+    pid_t pid = -1;
+    Options options;
+    Stream out;
+    Stream err;
+    Result result;
+    Clock::time_point start;
+    std::string command; // For the trace; empty unless tracing
+    std::optional<Clock::time_point> kill_sent;
+    bool killed = false;
+    bool exited = false; // Reaped; only its process group may still hold the pipes
+    std::function<void(Result)> on_exit;
+
+    void signal(int sig) {
+        // Children run in their own process group so helpers they spawn die too
+        ::kill(-pid, sig);
+    }
+};
+
+EventLoop::EventLoop() {
+    install_interrupt_handler();
+    ++active_loops;
+}
+
+EventLoop::~EventLoop() {
+    for (auto& child : children_) {
+        child->signal(SIGKILL);
+        child->out.finish();
+        child->err.finish();
+        if (!child->exited) {
+            ::waitpid(child->pid, nullptr, 0);
+        }
+    }
+    // The last loop to stop after an interrupt ends the process the way the signal would
+    if (--active_loops == 0 && interrupt_signal != 0) {
+        std::signal(interrupt_signal, SIG_DFL);
+        std::raise(interrupt_signal);
+    }
+}
+
+void EventLoop::spawn(const std::vector<std::string>& argv, Options options,
+                      std::function<void(Result)> on_exit) {
+    if (argv.empty()) {
+        throw std::invalid_argument("subprocess: empty argv");
+    }
+    if (interrupt_signal != 0) {
+        throw std::runtime_error(fmt::format("Interrupted before running {}", argv[0]));
+    }
+
+    int out_pipe[2] = {-1, -1};
+    int err_pipe[2] = {-1, -1};
+    if (::pipe2(out_pipe, O_CLOEXEC) != 0 || ::pipe2(err_pipe, O_CLOEXEC) != 0) {
+        close_pipe(out_pipe);
+        throw std::runtime_error(std::string("pipe() failed: ") + std::strerror(errno));
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_pipe[1], STDERR_FILENO);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    std::vector<char*> args;
+    args.reserve(argv.size() + 1);
+    for (const auto& arg : argv) {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+
+    pid_t pid = -1;
+    int rc = ::posix_spawnp(&pid, args[0], &actions, &attr, args.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    ::close(out_pipe[1]);
+    ::close(err_pipe[1]);
+
+    if (rc != 0) {
+        ::close(out_pipe[0]);
+        ::close(err_pipe[0]);
+        throw std::runtime_error(
+            fmt::format("Failed to spawn {}: {}", argv[0], std::strerror(rc)));
+    }
+
+    auto child = std::make_unique<Child>();
+    child->pid = pid;
+    child->start = Clock::now();
+    if (trace::enabled()) {
+        for (const auto& arg : argv) {
+            child->command += (child->command.empty() ? "" : " ") + arg;
+        }
+    }
+    child->on_exit = std::move(on_exit);
+    child->out.fd = out_pipe[0];
+    child->out.capture = options.capture_stdout;
+    child->out.on_data = std::move(options.on_stdout_data);
+    child->out.on_line = std::move(options.on_stdout_line);
+    child->out.sink = &child->result.out;
+    child->err.fd = err_pipe[0];
+    child->err.capture = options.capture_stderr;
+    child->err.on_line = std::move(options.on_stderr_line);
+    child->err.sink = &child->result.err;
+    child->options = std::move(options);
+    children_.push_back(std::move(child));
+}
+
+void EventLoop::cancel_all() {
+    for (auto& child : children_) {
+        if (!child->kill_sent) {
+            child->result.cancelled = true;
+            child->signal(SIGTERM);
+            child->kill_sent = Clock::now();
+        }
+    }
+}
+
+void EventLoop::run() {
+    std::vector<pollfd> fds;
+    std::vector<Stream*> streams;
+    std::vector<char> buffer(read_chunk);
+
+    bool interrupted = false;
+    while (!children_.empty()) {
+        if (!interrupted && interrupt_signal != 0) {
+            interrupted = true;
+            cancel_all();
+        }
+
+        auto now = Clock::now();
+        int wait_ms = -1;
+        auto shorten = [&](Clock::duration d) {
+            int ms = int(std::max<int64_t>(
+                0, std::chrono::ceil<std::chrono::milliseconds>(d).count()));
+            wait_ms = wait_ms < 0 ? ms : std::min(wait_ms, ms);
+        };
+
+        // Enforce timeouts and cancellation; escalate to SIGKILL after a grace period
+        for (auto& child : children_) {
+            const auto& opts = child->options;
+            if (!child->kill_sent) {
+                if (opts.cancel != nullptr && opts.cancel->load()) {
+                    child->result.cancelled = true;
+                } else if (opts.timeout.count() > 0 && now - child->start >= opts.timeout) {
+                    child->result.timed_out = true;
+                }
+                if (child->result.cancelled || child->result.timed_out) {
+                    child->signal(SIGTERM);
+                    child->kill_sent = now;
+                }
+            } else if (!child->killed && now - *child->kill_sent >= kill_grace) {
+                child->signal(SIGKILL);
+                child->killed = true;
+            }
+
+            if (child->kill_sent && !child->killed) {
+                shorten(*child->kill_sent + kill_grace - now);
+            } else if (!child->kill_sent && opts.timeout.count() > 0) {
+                shorten(child->start + opts.timeout - now);
+            }
+            if (opts.cancel != nullptr) {
+                shorten(std::chrono::milliseconds(100));
+            }
+            if (child->exited || (child->out.fd < 0 && child->err.fd < 0)) {
+                shorten(reap_interval);
+            } else {
+                shorten(exit_check_interval);
+            }
+        }
+
+        fds.clear();
+        streams.clear();
+        if (!interrupted) {
+            fds.push_back({interrupt_pipe[0], POLLIN, 0});
+            streams.push_back(nullptr);
+        }
+        for (auto& child : children_) {
+            for (Stream* stream : {&child->out, &child->err}) {
+                if (stream->fd >= 0) {
+                    fds.push_back({stream->fd, POLLIN, 0});
+                    streams.push_back(stream);
+                }
+            }
+        }
+
+        int ready = ::poll(fds.data(), fds.size(), wait_ms);
+        if (ready < 0 && errno != EINTR) {
+            throw std::runtime_error(std::string("poll() failed: ") + std::strerror(errno));
+        }
+        for (size_t i = 0; ready > 0 && i < fds.size(); ++i) {
+            if (fds[i].revents == 0 || streams[i] == nullptr) {
+                continue;
+            }
+            ssize_t n = ::read(fds[i].fd, buffer.data(), buffer.size());
+            if (n > 0) {
+                streams[i]->feed({buffer.data(), size_t(n)});
+            } else if (n == 0 || (errno != EINTR && errno != EAGAIN)) {
+                streams[i]->finish();
+            }
+        }
+
+        // Reap children as soon as they exit, whether or not their pipes are closed
+        for (auto it = children_.begin(); it != children_.end();) {
+            auto& child = **it;
+            if (!child.exited) {
+                int status = 0;
+                rusage usage{};
+                pid_t reaped;
+                while ((reaped = ::wait4(child.pid, &status, WNOHANG, &usage)) < 0 &&
+                       errno == EINTR) {
+                }
+                if (reaped == 0) {
+                    ++it; // Still running: keep enforcing its timeout
+                    continue;
+                }
+                child.exited = true;
+                if (WIFEXITED(status)) {
+                    child.result.exit_code = WEXITSTATUS(status);
+                } else if (WIFSIGNALED(status)) {
+                    child.result.exit_code = 128 + WTERMSIG(status);
+                }
+                auto end = Clock::now();
+                child.result.elapsed = end - child.start;
+                if (!child.command.empty()) {
+                    auto cpu = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+                    trace::record_child(
+                        child.command, child.start, end,
+                        std::chrono::duration<double>(cpu(usage.ru_utime) + cpu(usage.ru_stime)));
+                }
+            }
+
+            // Helpers left in the child's process group may still write; once the group
+            // is gone, whatever holds the pipes (a daemon that called setsid) is not ours
+            if (child.out.fd >= 0 || child.err.fd >= 0) {
+                if (::kill(-child.pid, 0) == 0 || errno != ESRCH) {
+                    ++it;
+                    continue;
+                }
+                child.out.drain(buffer);
+                child.err.drain(buffer);
+            }
+
+            auto owned = std::move(*it);
+            it = children_.erase(it);
+            if (owned->on_exit) {
+                owned->on_exit(std::move(owned->result));
+            }
+        }
+    }
+    if (interrupted) {
+        throw std::runtime_error("Interrupted");
+    }
+}
+
+Result run(const std::vector<std::string>& argv, Options options) {
+    Result result;
+    EventLoop loop;
+    loop.spawn(argv, std::move(options), [&](Result r) { result = std::move(r); });
+    loop.run();
+    return result;
+}
+
+std::string Result::describe(std::string_view program) const {
+    std::string reason = timed_out   ? "timed out"
+                         : cancelled ? "was cancelled"
+                                     : fmt::format("exited with status {}", exit_code);
+
+    // Last non-empty stderr line is almost always the actual error
+    std::string_view tail = err;
+    while (!tail.empty() && (tail.back() == '\n' || tail.back() == '\r')) {
+        tail.remove_suffix(1);
+    }
+    if (auto nl = tail.find_last_of('\n'); nl != std::string_view::npos) {
+        tail.remove_prefix(nl + 1);
+    }
+    if (tail.empty()) {
+        return fmt::format("{} {}", program, reason);
+    }
+    return fmt::format("{} {}: {}", program, reason, tail);
+}
+
+} // namespace cmake2nix::subprocess
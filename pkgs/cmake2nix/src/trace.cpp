@@ -0,0 +1,247 @@
+#include "cmake2nix.hpp"
+
+#include <algorithm>
+#include <fmt/core.h>
+#include <unistd.h>
+
+namespace cmake2nix::trace {
+
+namespace {
+struct Event {
+    std::string name;
+    std::string category;
+    Clock::time_point start;
+    Clock::time_point end;
+    unsigned tid = 0;
+    std::vector<std::pair<std::string, std::string>> args;
+    std::chrono::duration<double> cpu{0}; // Child processes only
+};
+
+struct Recorder {
+    std::atomic<bool> enabled = false;
+    Clock::time_point origin;
+    std::mutex mutex;
+    std::vector<Event> events;
+    std::atomic<unsigned> next_tid = 0;
+
+    void add(Event event) {
+        std::lock_guard lock(mutex);
+        events.push_back(std::move(event));
+    }
+};
+
+Recorder& recorder() {
+    static Recorder instance;
+    return instance;
+}
+
+// Small stable ids read better in the viewer than hashed std::thread::ids
+unsigned thread_id() {
+    thread_local unsigned id = recorder().next_tid++;
+    return id;
+}
+
+thread_local Span* current = nullptr;
+
+double micros(Clock::duration d) {
+    return std::chrono::duration<double, std::micro>(d).count();
+}
+
+double seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+}
+
+std::string_view find_arg(const Event& event, std::string_view key) {
+    for (const auto& [name, value] : event.args) {
+        if (name == key) {
+            return value;
+        }
+    }
+    return {};
+}
+} // namespace
+
+void start(Clock::time_point origin) {
+    auto& rec = recorder();
+    std::lock_guard lock(rec.mutex);
+    if (!rec.enabled) {
+        rec.origin = origin;
+        rec.enabled = true;
+        thread_id(); // The main thread is 0
+    }
+}
+
+bool enabled() {
+    return recorder().enabled.load(std::memory_order_relaxed);
+}
+
+Span::Span(std::string_view name, std::string_view category) {
+    if (!enabled()) {
+        return;
+    }
+    active_ = true;
+    name_ = name;
+    category_ = category;
+    parent_ = std::exchange(current, this);
+    start_ = Clock::now();
+}
+
+Span::~Span() {
+    if (!active_) {
+        return;
+    }
+    current = parent_;
+    recorder().add({std::move(name_), std::move(category_), start_, Clock::now(), thread_id(),
+                    std::move(args_)});
+}
+
+void Span::arg(std::string_view key, std::string_view value) {
+    if (active_) {
+        args_.emplace_back(key, value);
+    }
+}
+
+void annotate(std::string_view key, std::string_view value) {
+    if (current != nullptr) {
+        current->arg(key, value);
+    }
+}
+
+void record(std::string_view name, std::string_view category, Clock::time_point start,
+            Clock::time_point end) {
+    if (enabled()) {
+        recorder().add({std::string(name), std::string(category), start, end, thread_id(), {}});
+    }
+}
+
+void record_child(std::string_view command, Clock::time_point start, Clock::time_point end,
+                  std::chrono::duration<double> cpu) {
+    if (!enabled()) {
+        return;
+    }
+    // Named after the program, the full command line goes in the args
+    auto program = command.substr(0, command.find(' '));
+    program.remove_prefix(program.rfind('/') == std::string_view::npos ? 0
+                                                                       : program.rfind('/') + 1);
+    Event event{std::string(program), "process", start, end, thread_id(), {}, cpu};
+    event.args.emplace_back("command", command);
+    event.args.emplace_back("cpu", fmt::format("{:.3f}s", cpu.count()));
+    recorder().add(std::move(event));
+}
+
+void write(const fs::path& path) {
+    auto& rec = recorder();
+    std::lock_guard lock(rec.mutex);
+
+    json events = json::array();
+    int pid = ::getpid();
+    for (unsigned tid = 0; tid < rec.next_tid; ++tid) {
+        events.push_back({{"name", "thread_name"},
+                          {"ph", "M"},
+                          {"pid", pid},
+                          {"tid", tid},
+                          {"args", {{"name", tid == 0 ? "main" : fmt::format("worker {}", tid)}}}});
+    }
+    for (const auto& event : rec.events) {
+        json args = json::object();
+        for (const auto& [key, value] : event.args) {
+            args[key] = value;
+        }
+        events.push_back({{"name", event.name},
+                          {"cat", event.category},
+                          {"ph", "X"},
+                          {"ts", micros(event.start - rec.origin)},
+                          {"dur", micros(event.end - event.start)},
+                          {"pid", pid},
+                          {"tid", event.tid},
+                          {"args", std::move(args)}});
+    }
+    json trace = {{"traceEvents", std::move(events)}, {"displayTimeUnit", "ms"}};
+    fsutil::write_atomic(path, trace.dump() + "\n");
+    fmt::print("cmake2nix: Wrote {} trace events to {}\n", rec.events.size(), path.string());
+}
+
+void print_stats(size_t slowest) {
+    auto& rec = recorder();
+    std::lock_guard lock(rec.mutex);
+    auto wall = Clock::now() - rec.origin;
+
+    // Phases in order of first appearance; nested phases are also counted in their parent
+    struct Total {
+        std::string name;
+        size_t count = 0;
+        Clock::duration time{0};
+        Clock::duration max{0};
+        std::chrono::duration<double> cpu{0};
+    };
+    auto add_to = [](std::vector<Total>& totals, const Event& event) {
+        auto it = std::find_if(totals.begin(), totals.end(),
+                               [&](const Total& t) { return t.name == event.name; });
+        if (it == totals.end()) {
+            it = totals.insert(it, Total{event.name});
+        }
+        auto time = event.end - event.start;
+        it->count++;
+        it->time += time;
+        it->max = std::max(it->max, time);
+        it->cpu += event.cpu;
+    };
+
+    std::vector<Event> events = rec.events;
+    std::sort(events.begin(), events.end(),
+              [](const Event& a, const Event& b) { return a.start < b.start; });
+    std::vector<Total> phases;
+    std::vector<Total> programs;
+    std::vector<const Event*> dependencies;
+    for (const auto& event : events) {
+        if (event.category == "phase") {
+            add_to(phases, event);
+        } else if (event.category == "process") {
+            add_to(programs, event);
+        } else if (event.category == "prefetch" || event.category == "discover") {
+            dependencies.push_back(&event);
+        }
+    }
+
+    fmt::print("\ncmake2nix: {:<28} {:>6} {:>11} {:>10}\n", "Phase", "calls", "total (s)",
+               "max (s)");
+    for (const auto& phase : phases) {
+        fmt::print("  {:<37} {:>6} {:>11.3f} {:>10.3f}\n", phase.name, phase.count,
+                   seconds(phase.time), seconds(phase.max));
+    }
+
+    if (!dependencies.empty()) {
+        std::sort(dependencies.begin(), dependencies.end(), [](const Event* a, const Event* b) {
+            return a->end - a->start > b->end - b->start;
+        });
+        dependencies.resize(std::min(dependencies.size(), slowest));
+        fmt::print("\ncmake2nix: Slowest {} dependencies\n", dependencies.size());
+        for (const auto* event : dependencies) {
+            auto cache = find_arg(*event, "cache");
+            fmt::print("  {:<28} {:<9} {:<16} {:<6} {:>9.3f}s\n", event->name, event->category,
+                       find_arg(*event, "method"), cache.empty() ? "-" : cache,
+                       seconds(event->end - event->start));
+        }
+    }
+
+    Clock::duration child_wall{0};
+    std::chrono::duration<double> child_cpu{0};
+    size_t children = 0;
+    if (!programs.empty()) {
+        fmt::print("\ncmake2nix: {:<28} {:>6} {:>11} {:>10}\n", "Child process", "count",
+                   "wall (s)", "cpu (s)");
+        for (const auto& program : programs) {
+            fmt::print("  {:<37} {:>6} {:>11.3f} {:>10.3f}\n", program.name, program.count,
+                       seconds(program.time), program.cpu.count());
+            children += program.count;
+            child_wall += program.time;
+            child_cpu += program.cpu;
+        }
+    }
+    fmt::print("\ncmake2nix: {:.3f}s wall, {} child processes: {:.3f}s summed wall time "
+               "({:.1f}x), {:.3f}s CPU\n",
+               seconds(wall), children, seconds(child_wall),
+               seconds(child_wall) / std::max(seconds(wall), 1e-9), child_cpu.count());
+}
+
+} // namespace cmake2nix::trace
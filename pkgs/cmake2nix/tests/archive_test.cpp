@@ -0,0 +1,145 @@
+// In-process hashing against known-good values: nar::hash_path against
+// `nix hash path`, and archive::TarballHasher against `nix-prefetch-url --unpack`
+// on the tarballs in tests/fixtures (see make-tarballs.py there).
+
+#include "cmake2nix.hpp"
+#include "check.hpp"
+
+#include <fstream>
+#include <iterator>
+
+#ifndef CMAKE2NIX_TEST_FIXTURES
+#error "CMAKE2NIX_TEST_FIXTURES must point at tests/fixtures"
+#endif
+
+using namespace cmake2nix;
+
+namespace {
+
+const fs::path fixtures = CMAKE2NIX_TEST_FIXTURES;
+
+// gnu.tar.gz unpacks to this tree; pax.tar.gz adds café.txt, ustar.tar.gz lacks the
+// long symlink
+constexpr std::string_view tree_sri = "sha256-+fkyxNMN3FHC9W+EDow7JXXvGiwIEH4AsseWS7HOIVc=";
+
+constexpr std::string_view long_dir =
+    "a-directory-name-long-enough/that-the-path-no-longer-fits/in-the-hundred-bytes";
+
+void write(const fs::path& path, std::string_view content, fs::perms perms = fs::perms(0644)) {
+    fs::create_directories(path.parent_path());
+    std::ofstream(path, std::ios::binary) << content;
+    fs::permissions(path, perms);
+}
+
+std::string read(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(in), {}};
+}
+
+std::string repeat(std::string_view text, size_t times) {
+    std::string out;
+    for (size_t i = 0; i < times; ++i) {
+        out += text;
+    }
+    return out;
+}
+
+// The tree make-tarballs.py archives, plus a .git directory to filter out
+void make_tree(const fs::path& root) {
+    write(root / "CMakeLists.txt", "project(demo)\n");
+    write(root / "empty", "");
+    write(root / "bin/run.sh", "#!/bin/sh\necho run\n", fs::perms(0755));
+    write(root / "bin/group-exec-only", "not executable in a NAR\n", fs::perms(0654));
+    fs::create_symlink("bin/run.sh", root / "link");
+    fs::create_symlink(repeat("../", 40) + "target", root / "dangling");
+    fs::create_hard_link(root / "bin/run.sh", root / "hard");
+    fs::create_directories(root / "empty-dir");
+    write(root / long_dir / "of-a-tar-header-name-field.txt", repeat("long\n", 300));
+    write(root / "Zeta", "Z");
+    write(root / "alpha", "a");
+    write(root / ".git/HEAD", "ref: refs/heads/main\n");
+}
+
+void hash_path(const fs::path& tmp) {
+    auto root = tmp / "tree";
+    make_tree(root);
+    auto skip_git = [](std::string_view name) { return name == ".git"; };
+
+    CHECK_EQ(digest::to_sri(nar::hash_path(root, skip_git)), tree_sri);
+    CHECK_EQ(digest::to_sri(nar::hash_path(root)),
+             "sha256-/e81rDtaeT9YK3L1eSQ8/omAUUehMe6SljaopwgjNM0=");
+    // A lone file, executable file and symlink are NAR roots of their own
+    CHECK_EQ(digest::to_sri(nar::hash_path(root / "alpha")),
+             "sha256-f60ra/I/4NfkGxt4fT+hSXdhJvTBQGvfuX0/vcvbPnQ=");
+    CHECK_EQ(digest::to_sri(nar::hash_path(root / "bin/run.sh")),
+             "sha256-sAKyX9fqfcRRwXU9mGWrjf8jkek2wpnh1nw6zTXaIng=");
+    CHECK_EQ(digest::to_sri(nar::hash_path(root / "link")),
+             "sha256-UzL9pugIG54DpyPbjZuivTkCXM6ABsCXzth679ZLG5o=");
+}
+
+digest::Sha256::Digest hash_tarball(const std::string& data, size_t chunk,
+                                    size_t memory_budget = archive::TarballHasher::default_memory_budget) {
+    archive::TarballHasher hasher(memory_budget);
+    for (size_t pos = 0; pos < data.size(); pos += chunk) {
+        hasher.update(std::string_view(data).substr(pos, chunk));
+    }
+    return hasher.finish();
+}
+
+template <typename Fn> bool throws(Fn&& fn) {
+    try {
+        fn();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+void tarballs() {
+    struct Case {
+        std::string_view file;
+        std::string_view sri;
+    };
+    // GNU long name and long link records, pax records (path, linkpath, a global
+    // header, several gzip members), ustar prefix names, and a lone file
+    for (auto [file, sri] : {
+             Case{"gnu.tar.gz", tree_sri},
+             Case{"pax.tar.gz", "sha256-tUUg3nBYdVA27kRqEsz2qyOSi5dkzHnHw45zCvJ28A4="},
+             Case{"ustar.tar.gz", "sha256-gO+0BGCto4/1IcXYoKV9chdHuAVF1CRuasJ56/A/+/s="},
+             Case{"single-file.tar.gz", "sha256-BF/Ay80X6tH8lQbkdsyBjueYdoB+TO6F2IpdDh1slCs="},
+         }) {
+        auto data = read(fixtures / file);
+        CHECK(!data.empty());
+        CHECK_EQ(digest::to_sri(hash_tarball(data, data.size())), sri);
+        // Byte at a time, and with every file spilled to disk
+        CHECK_EQ(digest::to_sri(hash_tarball(data, 1)), sri);
+        CHECK_EQ(digest::to_sri(hash_tarball(data, 7, 0)), sri);
+    }
+
+    archive::TarballHasher spilling(0);
+    spilling.update(read(fixtures / "gnu.tar.gz"));
+    spilling.finish();
+    CHECK(spilling.spilled_bytes() > 0);
+
+    // fetchzip needs a single top-level entry to strip
+    auto two_tops = read(fixtures / "two-tops.tar.gz");
+    CHECK(throws([&] { hash_tarball(two_tops, two_tops.size()); }));
+
+    // A partial download never yields a hash
+    auto gnu = read(fixtures / "gnu.tar.gz");
+    for (size_t size : {size_t(0), size_t(10), gnu.size() / 2, gnu.size() - 1}) {
+        CHECK(throws([&] { hash_tarball(gnu.substr(0, size), 64); }));
+    }
+    auto corrupt = gnu;
+    corrupt[corrupt.size() / 2] ^= 0x55;
+    CHECK(throws([&] { hash_tarball(corrupt, corrupt.size()); }));
+}
+
+} // namespace
+
+int main() {
+    fsutil::TempDir tmp("cmake2nix-archive-test");
+    hash_path(tmp.path());
+    tarballs();
+    return check::exit_code();
+}
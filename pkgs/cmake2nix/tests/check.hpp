@@ -0,0 +1,40 @@
+// Minimal assertions for the ctest executables: a failed check is printed and
+// counted, and main() returns check::exit_code() so ctest sees the failure.
+#pragma once
+
+#include <fmt/core.h>
+#include <string_view>
+
+namespace check {
+
+inline int failures = 0;
+
+inline void expect(bool ok, std::string_view what, const char* file, int line) {
+    if (!ok) {
+        fmt::print(stderr, "{}:{}: check failed: {}\n", file, line, what);
+        ++failures;
+    }
+}
+
+template <typename Actual, typename Expected>
+void equal(const Actual& actual, const Expected& expected, std::string_view what,
+           const char* file, int line) {
+    if (!(actual == expected)) {
+        fmt::print(stderr, "{}:{}: check failed: {}\n  actual:   {}\n  expected: {}\n", file,
+                   line, what, actual, expected);
+        ++failures;
+    }
+}
+
+inline int exit_code() {
+    if (failures != 0) {
+        fmt::print(stderr, "{} check(s) failed\n", failures);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+} // namespace check
+
+#define CHECK(cond) ::check::expect(bool(cond), #cond, __FILE__, __LINE__)
+#define CHECK_EQ(actual, expected)                                                            \
+    ::check::equal((actual), (expected), #actual " == " #expected, __FILE__, __LINE__)
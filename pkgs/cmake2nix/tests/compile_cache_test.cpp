@@ -0,0 +1,121 @@
+// Compile cache keys: what the cc-wrapper's environment contributes, and what a
+// dependency bump may change without missing.
+
+#include "cmake2nix.hpp"
+#include "check.hpp"
+
+#include <cstdlib>
+#include <fstream>
+
+using namespace cmake2nix;
+
+namespace {
+
+constexpr std::string_view preprocessed = "# 1 \"main.c\"\nint main(void) { return 0; }\n";
+
+std::string store_path(char hash, std::string_view name) {
+    return fmt::format("/nix/store/{}-{}", std::string(32, hash), name);
+}
+
+// Key of a compile of main.c with `flags`, under `environment` (NAME, value pairs;
+// every other wrapper variable unset)
+std::string key_of(std::vector<std::pair<std::string, std::string>> environment,
+                   std::vector<std::string> flags = {}) {
+    for (const char* name : {"NIX_CFLAGS_COMPILE", "NIX_CFLAGS_COMPILE_BEFORE",
+                             "NIX_CFLAGS_COMPILE_FOR_BUILD", "NIX_HARDENING_ENABLE",
+                             "NIX_ENFORCE_NO_NATIVE", "NIX_BUILD_CORES", "NIX_BUILD_TOP",
+                             "NIX_CC_WRAPPER_TARGET_HOST_x86_64_unknown_linux_gnu"}) {
+        ::unsetenv(name);
+    }
+    for (const auto& [name, value] : environment) {
+        ::setenv(name.c_str(), value.c_str(), 1);
+    }
+    std::vector<std::string> args = {"cc", "-c", "main.c", "-o", "main.o"};
+    args.insert(args.end(), flags.begin(), flags.end());
+    auto invocation = compile_cache::parse(args);
+    CHECK_EQ(invocation.uncacheable, "");
+    return compile_cache::key(invocation, "cc", preprocessed);
+}
+
+void wrapper_environment() {
+    auto base = key_of({{"NIX_CFLAGS_COMPILE",
+                         "-frandom-seed=0a1b2c3d4e -isystem " + store_path('a', "dep-1.0/include") +
+                             " -O2"},
+                        {"NIX_HARDENING_ENABLE", "fortify pic stackprotector"},
+                        {"NIX_BUILD_CORES", "4"},
+                        {"NIX_BUILD_TOP", "/build"}});
+
+    // A dependency bump: new random seed and include directory, other build settings
+    CHECK_EQ(key_of({{"NIX_CFLAGS_COMPILE",
+                      "-frandom-seed=9z8y7x6w5v -isystem " + store_path('b', "dep-1.1/include") +
+                          " -O2"},
+                     {"NIX_HARDENING_ENABLE", "stackprotector pic fortify pic"},
+                     {"NIX_BUILD_CORES", "16"},
+                     {"NIX_BUILD_TOP", "/tmp/nix-build-1"},
+                     {"NIX_CC_WRAPPER_TARGET_HOST_x86_64_unknown_linux_gnu", "1"}}),
+             base);
+
+    // Anything that changes the code does miss
+    CHECK(key_of({{"NIX_CFLAGS_COMPILE",
+                   "-frandom-seed=0a1b2c3d4e -isystem " + store_path('a', "dep-1.0/include") +
+                       " -O3"},
+                  {"NIX_HARDENING_ENABLE", "fortify pic stackprotector"}}) != base);
+    CHECK(key_of({{"NIX_CFLAGS_COMPILE",
+                   "-frandom-seed=0a1b2c3d4e -isystem " + store_path('a', "dep-1.0/include") +
+                       " -O2"},
+                  {"NIX_HARDENING_ENABLE", "fortify pic"}}) != base);
+    auto plain = key_of({});
+    CHECK(key_of({{"NIX_CFLAGS_COMPILE_BEFORE", "-O2"}}) != plain);
+    CHECK(key_of({{"NIX_CFLAGS_COMPILE_FOR_BUILD", "-O2"}}) != plain);
+    CHECK(key_of({{"NIX_ENFORCE_NO_NATIVE", "1"}}) != plain);
+    CHECK(key_of({{"NIX_CFLAGS_COMPILE", "-O2"}}) !=
+          key_of({{"NIX_CFLAGS_COMPILE_BEFORE", "-O2"}}));
+
+    // Debug info and uncacheable options count from the environment too
+    ::setenv("NIX_CFLAGS_COMPILE", "-ggdb", 1);
+    CHECK(compile_cache::parse({"cc", "-c", "main.c", "-o", "main.o"}).debug_info);
+    ::setenv("NIX_CFLAGS_COMPILE", "--coverage", 1);
+    CHECK(!compile_cache::parse({"cc", "-c", "main.c", "-o", "main.o"}).uncacheable.empty());
+    ::unsetenv("NIX_CFLAGS_COMPILE");
+}
+
+// Include directories are covered by the preprocessed source even with -g, other
+// store paths only without it
+void store_paths() {
+    auto include = [](char hash) { return store_path(hash, "dep-1.0/include"); };
+    CHECK_EQ(key_of({}, {"-g", "-isystem", include('a'), "-I" + include('a')}),
+             key_of({}, {"-g", "-isystem", include('b'), "-I" + include('b')}));
+    auto prefix_map = [](char hash) {
+        return "-fdebug-prefix-map=" + store_path(hash, "src") + "=.";
+    };
+    CHECK_EQ(key_of({}, {prefix_map('a')}), key_of({}, {prefix_map('b')}));
+    CHECK(key_of({}, {"-g", prefix_map('a')}) != key_of({}, {"-g", prefix_map('b')}));
+}
+
+// Plugins and specs files count by contents, wherever they live
+void file_options(const fs::path& tmp) {
+    auto write = [](const fs::path& path, std::string_view content) {
+        std::ofstream(path, std::ios::binary) << content;
+    };
+    write(tmp / "a.so", "plugin v1");
+    write(tmp / "b.so", "plugin v1");
+    auto key_a = key_of({{"NIX_CFLAGS_COMPILE", "-fplugin=" + (tmp / "a.so").string()}});
+    CHECK_EQ(key_of({{"NIX_CFLAGS_COMPILE", "-fplugin=" + (tmp / "b.so").string()}}), key_a);
+    write(tmp / "a.so", "plugin v2");
+    CHECK(key_of({{"NIX_CFLAGS_COMPILE", "-fplugin=" + (tmp / "a.so").string()}}) != key_a);
+
+    write(tmp / "specs", "*cc1:\n-O2\n");
+    auto key_specs = key_of({}, {"-specs=" + (tmp / "specs").string()});
+    write(tmp / "specs", "*cc1:\n-O3\n");
+    CHECK(key_of({}, {"-specs=" + (tmp / "specs").string()}) != key_specs);
+}
+
+} // namespace
+
+int main() {
+    fsutil::TempDir tmp("cmake2nix-compile-cache-test");
+    wrapper_environment();
+    store_paths();
+    file_options(tmp.path());
+    return check::exit_code();
+}
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+# Regenerates the tarballs archive_test hashes. The expected hashes in
+# archive_test.cpp come from unpacking these and running `nix hash path` on the
+# single top-level directory, as fetchzip / `nix-prefetch-url --unpack` do.
+import gzip
+import io
+import os
+import tarfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+LONG_DIR = "a-directory-name-long-enough/that-the-path-no-longer-fits/in-the-hundred-bytes"
+LONG_NAME = LONG_DIR + "/of-a-tar-header-name-field.txt"
+LONG_TARGET = "../" * 40 + "target"
+
+
+def entry(name, type=tarfile.REGTYPE, mode=0o644, data=b"", link=""):
+    info = tarfile.TarInfo(name)
+    info.type = type
+    info.mode = mode
+    info.mtime = 1
+    info.uname = info.gname = "nixbld"
+    info.linkname = link
+    info.size = len(data) if type == tarfile.REGTYPE else 0
+    return info, io.BytesIO(data) if type == tarfile.REGTYPE else None
+
+
+def tree(top):
+    return [
+        entry(f"{top}/", tarfile.DIRTYPE, 0o755),
+        entry(f"{top}/CMakeLists.txt", data=b"project(demo)\n"),
+        entry(f"{top}/empty"),
+        entry(f"{top}/bin/", tarfile.DIRTYPE, 0o755),
+        entry(f"{top}/bin/run.sh", mode=0o755, data=b"#!/bin/sh\necho run\n"),
+        entry(f"{top}/bin/group-exec-only", mode=0o654, data=b"not executable in a NAR\n"),
+        entry(f"{top}/link", tarfile.SYMTYPE, 0o777, link="bin/run.sh"),
+        entry(f"{top}/dangling", tarfile.SYMTYPE, 0o777, link=LONG_TARGET),
+        # Extracting a hard link (GNU tar, libarchive) keeps its target's mode
+        entry(f"{top}/hard", tarfile.LNKTYPE, link=f"{top}/bin/run.sh"),
+        entry(f"{top}/empty-dir/", tarfile.DIRTYPE, 0o755),
+        # Implicit parent directories, and a name past the 100-byte field
+        entry(f"{top}/{LONG_NAME}", data=b"long\n" * 300),
+        # Byte-wise NAR order: upper case sorts first
+        entry(f"{top}/Zeta", data=b"Z"),
+        entry(f"{top}/alpha", data=b"a"),
+    ]
+
+
+def write(name, entries, format, members=1, pax_headers=None):
+    raw = io.BytesIO()
+    with tarfile.open(fileobj=raw, mode="w", format=format, pax_headers=pax_headers) as tar:
+        for info, data in entries:
+            tar.addfile(info, data)
+    raw = raw.getvalue()
+    # Several gzip members concatenated are still one valid stream
+    cut = [len(raw) * i // members for i in range(members + 1)]
+    with open(os.path.join(HERE, name), "wb") as out:
+        for begin, end in zip(cut, cut[1:]):
+            out.write(gzip.compress(raw[begin:end], mtime=0))
+
+
+write("gnu.tar.gz", tree("gnu-1.0"), tarfile.GNU_FORMAT)
+# git archive style: a global header with the commit, and the unicode name in pax
+write("pax.tar.gz", tree("pax-1.0") + [entry("pax-1.0/café.txt", data=b"pax\n")],
+      tarfile.PAX_FORMAT, members=3,
+      pax_headers={"comment": "0123456789abcdef0123456789abcdef01234567"})
+# ustar splits names over 100 bytes into prefix + name
+write("ustar.tar.gz", [e for e in tree("ustar-1.0") if "dangling" not in e[0].name],
+      tarfile.USTAR_FORMAT)
+write("single-file.tar.gz", [entry("README", data=b"only a file\n")], tarfile.GNU_FORMAT)
+write("two-tops.tar.gz", [entry("a", data=b"a"), entry("b", data=b"b")], tarfile.GNU_FORMAT)
@@ -0,0 +1,155 @@
+// Git mirrors against local file:// remotes: mirror creation and reuse, ref
+// resolution through ls-remote, worktree checkouts with submodules and their
+// release, and fetchgit hashes (.git excluded) against known-good values.
+
+#include "cmake2nix.hpp"
+#include "check.hpp"
+
+#include <fstream>
+
+using namespace cmake2nix;
+
+namespace {
+
+// What fetchgit gives for v1.0, and for main (which adds the lib submodule)
+constexpr std::string_view v1_sri = "sha256-viUzIDR0p5C8Rq7zyJ2T6c/ccqhqv2XY3MBIen0w5tc=";
+constexpr std::string_view main_sri = "sha256-sqRHTOlrnzg6rlDem/TmDOyzdc+Wqut17rCHXUvFna8=";
+
+std::string git(const fs::path& dir, std::vector<std::string> args) {
+    args.insert(args.begin(), {"git", "-C", dir.string(), "-c", "user.name=cmake2nix", "-c",
+                               "user.email=cmake2nix@localhost", "-c", "commit.gpgsign=false"});
+    auto result = subprocess::run(args);
+    if (!result.ok()) {
+        throw std::runtime_error(result.describe("git"));
+    }
+    while (!result.out.empty() && result.out.back() == '\n') {
+        result.out.pop_back();
+    }
+    return result.out;
+}
+
+void write(const fs::path& path, std::string_view content, fs::perms perms = fs::perms(0644)) {
+    std::ofstream(path, std::ios::binary) << content;
+    fs::permissions(path, perms);
+}
+
+struct Remotes {
+    std::string url; // file:// URL of the superproject
+    std::string v1;  // Tagged v1.0
+    std::string main;
+};
+
+// remote/upstream (v1.0, then main with a lib submodule at ../lib) and remote/lib
+Remotes make_remotes(const fs::path& root) {
+    auto lib = root / "remote/lib";
+    auto upstream = root / "remote/upstream";
+    for (const auto& dir : {lib, upstream}) {
+        fs::create_directories(dir);
+        git(dir, {"init", "-q", "-b", "main"});
+    }
+
+    write(lib / "lib.h", "int lib();\n");
+    git(lib, {"add", "-A"});
+    git(lib, {"commit", "-q", "-m", "lib"});
+    auto lib_commit = git(lib, {"rev-parse", "HEAD"});
+
+    Remotes remotes;
+    remotes.url = "file://" + upstream.string();
+    write(upstream / "CMakeLists.txt", "project(demo)\n");
+    write(upstream / "run.sh", "#!/bin/sh\necho run\n", fs::perms(0755));
+    fs::create_symlink("run.sh", upstream / "link");
+    git(upstream, {"add", "-A"});
+    git(upstream, {"commit", "-q", "-m", "v1"});
+    git(upstream, {"tag", "v1.0"});
+    remotes.v1 = git(upstream, {"rev-parse", "HEAD"});
+
+    write(upstream / ".gitmodules", "[submodule \"lib\"]\n\tpath = lib\n\turl = ../lib\n");
+    git(upstream, {"update-index", "--add", "--cacheinfo", "160000," + lib_commit + ",lib"});
+    git(upstream, {"add", ".gitmodules"});
+    git(upstream, {"commit", "-q", "-m", "submodule"});
+    remotes.main = git(upstream, {"rev-parse", "HEAD"});
+    return remotes;
+}
+
+// Worktrees the mirror has registered, besides the bare repository itself
+size_t registered_worktrees(const mirror::Repository& repo) {
+    auto list = git(repo.path(), {"worktree", "list", "--porcelain"});
+    size_t count = 0;
+    for (size_t pos = 0; (pos = list.find("worktree ", pos)) != std::string::npos; ++pos) {
+        ++count;
+    }
+    return count - 1;
+}
+
+void urls() {
+    CHECK_EQ(mirror::normalize_url("HTTPS://GitHub.com/Owner/Repo.git/"),
+             "https://github.com/Owner/Repo");
+    CHECK_EQ(mirror::normalize_url("git@github.com:owner/repo.git"),
+             "ssh://git@github.com/owner/repo");
+    CHECK_EQ(mirror::resolve_url("file:///srv/remote/upstream", "../lib"),
+             "file:///srv/remote/lib");
+    CHECK_EQ(mirror::resolve_url("https://host/a/b.git", "./c"), "https://host/a/b.git/c");
+}
+
+void resolve(const Remotes& remotes) {
+    resolver::Resolver resolver(1);
+    CHECK_EQ(resolver.resolve(remotes.url, "v1.0").value_or(""), remotes.v1);
+    CHECK_EQ(resolver.resolve(remotes.url, "main").value_or(""), remotes.main);
+    CHECK(!resolver.resolve(remotes.url, "no-such-ref").has_value());
+    auto calls = resolver.remote_calls();
+    CHECK_EQ(resolver.resolve(remotes.url, "v1.0").value_or(""), remotes.v1);
+    CHECK_EQ(resolver.remote_calls(), calls);
+}
+
+void mirrors(const fs::path& root, const Remotes& remotes) {
+    auto mirror_dir = root / "mirrors";
+    mirror::Repository repo(mirror_dir, remotes.url);
+    CHECK_EQ(repo.fetch("v1.0"), remotes.v1);
+    CHECK(fs::exists(repo.path() / "HEAD"));
+
+    // Another spelling of the same remote shares the mirror; a known commit is free
+    mirror::Repository again(mirror_dir, remotes.url + ".git/");
+    CHECK_EQ(again.path().string(), repo.path().string());
+    CHECK_EQ(again.fetch(remotes.v1), remotes.v1);
+    CHECK_EQ(again.fetch("main"), remotes.main);
+
+    auto skip_git = [](std::string_view name) { return name == ".git"; };
+    {
+        auto checkout = repo.checkout(remotes.v1, root / "v1");
+        CHECK_EQ(digest::to_sri(nar::hash_path(checkout.path(), skip_git)), v1_sri);
+        CHECK_EQ(registered_worktrees(repo), size_t(1));
+    }
+    CHECK(!fs::exists(root / "v1"));
+    CHECK_EQ(registered_worktrees(repo), size_t(0));
+
+    {
+        auto checkout = repo.checkout(remotes.main, root / "main");
+        CHECK(fs::exists(root / "main/lib/lib.h"));
+        CHECK_EQ(digest::to_sri(nar::hash_path(checkout.path(), skip_git)), main_sri);
+    }
+    CHECK(!fs::exists(root / "main"));
+    CHECK_EQ(registered_worktrees(repo), size_t(0));
+    mirror::Repository lib(mirror_dir, remotes.url.substr(0, remotes.url.rfind('/')) + "/lib");
+    CHECK(fs::exists(lib.path() / "HEAD"));
+    CHECK_EQ(registered_worktrees(lib), size_t(0));
+
+    // The whole fetchgit path, through the persistent mirrors and a throwaway one
+    prefetcher::Options options;
+    options.mirror_dir = mirror_dir;
+    CHECK_EQ(prefetcher::prefetch_git(remotes.url, "v1.0", options), v1_sri);
+    CHECK_EQ(prefetcher::prefetch_git(remotes.url, remotes.main, options), main_sri);
+    CHECK_EQ(prefetcher::prefetch_git(remotes.url, "main"), main_sri);
+    CHECK_EQ(registered_worktrees(repo), size_t(0));
+    CHECK_EQ(registered_worktrees(lib), size_t(0));
+}
+
+} // namespace
+
+int main() {
+    fsutil::TempDir tmp("cmake2nix-mirror-test");
+    auto remotes = make_remotes(tmp.path());
+    urls();
+    resolve(remotes);
+    mirrors(tmp.path(), remotes);
+    return check::exit_code();
+}
@@ -0,0 +1,80 @@
+// project() extraction by parse_cmake_lists and scan_tree, and how it ends up in
+// the generated default.nix.
+
+#include "cmake2nix.hpp"
+#include "check.hpp"
+
+#include <fstream>
+
+using namespace cmake2nix;
+
+namespace {
+
+void write(const fs::path& path, std::string_view content) {
+    std::ofstream out(path, std::ios::binary);
+    out << content;
+}
+
+ProjectInfo parse(const fsutil::TempDir& dir, std::string_view cmake_lists) {
+    write(dir.path() / "CMakeLists.txt", cmake_lists);
+    return parser::parse_cmake_lists(dir.path() / "CMakeLists.txt");
+}
+
+void literal_project(const fsutil::TempDir& dir) {
+    auto info = parse(dir, "cmake_minimum_required(VERSION 3.24)\n"
+                           "# project(commented VERSION 9.9.9)\n"
+                           "project(demo VERSION 1.2.3 LANGUAGES CXX)\n");
+    CHECK_EQ(info.pname, "demo");
+    CHECK_EQ(info.version, "1.2.3");
+
+    info = parse(dir, "project(\"quoted\")\n");
+    CHECK_EQ(info.pname, "quoted");
+    CHECK_EQ(info.version, "0.1.0");
+}
+
+// Variable references cannot be expanded without configuring: the defaults win
+void variable_project(const fsutil::TempDir& dir) {
+    auto info = parse(dir, "set(N demo)\nset(V 1.0)\nproject(${N} VERSION ${V})\n");
+    CHECK_EQ(info.pname, "cmake-project");
+    CHECK_EQ(info.version, "0.1.0");
+
+    info = parse(dir, "project(demo-$ENV{SUFFIX} VERSION 2.0.$CACHE{PATCH})\n");
+    CHECK_EQ(info.pname, "cmake-project");
+    CHECK_EQ(info.version, "0.1.0");
+
+    info = parse(dir, "project(demo VERSION ${PROJECT_VERSION_OVERRIDE})\n");
+    CHECK_EQ(info.pname, "demo");
+    CHECK_EQ(info.version, "0.1.0");
+
+    auto scan = parser::scan_tree(dir.path() / "CMakeLists.txt", 1);
+    CHECK(scan.project.has_value());
+    if (scan.project) {
+        CHECK_EQ(scan.project->pname, "demo");
+        CHECK_EQ(scan.project->version, "");
+    }
+
+    write(dir.path() / "CMakeLists.txt", "project(${N} VERSION ${V})\n");
+    scan = parser::scan_tree(dir.path() / "CMakeLists.txt", 1);
+    CHECK(scan.project.has_value());
+    if (scan.project) {
+        CHECK_EQ(scan.project->pname, "");
+        CHECK_EQ(scan.project->version, "");
+    }
+}
+
+// pname and version are Nix string literals, never spliced raw
+void generated_default_nix() {
+    auto nix = generator::generate_default_nix({"a\"b${c}", "1.0\\"});
+    CHECK(nix.find(R"(pname = "a\"b\${c}";)") != std::string::npos);
+    CHECK(nix.find(R"(version = "1.0\\";)") != std::string::npos);
+}
+
+} // namespace
+
+int main() {
+    fsutil::TempDir dir("cmake2nix-parser-test");
+    literal_project(dir);
+    variable_project(dir);
+    generated_default_nix();
+    return check::exit_code();
+}
@@ -0,0 +1,195 @@
+// The streamed curl -> TarballHasher path of fetchFromGitHub (and fetchzip)
+// against a local HTTP stand-in for codeload: complete downloads hash like
+// `nix-prefetch-url --unpack`, and failed or truncated ones never yield a hash.
+
+#include "cmake2nix.hpp"
+#include "check.hpp"
+
+#include <arpa/inet.h>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#ifndef CMAKE2NIX_TEST_FIXTURES
+#error "CMAKE2NIX_TEST_FIXTURES must point at tests/fixtures"
+#endif
+
+using namespace cmake2nix;
+
+namespace {
+
+const fs::path fixtures = CMAKE2NIX_TEST_FIXTURES;
+
+// gnu.tar.gz, as checked by archive_test
+constexpr std::string_view tarball_sri = "sha256-+fkyxNMN3FHC9W+EDow7JXXvGiwIEH4AsseWS7HOIVc=";
+
+std::string read(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return {std::istreambuf_iterator<char>(in), {}};
+}
+
+// One connection at a time on 127.0.0.1. The repository name in the path picks the
+// behaviour: "full" serves the tarball, "short" closes half way through the declared
+// Content-Length, "unframed" closes half way without one, "missing" is a 404, and
+// "flaky" drops the first connection without a response.
+class Server {
+  public:
+    explicit Server(std::string body) : body_(std::move(body)) {
+        fd_ = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (fd_ < 0 || ::bind(fd_, reinterpret_cast<sockaddr*>(&addr), len) != 0 ||
+            ::listen(fd_, 16) != 0 ||
+            ::getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+            throw std::runtime_error("Failed to listen on 127.0.0.1");
+        }
+        url_ = fmt::format("http://127.0.0.1:{}", ntohs(addr.sin_port));
+        thread_ = std::jthread([this](std::stop_token stop) { serve(stop); });
+    }
+
+    ~Server() {
+        thread_.request_stop();
+        thread_.join();
+        ::close(fd_);
+    }
+
+    const std::string& url() const {
+        return url_;
+    }
+
+    size_t requests(const std::string& repo) {
+        std::lock_guard lock(mutex_);
+        return requests_[repo];
+    }
+
+  private:
+    void serve(std::stop_token stop) {
+        while (!stop.stop_requested()) {
+            pollfd pfd{fd_, POLLIN, 0};
+            if (::poll(&pfd, 1, 20) <= 0) {
+                continue;
+            }
+            int client = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                respond(client);
+                ::close(client);
+            }
+        }
+    }
+
+    void respond(int client) {
+        std::string request;
+        char buffer[4096];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = ::read(client, buffer, sizeof(buffer));
+            if (n <= 0) {
+                return;
+            }
+            request.append(buffer, size_t(n));
+        }
+        // GET /<owner>/<repo>/... HTTP/1.1
+        auto path = request.substr(4, request.find(' ', 4) - 4);
+        auto begin = path.find('/', 1) + 1;
+        auto repo = path.substr(begin, path.find('/', begin) - begin);
+        size_t count;
+        {
+            std::lock_guard lock(mutex_);
+            count = ++requests_[repo];
+        }
+
+        std::string_view half = std::string_view(body_).substr(0, body_.size() / 2);
+        if (repo == "full" || (repo == "flaky" && count > 1)) {
+            send(client, fmt::format("HTTP/1.1 200 OK\r\nContent-Length: {}\r\n"
+                                     "Connection: close\r\n\r\n",
+                                     body_.size()) +
+                             body_);
+        } else if (repo == "short") {
+            send(client, fmt::format("HTTP/1.1 200 OK\r\nContent-Length: {}\r\n"
+                                     "Connection: close\r\n\r\n{}",
+                                     body_.size(), half));
+        } else if (repo == "unframed") {
+            send(client, fmt::format("HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n{}", half));
+        } else if (repo != "flaky") {
+            send(client, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n"
+                         "Connection: close\r\n\r\n");
+        }
+    }
+
+    static void send(int client, std::string_view data) {
+        while (!data.empty()) {
+            ssize_t n = ::write(client, data.data(), data.size());
+            if (n <= 0) {
+                return;
+            }
+            data.remove_prefix(size_t(n));
+        }
+    }
+
+    std::string body_;
+    int fd_ = -1;
+    std::string url_;
+    std::mutex mutex_;
+    std::map<std::string, size_t> requests_;
+    std::jthread thread_;
+};
+
+template <typename Fn> bool throws(Fn&& fn) {
+    try {
+        fn();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+void github(Server& server, const fs::path& tmp) {
+    ::setenv("CMAKE2NIX_GITHUB_URL", server.url().c_str(), 1);
+    cache::PrefetchCache cache(tmp / "cache");
+    prefetcher::Options options;
+    options.cache = &cache;
+
+    CHECK_EQ(prefetcher::prefetch_github("owner", "full", "v1.0", options), tarball_sri);
+    CHECK_EQ(server.requests("full"), size_t(1));
+    // Served from the cache the second time
+    CHECK_EQ(prefetcher::prefetch_github("owner", "full", "v1.0", options), tarball_sri);
+    CHECK_EQ(server.requests("full"), size_t(1));
+
+    // A dropped connection is retried with a fresh hasher
+    CHECK_EQ(prefetcher::prefetch_github("owner", "flaky", "v1.0", options), tarball_sri);
+    CHECK_EQ(server.requests("flaky"), size_t(2));
+
+    // curl sees the short body (and retries it); without a Content-Length only the
+    // hasher can tell; a 404 is final. None of them may hash or be cached.
+    for (std::string repo : {"short", "unframed", "missing"}) {
+        CHECK(throws([&] { prefetcher::prefetch_github("owner", repo, "v1.0", options); }));
+        CHECK(!cache.lookup(cache::PrefetchCache::key("fetchFromGitHub", "owner/" + repo,
+                                                      "v1.0")));
+    }
+    CHECK_EQ(server.requests("short"), size_t(3));
+    CHECK_EQ(server.requests("unframed"), size_t(1));
+    CHECK_EQ(server.requests("missing"), size_t(1));
+}
+
+// fetchzip streams .tar.gz URLs the same way
+void zip(Server& server) {
+    CHECK_EQ(prefetcher::prefetch_zip(server.url() + "/owner/full/v1.0.tar.gz"), tarball_sri);
+    CHECK(throws([&] { prefetcher::prefetch_zip(server.url() + "/owner/unframed/v1.0.tar.gz"); }));
+}
+
+} // namespace
+
+int main() {
+    fsutil::TempDir tmp("cmake2nix-prefetcher-test");
+    Server server(read(fixtures / "gnu.tar.gz"));
+    github(server, tmp.path());
+    zip(server);
+    return check::exit_code();
+}